@@ -1,6 +1,9 @@
 #ifndef __INCLUDE_GUARD_BSDIFF_H
 #define __INCLUDE_GUARD_BSDIFF_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 /* encodings */
 enum BSDIFF_ENCODINGS {
 	BSDIFF_ENC_ANY,
@@ -12,8 +15,274 @@ enum BSDIFF_ENCODINGS {
 	BSDIFF_ENC_LAST
 };
 
+/* flags for make_bsdiff_delta_flags() */
+enum BSDIFF_DIFF_FLAGS {
+	/* read the new file with io_uring while the old file is sorted */
+	BSDIFF_DIFF_IO_URING = 1 << 0,
+	/* write the streaming format, which bspatch can apply in one pass
+	 * from a pipe */
+	BSDIFF_DIFF_STREAM = 1 << 1,
+	/* write the streaming format with an index of its frames, for
+	 * bsdiff_ctx_apply_range() */
+	BSDIFF_DIFF_SEEKABLE = 1 << 2,
+	/* write the variable length v3 header */
+	BSDIFF_DIFF_V3 = 1 << 3,
+	/* v3 header with a CRC-32 of each block, which bspatch checks before
+	 * decoding; implies BSDIFF_DIFF_V3 */
+	BSDIFF_DIFF_CHECKSUM = 1 << 4,
+	/* v3 header with a CRC-32 or a SHA-256 of the new file, which bspatch
+	 * checks as it rebuilds the file; each implies BSDIFF_DIFF_V3 */
+	BSDIFF_DIFF_DIGEST = 1 << 5,
+	BSDIFF_DIFF_DIGEST_SHA256 = 1 << 6,
+	/* v3 header with a digest of the whole old file (SHA-256 along with
+	 * BSDIFF_DIFF_DIGEST_SHA256, else CRC-32), or with CRC-32s of a few
+	 * sampled blocks of it, which is cheaper to check for a large file */
+	BSDIFF_DIFF_OLD_DIGEST = 1 << 7,
+	BSDIFF_DIFF_OLD_SAMPLES = 1 << 8,
+	/* diff the new file a segment at a time against the part of the old
+	 * file it resembles most, so that memory is bounded by the window
+	 * rather than the file size; writes a stream (or seekable) delta.
+	 * Always used for files over 512 MiB. */
+	BSDIFF_DIFF_WINDOWED = 1 << 9,
+	/* find matches through a hash table of sampled old file k-grams
+	 * instead of a suffix array: much faster, with somewhat larger
+	 * deltas, which bspatch applies as usual */
+	BSDIFF_DIFF_FAST = 1 << 10,
+	/* after the usual scan, choose where each match starts and ends by
+	 * the estimated size of the whole delta rather than one match at a
+	 * time: slower, for somewhat smaller deltas */
+	BSDIFF_DIFF_OPTIMAL = 1 << 11,
+};
+
+/* flags for apply_bsdiff_delta_flags() */
+enum BSDIFF_APPLY_FLAGS {
+	/* share unchanged block aligned ranges with the old file (reflink or
+	 * copy_file_range) instead of rewriting them */
+	BSDIFF_APPLY_REFLINK = 1 << 0,
+	/* leave long zero runs in the new file as holes */
+	BSDIFF_APPLY_SPARSE = 1 << 1,
+	/* build the new file unnamed (O_TMPFILE) and link it into place only
+	 * once it is complete */
+	BSDIFF_APPLY_ATOMIC = 1 << 2,
+	/* write the new file with io_uring while it is still being built */
+	BSDIFF_APPLY_IO_URING = 1 << 3,
+	/* do not ask the kernel to read ahead the old file ranges that the
+	 * control block says are needed next */
+	BSDIFF_APPLY_NO_READAHEAD = 1 << 4,
+	/* build the new file as NEWFILE.part with checkpoints in
+	 * NEWFILE.ckpt, and pick up from the last checkpoint if both are
+	 * there. A checkpoint taken with another delta is dropped and the
+	 * part file rebuilt, unless the delta comes from a pipe. Only stream
+	 * deltas can be resumed; others are applied as usual. */
+	BSDIFF_APPLY_RESUME = 1 << 5,
+};
+
 /* API definition */
 int make_bsdiff_delta(char *old_filename, char *new_filename, char *delta_filename, int enc);
+int make_bsdiff_delta_flags(char *old_filename, char *new_filename, char *delta_filename,
+			    int enc, unsigned int flags);
 int apply_bsdiff_delta(char *oldfile, char *newfile, char *deltafile);
+int apply_bsdiff_delta_flags(char *oldfile, char *newfile, char *deltafile, unsigned int flags);
+
+/* Reentrant API. A context holds the options, statistics and scratch
+ * buffers for any number of diffs and patches. Contexts share no state, so
+ * separate threads can each drive their own; a single context must not be
+ * used by two threads at once. The scratch buffers grow to fit the largest
+ * files seen and are only released by bsdiff_ctx_free(). */
+typedef struct bsdiff_ctx bsdiff_ctx;
+
+struct bsdiff_stats {
+	uint64_t files;	      /* deltas written */
+	uint64_t newbytes;    /* new file bytes those deltas produce */
+	uint64_t outputbytes; /* delta bytes written */
+	uint64_t none;	      /* blocks per encoding */
+	uint64_t gzip;
+	uint64_t bzip2;
+	uint64_t xz;
+	uint64_t zeros;
+	uint64_t fulldl; /* files left to full download */
+	uint64_t sorted;    /* old file bytes suffix sorted */
+	uint64_t sort_usec; /* time spent sorting them */
+	uint64_t external;  /* sorts done on disk */
+	uint64_t spilled;   /* bytes those wrote to scratch files */
+	uint64_t early;	    /* FULLDL files caught before a full diff */
+	uint64_t coarse;    /* scans that ran out of work and turned coarse */
+	uint64_t timeouts;  /* scans cut short by scan_seconds */
+	uint64_t reparsed;  /* deltas taken from the optimal parse */
+};
+
+bsdiff_ctx *bsdiff_ctx_new(void);
+void bsdiff_ctx_free(bsdiff_ctx *ctx);
+void bsdiff_ctx_set_encoding(bsdiff_ctx *ctx, int enc);
+void bsdiff_ctx_set_diff_flags(bsdiff_ctx *ctx, unsigned int flags);
+void bsdiff_ctx_set_apply_flags(bsdiff_ctx *ctx, unsigned int flags);
+void bsdiff_ctx_get_stats(bsdiff_ctx *ctx, struct bsdiff_stats *stats);
+/* Tuning constants for diffing, with their defaults in brackets. */
+struct bsdiff_tunables {
+	/* a match at a new alignment is taken over the current one when it
+	 * is longer by more than this many bytes [8] */
+	int64_t match_margin;
+	/* a delta bigger than this fraction of the new file is replaced by
+	 * a FULLDL one [0.90] */
+	double fulldl_ratio;
+	/* new files smaller than this are always FULLDL [200] */
+	int64_t fulldl_min_size;
+	/* old and new files both smaller than this may get the small v21
+	 * header; at most 65536 [65536] */
+	int64_t small_max;
+	/* a bzip2 block counts as this many times its size, plus
+	 * bzip2_penalty bytes unless it is all zeros, against the other
+	 * encodings, for its cost to decompress [1.05, 512] */
+	double bzip2_factor;
+	int64_t bzip2_penalty;
+	/* k-grams of the new file looked up in the old one to spot a FULLDL
+	 * pair before sorting, which also lets the scan give up once its
+	 * extra block is too big; 0 turns both off [1024] */
+	int64_t predict_samples;
+	/* bytes the scan may compare per new byte before it starts to skip
+	 * ahead on rejected matches; 0 for no limit [64] */
+	int64_t scan_work;
+	/* seconds after which the scan stops and the rest of the new file
+	 * becomes extra, once per file even when it is diffed in windows; 0
+	 * for no limit [0] */
+	double scan_seconds;
+};
+
+/* Fills t with the defaults. bsdiff_ctx_set_tunables() returns -1, and
+ * changes nothing, if a value is out of range. */
+void bsdiff_tunables_init(struct bsdiff_tunables *t);
+int bsdiff_ctx_set_tunables(bsdiff_ctx *ctx, const struct bsdiff_tunables *t);
+
+/* Effort levels, from BSDIFF_EFFORT_MIN (fastest) to BSDIFF_EFFORT_MAX
+ * (smallest deltas, the default). Levels 1-5 use the fast engine, with a
+ * k-gram step of 32, 16, 8, 8 and 4 bytes; 6-9 sort the old file. Levels
+ * 1-6 cap the scan_work tunable at 8, 8, 16, 16, 32 and 32; match_margin
+ * is left as it is set, since a lower one is not reliably faster. For
+ * BSDIFF_ENC_ANY, the levels try:
+ *	1	gzip -1
+ *	2	gzip -6
+ *	3	gzip -9, xz -1
+ *	4, 6	gzip -9, xz -6
+ *	5, 7	gzip -9, xz -6, bzip2
+ *	8	gzip -9, xz -9, bzip2
+ *	9	gzip -9, xz -9e, bzip2
+ * A named encoding is always tried. Returns -1 for a level out of range. */
+#define BSDIFF_EFFORT_MIN 1
+#define BSDIFF_EFFORT_MAX 9
+int bsdiff_ctx_set_effort(bsdiff_ctx *ctx, int level);
+
+/* When suffix sorting an old file would take more than mem bytes (16 per
+ * byte of the file), build the suffix array in files under dir instead,
+ * using about mem bytes, and search it through a mapping. dir must stay
+ * valid while ctx is in use; NULL means $TMPDIR or /tmp. mem == 0, the
+ * default, always sorts in memory. */
+void bsdiff_ctx_set_sort_memory(bsdiff_ctx *ctx, uint64_t mem, const char *dir);
+int bsdiff_ctx_diff(bsdiff_ctx *ctx, char *old_filename, char *new_filename, char *delta_filename);
+int bsdiff_ctx_apply(bsdiff_ctx *ctx, char *oldfile, char *newfile, char *deltafile);
+
+/* Every apply call returns -3, and leaves no new file behind, when the
+ * delta carries a digest of the new file that the rebuilt data does not
+ * match. It returns -4 when the old file is not the one the delta was
+ * made from: its size is wrong, or it does not match the old file digest
+ * or samples in the delta, which are checked before anything is decoded.
+ *
+ * bsdiff_ctx_verify() rebuilds the new file in memory only, to check the
+ * old file and delta without writing anything; a delta without a digest
+ * verifies if it decodes. */
+int bsdiff_ctx_verify(bsdiff_ctx *ctx, char *oldfile, char *deltafile);
+
+/* In-memory variants. For output, a NULL *delta or *new asks for a buffer
+ * malloc'd to fit, which the caller frees; otherwise it is a caller buffer
+ * whose capacity is passed in *delta_len or *new_len, and the call fails
+ * if it is too small. Either way the length produced is stored back. A diff
+ * records mode 0644 and the caller's uid and gid in the header, and apply
+ * ignores those fields as well as the reflink, sparse, atomic and io_uring
+ * flags. Return values are as for the file variants. */
+int bsdiff_ctx_diff_mem(bsdiff_ctx *ctx, const void *old, size_t old_len,
+			const void *new, size_t new_len,
+			void **delta, size_t *delta_len);
+int bsdiff_ctx_apply_mem(bsdiff_ctx *ctx, const void *old, size_t old_len,
+			 const void *delta, size_t delta_len,
+			 void **new, size_t *new_len);
+
+/* Pluggable I/O. A reader gives random access to old, new or delta data:
+ * read_at() returns the number of bytes read, 0 past the end, or -1, and
+ * size() returns the total length or -1. Apply reads the blocks of a delta
+ * on separate threads, but one apply call never calls read_at() of a
+ * reader other than the built-in ones from two threads at once; calls on
+ * separate contexts are not serialized against each other. map() is an optional hint; if it
+ * returns non-NULL, the whole data is used in place until unmap(), also
+ * optional, is called, and is never passed to madvise(). A writer takes
+ * output through write_at(), which returns the number of bytes written or
+ * -1. close() is called by bsdiff_reader_close() and bsdiff_writer_close(),
+ * and may be NULL. */
+struct bsdiff_reader {
+	void *opaque;
+	int64_t (*read_at)(void *opaque, void *buf, size_t len, uint64_t off);
+	int64_t (*size)(void *opaque);
+	const void *(*map)(void *opaque);
+	void (*unmap)(void *opaque, const void *addr);
+	void (*close)(void *opaque);
+};
+
+struct bsdiff_writer {
+	void *opaque;
+	int64_t (*write_at)(void *opaque, const void *buf, size_t len, uint64_t off);
+	int (*close)(void *opaque);
+};
+
+/* The built-in file backend. The writer creates path, which must not
+ * exist yet. */
+int bsdiff_reader_file(struct bsdiff_reader *r, const char *path);
+int bsdiff_writer_file(struct bsdiff_writer *w, const char *path);
+void bsdiff_reader_close(struct bsdiff_reader *r);
+int bsdiff_writer_close(struct bsdiff_writer *w);
+
+/* Like the _mem() variants, but through readers and writers. */
+int bsdiff_ctx_diff_io(bsdiff_ctx *ctx, struct bsdiff_reader *old,
+		       struct bsdiff_reader *new, struct bsdiff_writer *delta);
+int bsdiff_ctx_apply_io(bsdiff_ctx *ctx, struct bsdiff_reader *old,
+			struct bsdiff_reader *delta, struct bsdiff_writer *new);
+
+/* Batch mode: runs many jobs on a pool of threads, each with its own
+ * context that takes the options of ctx, and adds up their statistics in
+ * ctx. threads == 0 uses one per online CPU. mem_limit bounds the combined
+ * estimated footprint of running jobs, 0 meaning half of physical memory;
+ * a job larger than that still runs, alone. Each job's ret gets what the
+ * single-file call returned, so -2 still marks a FULLDL delta on apply,
+ * and the batch returns -1 if any was < 0. */
+struct bsdiff_job {
+	char *old_filename;
+	char *new_filename;
+	char *delta_filename;
+	int ret;
+};
+
+int bsdiff_ctx_diff_batch(bsdiff_ctx *ctx, struct bsdiff_job *jobs, size_t njobs,
+			  unsigned int threads, uint64_t mem_limit);
+int bsdiff_ctx_apply_batch(bsdiff_ctx *ctx, struct bsdiff_job *jobs, size_t njobs,
+			   unsigned int threads, uint64_t mem_limit);
+
+/* Applies a delta read sequentially from fd, such as a pipe or socket,
+ * which is left open. A streaming delta is applied while it arrives, and
+ * the new file is written as it is produced; any other delta is read into
+ * memory first. Return values are as for bsdiff_ctx_apply(). */
+int bsdiff_ctx_apply_fd(bsdiff_ctx *ctx, char *oldfile, char *newfile, int fd);
+
+/* Rebuilds only bytes [offset, offset + len) of the new file into buf.
+ * With a seekable delta, only the frames covering the range are read and
+ * decoded; any other delta is applied whole in memory first. Returns -1
+ * if the range is not within the new file. */
+int bsdiff_ctx_apply_range(bsdiff_ctx *ctx, struct bsdiff_reader *old,
+			   struct bsdiff_reader *delta, uint64_t offset, void *buf, size_t len);
+
+/* Directory archives: one delta for every file under newdir against the
+ * file of the same name under olddir. bsdiff_ctx_diff() and
+ * bsdiff_ctx_apply() take this path when given directories. On apply,
+ * fulldl (if not NULL) is called with the name of each file that must be
+ * fetched in full, and -2 is returned once the rest of the tree is done. */
+int bsdiff_ctx_diff_dir(bsdiff_ctx *ctx, char *olddir, char *newdir, char *archive);
+int bsdiff_ctx_apply_dir(bsdiff_ctx *ctx, char *olddir, char *newdir, char *archive,
+			 void (*fulldl)(const char *name, void *arg), void *arg);
 
 #endif
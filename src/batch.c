@@ -0,0 +1,443 @@
+/*
+ *   This file is part of bsdiff.
+ *
+ *      Copyright © 2012-2016 Intel Corporation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bsheader.h"
+
+#undef MIN
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#undef MAX
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+
+/* Batch mode runs a list of jobs on a pool of threads, each with its own
+ * context. Jobs are sorted by estimated memory footprint and dealt out
+ * largest first, one deque per worker; a worker whose deque runs dry
+ * steals the smallest job left on another's. Before a job starts, its
+ * footprint is reserved against a memory budget, and the worker waits
+ * while that would overrun it, unless nothing else is running. */
+
+/* Scratch buffers of jobs up to this footprint are kept for the next job
+ * of the worker; larger ones are freed so they stay within the budget. */
+#define BSDIFF_BATCH_KEEP (64 * 1024 * 1024)
+
+typedef struct {
+	pthread_mutex_t lock;
+	size_t *idx;
+	size_t head, tail;
+} cdeque;
+
+typedef struct {
+	struct bsdiff_job *jobs;
+	uint64_t *cost;
+	int (*run)(bsdiff_ctx *, struct bsdiff_job *);
+
+	cdeque *deques;
+	unsigned int nworkers;
+
+	pthread_mutex_t mem_lock;
+	pthread_cond_t mem_cond;
+	uint64_t mem_limit;
+	uint64_t mem_used;
+	unsigned int running;
+} cpool;
+
+typedef struct {
+	cpool *pool;
+	unsigned int id;
+	bsdiff_ctx ctx;
+} cworker;
+
+typedef struct {
+	uint64_t cost;
+	size_t idx;
+} cjob;
+
+static int cmp_cost(const void *a, const void *b)
+{
+	uint64_t ca = ((const cjob *)a)->cost;
+	uint64_t cb = ((const cjob *)b)->cost;
+
+	return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+/* Returns the next job for worker id, or -1 when every deque is empty. */
+static ssize_t take_job(cpool *p, unsigned int id)
+{
+	cdeque *d;
+	ssize_t job = -1;
+	unsigned int i;
+
+	for (i = 0; i < p->nworkers && job < 0; i++) {
+		d = &p->deques[(id + i) % p->nworkers];
+		pthread_mutex_lock(&d->lock);
+		if (d->head < d->tail) {
+			job = i == 0 ? d->idx[d->head++] : d->idx[--d->tail];
+		}
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	return job;
+}
+
+static void admit(cpool *p, uint64_t cost)
+{
+	pthread_mutex_lock(&p->mem_lock);
+	while (p->running > 0 && p->mem_used + cost > p->mem_limit) {
+		pthread_cond_wait(&p->mem_cond, &p->mem_lock);
+	}
+	p->mem_used += cost;
+	p->running++;
+	pthread_mutex_unlock(&p->mem_lock);
+}
+
+static void release(cpool *p, uint64_t cost)
+{
+	pthread_mutex_lock(&p->mem_lock);
+	p->mem_used -= cost;
+	p->running--;
+	pthread_cond_broadcast(&p->mem_cond);
+	pthread_mutex_unlock(&p->mem_lock);
+}
+
+static void *worker(void *arg)
+{
+	cworker *w = arg;
+	cpool *p = w->pool;
+	ssize_t job;
+
+	while ((job = take_job(p, w->id)) >= 0) {
+		admit(p, p->cost[job]);
+		p->jobs[job].ret = p->run(&w->ctx, &p->jobs[job]);
+		if (p->cost[job] > BSDIFF_BATCH_KEEP) {
+			bsdiff_ctx_release(&w->ctx);
+		}
+		release(p, p->cost[job]);
+	}
+
+	return NULL;
+}
+
+static void stats_add(struct bsdiff_stats *to, struct bsdiff_stats *from)
+{
+	to->files += from->files;
+	to->newbytes += from->newbytes;
+	to->outputbytes += from->outputbytes;
+	to->none += from->none;
+	to->gzip += from->gzip;
+	to->bzip2 += from->bzip2;
+	to->xz += from->xz;
+	to->zeros += from->zeros;
+	to->fulldl += from->fulldl;
+	to->sorted += from->sorted;
+	to->sort_usec += from->sort_usec;
+	to->external += from->external;
+	to->spilled += from->spilled;
+	to->early += from->early;
+	to->coarse += from->coarse;
+	to->timeouts += from->timeouts;
+	to->reparsed += from->reparsed;
+}
+
+/* Runs every job through run() with the options of ctx, whose statistics
+ * collect those of all jobs. cost[i] is the footprint of job i. Returns
+ * -1 if the pool could not be set up or any job returned < 0. */
+static int run_batch(bsdiff_ctx *ctx, struct bsdiff_job *jobs, size_t njobs,
+		     uint64_t *cost, unsigned int threads, uint64_t mem_limit,
+		     int (*run)(bsdiff_ctx *, struct bsdiff_job *))
+{
+	cpool p;
+	cworker *w = NULL;
+	pthread_t *tid = NULL;
+	cjob *order = NULL;
+	unsigned int i, started;
+	long pages, pagesize;
+	size_t j;
+	int ret = -1;
+
+	if (njobs == 0) {
+		return 0;
+	}
+	if (threads == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = n > 0 ? n : 1;
+	}
+	if (threads > njobs) {
+		threads = njobs;
+	}
+	if (mem_limit == 0) {
+		pages = sysconf(_SC_PHYS_PAGES);
+		pagesize = sysconf(_SC_PAGESIZE);
+		mem_limit = pages > 0 && pagesize > 0 ? (uint64_t)pages * pagesize / 2 : UINT64_MAX;
+	}
+
+	memset(&p, 0, sizeof(cpool));
+	p.jobs = jobs;
+	p.cost = cost;
+	p.run = run;
+	p.nworkers = threads;
+	p.mem_limit = mem_limit;
+	pthread_mutex_init(&p.mem_lock, NULL);
+	pthread_cond_init(&p.mem_cond, NULL);
+
+	order = malloc(njobs * sizeof(cjob));
+	w = calloc(threads, sizeof(cworker));
+	tid = calloc(threads, sizeof(pthread_t));
+	p.deques = calloc(threads, sizeof(cdeque));
+	if (!order || !w || !tid || !p.deques) {
+		goto out;
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_mutex_init(&p.deques[i].lock, NULL);
+		p.deques[i].idx = malloc((njobs / threads + 1) * sizeof(size_t));
+		if (p.deques[i].idx == NULL) {
+			goto out;
+		}
+	}
+
+	/* largest first, dealt round robin */
+	for (j = 0; j < njobs; j++) {
+		order[j].cost = cost[j];
+		order[j].idx = j;
+	}
+	qsort(order, njobs, sizeof(cjob), cmp_cost);
+	for (j = 0; j < njobs; j++) {
+		cdeque *d = &p.deques[j % threads];
+		d->idx[d->tail++] = order[j].idx;
+	}
+
+	for (i = 0; i < threads; i++) {
+		w[i].pool = &p;
+		w[i].id = i;
+		bsdiff_ctx_init(&w[i].ctx);
+		w[i].ctx.enc = ctx->enc;
+		w[i].ctx.diff_flags = ctx->diff_flags;
+		w[i].ctx.apply_flags = ctx->apply_flags;
+		w[i].ctx.effort = ctx->effort;
+		w[i].ctx.tune = ctx->tune;
+		w[i].ctx.sort_mem = ctx->sort_mem;
+		w[i].ctx.sort_dir = ctx->sort_dir;
+	}
+
+	/* worker 0 is this thread; the deques of workers that fail to
+	 * start are simply stolen by the others */
+	for (started = 1; started < threads; started++) {
+		if (pthread_create(&tid[started], NULL, worker, &w[started]) != 0) {
+			break;
+		}
+	}
+	worker(&w[0]);
+	for (i = 1; i < started; i++) {
+		pthread_join(tid[i], NULL);
+	}
+
+	ret = 0;
+	for (i = 0; i < threads; i++) {
+		stats_add(&ctx->stats, &w[i].ctx.stats);
+		bsdiff_ctx_release(&w[i].ctx);
+	}
+	for (j = 0; j < njobs; j++) {
+		if (jobs[j].ret < 0) {
+			ret = -1;
+		}
+	}
+
+out:
+	if (p.deques) {
+		for (i = 0; i < threads; i++) {
+			free(p.deques[i].idx);
+			pthread_mutex_destroy(&p.deques[i].lock);
+		}
+	}
+	free(p.deques);
+	free(tid);
+	free(w);
+	free(order);
+	pthread_cond_destroy(&p.mem_cond);
+	pthread_mutex_destroy(&p.mem_lock);
+
+	return ret;
+}
+
+static int run_diff(bsdiff_ctx *ctx, struct bsdiff_job *job)
+{
+	return bsdiff_ctx_diff(ctx, job->old_filename, job->new_filename,
+			       job->delta_filename);
+}
+
+int bsdiff_ctx_diff_batch(bsdiff_ctx *ctx, struct bsdiff_job *jobs, size_t njobs,
+			  unsigned int threads, uint64_t mem_limit)
+{
+	struct stat sb;
+	uint64_t *cost;
+	size_t i;
+	int ret;
+
+	if ((cost = calloc(njobs + 1, sizeof(uint64_t))) == NULL) {
+		return -1;
+	}
+	/* the suffix array and its ranks take 16 bytes per old byte; the new
+	 * file and the three blocks built from it about 4 per new byte. An
+	 * external sort stays within its own budget, and the fast engine's
+	 * table takes 2 bytes per old byte. BSDIFF_DIFF_OPTIMAL builds a
+	 * second set of blocks. */
+	for (i = 0; i < njobs; i++) {
+		jobs[i].ret = -1;
+		if (stat(jobs[i].old_filename, &sb) == 0) {
+			if ((ctx->diff_flags & BSDIFF_DIFF_FAST) ||
+			    (ctx->effort && ctx->effort <= BSDIFF_EFFORT_FAST)) {
+				cost[i] += 2 * (uint64_t)sb.st_size;
+			} else {
+				cost[i] += 16 * (uint64_t)sb.st_size;
+			}
+			if (ctx->sort_mem && cost[i] > ctx->sort_mem) {
+				cost[i] = ctx->sort_mem;
+			}
+		}
+		if (stat(jobs[i].new_filename, &sb) == 0) {
+			cost[i] += 4 * (uint64_t)sb.st_size;
+			if (ctx->diff_flags & BSDIFF_DIFF_OPTIMAL) {
+				cost[i] += 3 * (uint64_t)sb.st_size;
+			}
+		}
+	}
+
+	ret = run_batch(ctx, jobs, njobs, cost, threads, mem_limit, run_diff);
+	free(cost);
+
+	return ret;
+}
+
+static int run_apply(bsdiff_ctx *ctx, struct bsdiff_job *job)
+{
+	return bsdiff_ctx_apply(ctx, job->old_filename, job->new_filename,
+				job->delta_filename);
+}
+
+/* The memory applying the delta at off in r takes beyond the mapped old
+ * file, from its header, or 0 if it has none. A v2 or v3 delta builds the
+ * whole new file in memory, a stream one a frame and its blocks at a time.
+ * An archive holds its index and solid stream, and applies one entry after
+ * the other; solid entries are v21 deltas, so at most UINT16_MAX bytes. */
+static uint64_t delta_cost(struct bsdiff_reader *r, uint64_t off, int top)
+{
+	u_char buf[BSDIFF_V30_MAX_HEADER + 16], *index = NULL, *p;
+	struct header_v20 v20;
+	struct header_v21 v21;
+	struct header_v30 v30;
+	struct header_stream stream;
+	struct header_seekable seekable;
+	struct header_dir_v20 dir;
+	struct dir_entry_v20 e;
+	uint64_t size = 0, n, entry, most = 0;
+	int64_t total;
+	uint32_t i;
+
+	if ((total = r->size(r->opaque)) < 0 || (uint64_t)total < off + 8 ||
+	    reader_read(r, buf, 8, off) < 0) {
+		return 0;
+	}
+	n = MIN(sizeof(buf), total - off);
+	if (memcmp(buf, BSDIFF_HDR_MAGIC_V20, 8) == 0 &&
+	    reader_read(r, &v20, sizeof(struct header_v20), off) == 0) {
+		size = v20.new_file_length;
+	} else if (memcmp(buf, BSDIFF_HDR_MAGIC_V21, 8) == 0 &&
+		   reader_read(r, &v21, sizeof(struct header_v21), off) == 0) {
+		size = v21.new_file_length;
+	} else if (memcmp(buf, BSDIFF_HDR_MAGIC_V30, 8) == 0 &&
+		   reader_read(r, buf, n, off) == 0 && header_v30_read(buf, n, &v30) >= 0) {
+		size = v30.new_file_length;
+	} else if (memcmp(buf, BSDIFF_HDR_MAGIC_STREAM, 8) == 0 &&
+		   reader_read(r, &stream, sizeof(struct header_stream), off) == 0) {
+		size = 4 * MIN(stream.new_file_length, (uint64_t)stream.frame_size);
+	} else if (memcmp(buf, BSDIFF_HDR_MAGIC_SEEKABLE, 8) == 0 &&
+		   reader_read(r, &seekable, sizeof(struct header_seekable), off) == 0) {
+		size = 4 * MIN(seekable.new_file_length, (uint64_t)seekable.frame_size);
+	} else if (top && memcmp(buf, BSDIFF_HDR_DIR_V20, 8) == 0 &&
+		   reader_read(r, &dir, sizeof(struct header_dir_v20), off) == 0 &&
+		   dir.offset_to_first_block == sizeof(struct header_dir_v20) &&
+		   (index = dir_block(r, dir.offset_to_first_block, dir.index_length,
+				      dir.index_size, cblock_get_enc(dir.encoding), "index")) != NULL) {
+		p = index;
+		for (i = 0; i < dir.entries; i++) {
+			if ((uint64_t)(index + dir.index_size - p) < sizeof(struct dir_entry_v20)) {
+				break;
+			}
+			memcpy(&e, p, sizeof(struct dir_entry_v20));
+			p += sizeof(struct dir_entry_v20);
+			if ((uint64_t)(index + dir.index_size - p) < e.name_length) {
+				break;
+			}
+			p += e.name_length;
+			entry = 0;
+			if (e.type == BSDIFF_DIR_SOLID) {
+				entry = UINT16_MAX;
+			} else if (e.type == BSDIFF_DIR_DELTA) {
+				entry = delta_cost(r, dir.offset_to_first_block + dir.index_length +
+						   dir.solid_length + e.offset, 0);
+			}
+			most = MAX(most, entry);
+		}
+		size = dir.index_size + dir.solid_size + most;
+	}
+	free(index);
+
+	return size;
+}
+
+int bsdiff_ctx_apply_batch(bsdiff_ctx *ctx, struct bsdiff_job *jobs, size_t njobs,
+			   unsigned int threads, uint64_t mem_limit)
+{
+	struct bsdiff_reader delta;
+	uint64_t *cost;
+	size_t i;
+	int ret;
+
+	if ((cost = calloc(njobs + 1, sizeof(uint64_t))) == NULL) {
+		return -1;
+	}
+	/* the old file is only mapped */
+	for (i = 0; i < njobs; i++) {
+		jobs[i].ret = -1;
+		if (bsdiff_reader_file(&delta, jobs[i].delta_filename) == 0) {
+			cost[i] = delta_cost(&delta, 0, 1);
+			bsdiff_reader_close(&delta);
+		}
+	}
+
+	ret = run_batch(ctx, jobs, njobs, cost, threads, mem_limit, run_apply);
+	free(cost);
+
+	return ret;
+}
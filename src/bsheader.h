@@ -86,6 +86,215 @@ struct header_v21 {
 	enc_flags_t encoding;
 } __attribute__((__packed__));
 
+/***************************************************************
+ * v3 header
+ ***************************************************************/
+
+/* The v3 header is variable length: after the magic, the number of header
+ * bytes that follow, then the fields as LEB128 varints, so a small file
+ * pays for small numbers only. Blocks carry encoding IDs from enum
+ * BSDIFF_ENCODINGS rather than enc_flags_t bits. Each bit in features adds
+ * a group of fields after the block table, in bit order; a reader refuses
+ * bits it does not know, and skips any header bytes past the fields it
+ * does know. The same control, diff and extra blocks as v2 follow.
+ *
+ *	magic[8] header_length features
+ *	old_file_length new_file_length file_mode file_owner file_group
+ *	3 x (encoding:u8 length)
+ *	[BSDIFF_V30_BLOCK_CRC: 3 x crc32:le32 of the stored blocks]
+ *	[BSDIFF_V30_NEW_DIGEST: digest_alg:u8 digest of the new file]
+ *	[BSDIFF_V30_OLD_DIGEST: digest_alg:u8 digest of the old file]
+ *	[BSDIFF_V30_OLD_SAMPLES: sample_size sample_count
+ *		sample_count x crc32:le32 of old file blocks, see old_sample()]
+ */
+#define BSDIFF_HDR_MAGIC_V30 "BSDIFF4W"
+
+enum BSDIFF_V30_FEATURES {
+	BSDIFF_V30_BLOCK_CRC = 1 << 0,
+	BSDIFF_V30_NEW_DIGEST = 1 << 1,
+	BSDIFF_V30_OLD_DIGEST = 1 << 2,
+	BSDIFF_V30_OLD_SAMPLES = 1 << 3,
+};
+#define BSDIFF_V30_FEATURES_KNOWN (BSDIFF_V30_BLOCK_CRC | BSDIFF_V30_NEW_DIGEST | \
+				   BSDIFF_V30_OLD_DIGEST | BSDIFF_V30_OLD_SAMPLES)
+
+/* digests of the new file; the size of each is given by digest_size() */
+enum BSDIFF_DIGESTS {
+	BSDIFF_DIGEST_CRC32 = 1,
+	BSDIFF_DIGEST_SHA256 = 2,
+	BSDIFF_DIGEST_LAST
+};
+#define BSDIFF_DIGEST_MAX 32
+
+/* digest.c: incremental hashing for any of BSDIFF_DIGESTS */
+typedef struct {
+	int alg;
+	uint32_t crc;
+	uint32_t h[8];
+	uint64_t total;
+	u_char buf[64];
+	size_t used;
+} digest_ctx;
+
+size_t digest_size(int alg);
+void digest_init(digest_ctx *d, int alg);
+void digest_update(digest_ctx *d, const void *data, size_t len);
+void digest_final(digest_ctx *d, u_char *out);
+
+/* Sampled old file blocks: sample i of count covers sample_size bytes (or
+ * what is left of the file) from offset (size / count) * i. bsdiff writes
+ * BSDIFF_OLD_SAMPLES of BSDIFF_OLD_SAMPLE_SIZE bytes, fewer for a small
+ * file; a reader takes up to BSDIFF_V30_MAX_SAMPLES. */
+#define BSDIFF_OLD_SAMPLES 64
+#define BSDIFF_OLD_SAMPLE_SIZE 4096
+#define BSDIFF_V30_MAX_SAMPLES 256
+
+uint32_t old_sample(const u_char *old, uint64_t size, uint64_t sample_size,
+		    uint32_t count, uint32_t i);
+
+/* the largest header_length a reader takes */
+#define BSDIFF_V30_MAX_HEADER 4096
+
+struct header_v30 {
+	uint64_t offset_to_first_block; /* computed, not stored */
+	uint64_t features;
+	uint64_t old_file_length;
+	uint64_t new_file_length;
+	uint32_t file_mode;
+	uint32_t file_owner;
+	uint32_t file_group;
+	uint8_t encoding[3]; /* by enum BSDIFF_BLOCKS */
+	uint64_t length[3];
+	uint32_t crc[3];
+	uint8_t digest_alg; /* enum BSDIFF_DIGESTS */
+	u_char new_digest[BSDIFF_DIGEST_MAX];
+	uint8_t old_digest_alg;
+	u_char old_digest[BSDIFF_DIGEST_MAX];
+	uint64_t sample_size;
+	uint32_t sample_count;
+	uint32_t samples[BSDIFF_V30_MAX_SAMPLES];
+};
+
+/* header.c: header_v30_write() needs BSDIFF_V30_MAX_HEADER bytes at buf and
+ * returns the header size; header_v30_read() parses the len bytes at buf,
+ * which must hold the whole header, and returns the header size or -1. */
+size_t header_v30_write(u_char *buf, struct header_v30 *h);
+int header_v30_read(const u_char *buf, size_t len, struct header_v30 *h);
+
+/* streaming: control, diff and extra data interleaved in frames that each
+ * produce at most frame_size bytes of the new file, so a delta can be
+ * applied in one pass as it is read from a pipe. Each frame is a struct
+ * frame_stream followed by its three blocks; the frames follow each other
+ * until they have produced new_file_length bytes. */
+#define BSDIFF_HDR_MAGIC_STREAM "BSDIFF4S"
+struct header_stream {
+	unsigned char magic[8];
+	uint8_t offset_to_first_block; /* ~= header length */
+	uint32_t frame_size;
+	uint64_t old_file_length;
+	uint64_t new_file_length;
+	uint32_t file_mode;
+	uint32_t file_owner;
+	uint32_t file_group;
+} __attribute__((__packed__));
+
+struct frame_stream {
+	uint32_t tuples; /* control tuples, at most frame_size / 24 (or 1) */
+	uint32_t control_length;
+	uint32_t diff_length;
+	uint32_t extra_length;
+
+	enc_flags_t encoding;
+} __attribute__((__packed__));
+
+/* seekable: a stream delta with an index of its frames between the header
+ * and the first frame. Each entry records where a frame starts in the
+ * delta, counted from the first frame, and the new and old file positions
+ * at which it starts, so any range of the new file can be rebuilt from the
+ * frames that cover it. */
+#define BSDIFF_HDR_MAGIC_SEEKABLE "BSDIFF4X"
+struct header_seekable {
+	unsigned char magic[8];
+	uint8_t offset_to_first_block; /* of the index */
+	uint32_t frame_size;
+	uint32_t entries;
+	uint64_t old_file_length;
+	uint64_t new_file_length;
+	uint32_t file_mode;
+	uint32_t file_owner;
+	uint32_t file_group;
+} __attribute__((__packed__));
+
+struct stream_index_entry {
+	uint64_t offset;
+	uint64_t new_pos;
+	uint64_t old_pos;
+} __attribute__((__packed__));
+
+/* frame_size that bsdiff writes, and the largest bspatch accepts */
+#define BSDIFF_STREAM_FRAME (1024 * 1024)
+#define BSDIFF_STREAM_MAX_FRAME (64 * 1024 * 1024)
+
+/* resumable apply of a stream delta: NEWFILE is built as NEWFILE.part and
+ * NEWFILE.ckpt records how far it got, at a frame boundary. The delta is
+ * identified by the CRC-32 of its header and of every byte up to the next
+ * frame, and the part file by the CRC-32 of its first new_pos bytes. */
+#define BSDIFF_CKPT_MAGIC "BSDIFFCK"
+
+struct stream_checkpoint {
+	uint8_t magic[8];
+	uint32_t header_crc;
+	uint32_t delta_crc;
+	uint32_t output_crc;
+	uint64_t frames;       /* frames applied */
+	uint64_t delta_offset; /* of the next frame, from the first one */
+	int64_t new_pos;
+	int64_t old_pos;
+} __attribute__((__packed__));
+
+/* new file bytes between checkpoints; one is also taken when the delta
+ * ends early */
+#define BSDIFF_CKPT_INTERVAL (64 * 1024 * 1024)
+
+/* directory archive: the deltas of a whole tree behind one header. The
+ * header is followed by the index (cblk encoding), the solid stream (dblk
+ * encoding) and the data area. Each index entry is a struct dir_entry_v20
+ * and its name. Small v21 deltas are stored with raw blocks, one after the
+ * other in the solid stream, so that they are compressed together; all
+ * other deltas are stored as they are in the data area. */
+struct header_dir_v20 {
+	unsigned char magic[8];
+	uint8_t offset_to_first_block; /* ~= header length */
+	uint32_t entries;
+	uint64_t index_length; /* compressed */
+	uint64_t index_size;   /* uncompressed */
+	uint64_t solid_length; /* compressed */
+	uint64_t solid_size;   /* uncompressed */
+	uint64_t data_length;
+	uint32_t file_mode; /* of the top directory */
+	uint32_t file_owner;
+	uint32_t file_group;
+
+	enc_flags_t encoding;
+} __attribute__((__packed__));
+
+enum BSDIFF_DIR_ENTRIES {
+	BSDIFF_DIR_DELTA, /* a delta in the data area */
+	BSDIFF_DIR_SOLID, /* a delta in the solid stream */
+	BSDIFF_DIR_FULLDL,
+	BSDIFF_DIR_DIR
+};
+
+struct dir_entry_v20 {
+	uint8_t type;
+	uint16_t name_length; /* name follows, not NUL terminated */
+	uint32_t file_mode;
+	uint32_t file_owner;
+	uint32_t file_group;
+	uint64_t offset; /* of the delta in the solid stream or data area */
+	uint64_t length;
+} __attribute__((__packed__));
+
 static inline void cblock_set_enc(enc_flags_t *enc, int method)
 {
 	if (method == BSDIFF_ENC_NONE) {
@@ -179,5 +388,93 @@ static inline int eblock_get_enc(enc_flags_t enc)
 }
 
 int qsufsort(int64_t *, int64_t *, u_char *, int64_t);
+int64_t *ext_sufsort(u_char *old, int64_t old_size, const char *dir, size_t mem,
+		     uint64_t *spilled);
+
+/* A run of new bytes, start to end, that matches the old file at the same
+ * position plus offset, as found by the scan; opt_parse() reads them in
+ * order of start. */
+typedef struct {
+	int64_t start;
+	int64_t end;
+	int64_t offset;
+} chint;
+
+typedef struct {
+	chint *v;
+	size_t len;
+	size_t cap;
+} chints;
+
+int opt_parse(u_char *old, int64_t old_size, u_char *new, int64_t new_size,
+	      const chints *hints, u_char *cb, uint64_t *cblen, u_char *db,
+	      uint64_t *dblen, u_char *eb, uint64_t *eblen, uint64_t *cost);
+uint64_t parse_cost(uint64_t cblen, u_char *db, uint64_t dblen, uint64_t eblen);
+
+/* the highest effort level that uses the fast engine (diff.c) */
+#define BSDIFF_EFFORT_FAST 5
+
+/* the most k-grams the early FULLDL check may sample (diff.c) */
+#define BSDIFF_PREDICT_MAX (1 << 20)
+
+/* scratch buffers a context keeps between calls */
+enum BSDIFF_BUFS {
+	BSDIFF_BUF_I,	/* suffix array */
+	BSDIFF_BUF_V,	/* suffix sort ranks */
+	BSDIFF_BUF_NEW, /* new file contents */
+	BSDIFF_BUF_OLD, /* old file contents, when a reader can't map them */
+	BSDIFF_BUF_LAST
+};
+
+struct bsdiff_ctx {
+	int enc;
+	unsigned int diff_flags;
+	unsigned int apply_flags;
+	int effort; /* 0 for BSDIFF_EFFORT_MAX */
+	struct bsdiff_tunables tune;
+	struct bsdiff_stats stats;
+
+	void *buf[BSDIFF_BUF_LAST];
+	size_t buf_len[BSDIFF_BUF_LAST];
+
+	/* external suffix sorting, and the last suffix array it mapped */
+	uint64_t sort_mem;
+	const char *sort_dir;
+	int64_t *sa_map;
+	size_t sa_map_len;
+};
+
+/* for contexts that live on the stack (ctx.c) */
+void bsdiff_ctx_init(bsdiff_ctx *ctx);
+void bsdiff_ctx_release(bsdiff_ctx *ctx);
+void *ctx_buf(bsdiff_ctx *ctx, int which, size_t len);
+
+/* reader and writer helpers (io.c) */
+typedef struct {
+	const u_char *buf;
+	size_t len;
+} memio;
+
+void reader_mem(struct bsdiff_reader *r, memio *mio, const void *buf, size_t len);
+int reader_read(struct bsdiff_reader *r, void *buf, size_t len, uint64_t off);
+int writer_write(struct bsdiff_writer *w, const void *buf, size_t len, uint64_t off);
+u_char *reader_load(bsdiff_ctx *ctx, int which, struct bsdiff_reader *r,
+		    int64_t size, int *mapped);
+void reader_unload(struct bsdiff_reader *r, u_char *data, int mapped);
+int reader_builtin(struct bsdiff_reader *r);
+int reader_own_map(struct bsdiff_reader *r);
+
+/* decodes an archive's index or solid stream into a new buffer (patch.c) */
+u_char *dir_block(struct bsdiff_reader *ar, off_t off, uint64_t length,
+		  uint64_t size, int method, const char *tag);
+
+/* asynchronous file I/O (bsio.c); bsio_open() returns NULL when io_uring is
+ * unavailable, and buf, if given, is registered with the kernel */
+typedef struct bsio bsio;
+bsio *bsio_open(void *buf, size_t len);
+int bsio_read(bsio *io, int fd, void *buf, size_t len, off_t off);
+int bsio_write(bsio *io, int fd, void *buf, size_t len, off_t off);
+int bsio_wait(bsio *io);
+void bsio_close(bsio *io);
 
 #endif
@@ -0,0 +1,329 @@
+/*
+ *   This file is part of bsdiff.
+ *
+ *      Copyright © 2012-2016 Intel Corporation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef BSDIFF_WITH_URING
+#include <liburing.h>
+#endif
+
+#include "bsheader.h"
+
+/* bsio is an asynchronous file I/O engine built on io_uring. Reads and
+ * writes are queued in chunks and complete while the caller keeps computing;
+ * bsio_wait() collects them. When bsdiff is built without liburing, or the
+ * kernel refuses to set up a ring, bsio_open() returns NULL and callers use
+ * their plain blocking I/O instead. */
+
+#ifdef BSDIFF_WITH_URING
+
+/* submission queue depth, and the largest single read or write queued */
+#define BSIO_DEPTH 32
+#define BSIO_CHUNK (1024 * 1024)
+
+struct bsio {
+	struct io_uring ring;
+	/* the one registered buffer, if registration succeeded */
+	u_char *fixed;
+	size_t fixed_len;
+	/* requests queued but not yet taken by the kernel, oldest first */
+	struct bsio_req *pending[BSIO_DEPTH];
+	unsigned npending;
+	unsigned inflight;
+	int err;
+	/* a submit failed; the ring is not used again */
+	int failed;
+};
+
+struct bsio_req {
+	int fd;
+	int write;
+	u_char *buf;
+	size_t len;
+	off_t off;
+};
+
+bsio *bsio_open(void *buf, size_t len)
+{
+	struct iovec iov;
+	bsio *io;
+
+	if ((io = calloc(1, sizeof(bsio))) == NULL) {
+		return NULL;
+	}
+	if (io_uring_queue_init(BSIO_DEPTH, &io->ring, 0) < 0) {
+		free(io);
+		return NULL;
+	}
+
+	/* Registering pins the pages, which RLIMIT_MEMLOCK may forbid for
+	 * large buffers; unregistered requests work the same, only slower. */
+	if (buf && len > 0) {
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		if (io_uring_register_buffers(&io->ring, &iov, 1) == 0) {
+			io->fixed = buf;
+			io->fixed_len = len;
+		}
+	}
+
+	return io;
+}
+
+/* Hands the queued requests to the kernel. If that fails, or it takes none
+ * with nothing in flight, the entries stay in the ring, so it is never
+ * submitted again and their requests are dropped: only what the kernel took
+ * is waited for, and the caller redoes the transfer with plain I/O. */
+static int bsio_submit(bsio *io)
+{
+	int n;
+
+	if (io->failed) {
+		io->err = 1;
+		return -1;
+	}
+	if (io->npending == 0) {
+		return 0;
+	}
+	n = io_uring_submit(&io->ring);
+	if (n < 0 || (n == 0 && io->inflight == 0)) {
+		io->err = 1;
+		io->failed = 1;
+		while (io->npending > 0) {
+			free(io->pending[--io->npending]);
+		}
+		return -1;
+	}
+	/* the kernel takes entries in order; the rest go with the next call */
+	if ((unsigned)n > io->npending) {
+		n = io->npending;
+	}
+	io->inflight += n;
+	io->npending -= n;
+	memmove(io->pending, io->pending + n, io->npending * sizeof(io->pending[0]));
+
+	return 0;
+}
+
+static int bsio_queue(bsio *io, struct bsio_req *r);
+
+/* Queues the rest of a request again. The caller may be waiting for the
+ * last completion, so the new entry has to reach the kernel now. */
+static void bsio_requeue(bsio *io, struct bsio_req *r)
+{
+	if (bsio_queue(io, r) == 0) {
+		(void)bsio_submit(io);
+	}
+}
+
+/* Waits for one completion. Short transfers are queued again for the rest. */
+static int bsio_reap(bsio *io)
+{
+	struct io_uring_cqe *cqe;
+	struct bsio_req *r;
+	int res;
+
+	if (io_uring_wait_cqe(&io->ring, &cqe) < 0) {
+		io->err = 1;
+		return -1;
+	}
+	r = io_uring_cqe_get_data(cqe);
+	res = cqe->res;
+	io_uring_cqe_seen(&io->ring, cqe);
+	io->inflight--;
+
+#ifdef BSIO_TEST_SHORT
+	/* test builds cut every transfer short to drive the re-queue below */
+	if (res > BSIO_TEST_SHORT) {
+		res = BSIO_TEST_SHORT;
+	}
+#endif
+	if (res == -EINTR || res == -EAGAIN) {
+		bsio_requeue(io, r);
+		return 0;
+	}
+	if (res <= 0) {
+		io->err = 1;
+		free(r);
+		return 0;
+	}
+	if ((size_t)res < r->len) {
+		r->buf += res;
+		r->len -= res;
+		r->off += res;
+		bsio_requeue(io, r);
+		return 0;
+	}
+	free(r);
+	return 0;
+}
+
+static int bsio_queue(bsio *io, struct bsio_req *r)
+{
+	struct io_uring_sqe *sqe;
+	int fixed;
+
+	if (io->failed) {
+		io->err = 1;
+		free(r);
+		return -1;
+	}
+	/* a full ring is made room in by waiting for what the kernel has */
+	while ((sqe = io_uring_get_sqe(&io->ring)) == NULL) {
+		if (bsio_submit(io) < 0 || bsio_reap(io) < 0 || io->failed) {
+			io->err = 1;
+			free(r);
+			return -1;
+		}
+	}
+
+	fixed = io->fixed && r->buf >= io->fixed &&
+		r->buf + r->len <= io->fixed + io->fixed_len;
+	if (r->write && fixed) {
+		io_uring_prep_write_fixed(sqe, r->fd, r->buf, r->len, r->off, 0);
+	} else if (r->write) {
+		io_uring_prep_write(sqe, r->fd, r->buf, r->len, r->off);
+	} else if (fixed) {
+		io_uring_prep_read_fixed(sqe, r->fd, r->buf, r->len, r->off, 0);
+	} else {
+		io_uring_prep_read(sqe, r->fd, r->buf, r->len, r->off);
+	}
+	io_uring_sqe_set_data(sqe, r);
+	io->pending[io->npending++] = r;
+
+	return 0;
+}
+
+static int bsio_rw(bsio *io, int fd, int write, void *buf, size_t len, off_t off)
+{
+	struct bsio_req *r;
+	size_t n;
+
+	while (len > 0) {
+		n = len < BSIO_CHUNK ? len : BSIO_CHUNK;
+		if ((r = malloc(sizeof(struct bsio_req))) == NULL) {
+			io->err = 1;
+			return -1;
+		}
+		r->fd = fd;
+		r->write = write;
+		r->buf = buf;
+		r->len = n;
+		r->off = off;
+		if (bsio_queue(io, r) < 0) {
+			return -1;
+		}
+		buf = (u_char *)buf + n;
+		len -= n;
+		off += n;
+	}
+
+	return bsio_submit(io);
+}
+
+int bsio_wait(bsio *io)
+{
+	int err;
+
+	/* the kernel may take fewer entries than are queued, so submit
+	 * again after each completion */
+	for (;;) {
+		(void)bsio_submit(io);
+		if (io->inflight == 0 || bsio_reap(io) < 0) {
+			break;
+		}
+	}
+	err = io->err;
+	io->err = 0;
+
+	return err ? -1 : 0;
+}
+
+void bsio_close(bsio *io)
+{
+	if (io == NULL) {
+		return;
+	}
+	/* requests in flight still point into caller memory */
+	(void)bsio_wait(io);
+	if (io->fixed) {
+		io_uring_unregister_buffers(&io->ring);
+	}
+	io_uring_queue_exit(&io->ring);
+	free(io);
+}
+
+#else /* BSDIFF_WITHOUT_URING */
+
+struct bsio {
+	int unused;
+};
+
+bsio *bsio_open(__attribute__((unused)) void *buf,
+		__attribute__((unused)) size_t len)
+{
+	return NULL;
+}
+
+static int bsio_rw(__attribute__((unused)) bsio *io,
+		   __attribute__((unused)) int fd,
+		   __attribute__((unused)) int write,
+		   __attribute__((unused)) void *buf,
+		   __attribute__((unused)) size_t len,
+		   __attribute__((unused)) off_t off)
+{
+	return -1;
+}
+
+int bsio_wait(__attribute__((unused)) bsio *io)
+{
+	return -1;
+}
+
+void bsio_close(__attribute__((unused)) bsio *io)
+{
+}
+
+#endif /* BSDIFF_WITH_URING */
+
+int bsio_read(bsio *io, int fd, void *buf, size_t len, off_t off)
+{
+	return bsio_rw(io, fd, 0, buf, len, off);
+}
+
+int bsio_write(bsio *io, int fd, void *buf, size_t len, off_t off)
+{
+	return bsio_rw(io, fd, 1, buf, len, off);
+}
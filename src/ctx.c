@@ -0,0 +1,163 @@
+/*
+ *   This file is part of bsdiff.
+ *
+ *      Copyright © 2012-2016 Intel Corporation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "bsheader.h"
+
+void bsdiff_ctx_init(bsdiff_ctx *ctx)
+{
+	memset(ctx, 0, sizeof(bsdiff_ctx));
+	ctx->enc = BSDIFF_ENC_ANY;
+	bsdiff_tunables_init(&ctx->tune);
+}
+
+void bsdiff_ctx_release(bsdiff_ctx *ctx)
+{
+	int i;
+
+	for (i = 0; i < BSDIFF_BUF_LAST; i++) {
+		free(ctx->buf[i]);
+		ctx->buf[i] = NULL;
+		ctx->buf_len[i] = 0;
+	}
+	if (ctx->sa_map) {
+		munmap(ctx->sa_map, ctx->sa_map_len);
+		ctx->sa_map = NULL;
+	}
+}
+
+/* Returns scratch buffer WHICH with room for at least len bytes. The old
+ * contents are not preserved when it has to grow. */
+void *ctx_buf(bsdiff_ctx *ctx, int which, size_t len)
+{
+	void *buf;
+
+	if (len == 0) {
+		len = 1;
+	}
+	if (ctx->buf_len[which] >= len) {
+		return ctx->buf[which];
+	}
+	if ((buf = malloc(len)) == NULL) {
+		return NULL;
+	}
+	free(ctx->buf[which]);
+	ctx->buf[which] = buf;
+	ctx->buf_len[which] = len;
+
+	return buf;
+}
+
+bsdiff_ctx *bsdiff_ctx_new(void)
+{
+	bsdiff_ctx *ctx;
+
+	if ((ctx = malloc(sizeof(bsdiff_ctx))) == NULL) {
+		return NULL;
+	}
+	bsdiff_ctx_init(ctx);
+
+	return ctx;
+}
+
+void bsdiff_ctx_free(bsdiff_ctx *ctx)
+{
+	if (ctx == NULL) {
+		return;
+	}
+	bsdiff_ctx_release(ctx);
+	free(ctx);
+}
+
+void bsdiff_ctx_set_encoding(bsdiff_ctx *ctx, int enc)
+{
+	ctx->enc = enc;
+}
+
+void bsdiff_ctx_set_diff_flags(bsdiff_ctx *ctx, unsigned int flags)
+{
+	ctx->diff_flags = flags;
+}
+
+void bsdiff_ctx_set_apply_flags(bsdiff_ctx *ctx, unsigned int flags)
+{
+	ctx->apply_flags = flags;
+}
+
+void bsdiff_tunables_init(struct bsdiff_tunables *t)
+{
+	t->match_margin = 8;
+	t->fulldl_ratio = 0.90;
+	t->fulldl_min_size = 200;
+	t->small_max = 65536;
+	t->bzip2_factor = 1.05;
+	t->bzip2_penalty = 512;
+	t->predict_samples = 1024;
+	t->scan_work = 64;
+	t->scan_seconds = 0;
+}
+
+int bsdiff_ctx_set_tunables(bsdiff_ctx *ctx, const struct bsdiff_tunables *t)
+{
+	/* an empty new file must stay FULLDL, and v21 lengths are 16 bits */
+	if (t->match_margin < 0 || t->fulldl_ratio < 0 || t->fulldl_min_size < 1 ||
+	    t->small_max < 0 || t->small_max > 65536 || t->bzip2_factor < 0 ||
+	    t->bzip2_penalty < 0 || t->predict_samples < 0 ||
+	    t->predict_samples > BSDIFF_PREDICT_MAX || t->scan_work < 0 ||
+	    t->scan_seconds < 0) {
+		return -1;
+	}
+	ctx->tune = *t;
+
+	return 0;
+}
+
+int bsdiff_ctx_set_effort(bsdiff_ctx *ctx, int level)
+{
+	if (level < BSDIFF_EFFORT_MIN || level > BSDIFF_EFFORT_MAX) {
+		return -1;
+	}
+	ctx->effort = level;
+
+	return 0;
+}
+
+void bsdiff_ctx_set_sort_memory(bsdiff_ctx *ctx, uint64_t mem, const char *dir)
+{
+	ctx->sort_mem = mem;
+	ctx->sort_dir = dir;
+}
+
+void bsdiff_ctx_get_stats(bsdiff_ctx *ctx, struct bsdiff_stats *stats)
+{
+	*stats = ctx->stats;
+}
@@ -44,9 +44,9 @@ __FBSDID
 #endif
 
 #include <assert.h>
+#include <dirent.h>
 #include <endian.h>
 #include <grp.h>
-#include <pthread.h>
 #include <pwd.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -55,31 +55,33 @@ __FBSDID
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <zlib.h>
 
 #include "bsheader.h"
 
-static int bsdiff_files;
-static uint64_t bsdiff_newbytes;
-static uint64_t bsdiff_outputbytes;
-static int bsdiff_gzip;
-static int bsdiff_bzip2;
-static int bsdiff_xz;
-static int bsdiff_none;
-static int bsdiff_zeros;
-static int bsdiff_fulldl;
-
 /* TODO: oh dear, another MIN that multiple evaluates....  */
 #undef MIN
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#undef MAX
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
 
 static int64_t matchlen(u_char *old, int64_t old_size, u_char *new,
 			int64_t new_size)
 {
-	int64_t i;
-
-	for (i = 0; (i < old_size) && (i < new_size); i++) {
+	int64_t i, n = MIN(old_size, new_size);
+	uint64_t a, b;
+
+	/* a word at a time up to the word that differs */
+	for (i = 0; i + 8 <= n; i += 8) {
+		memcpy(&a, old + i, 8);
+		memcpy(&b, new + i, 8);
+		if (a != b) {
+			break;
+		}
+	}
+	for (; i < n; i++) {
 		if (old[i] != new[i]) {
 			break;
 		}
@@ -145,11 +147,136 @@ static void search(int64_t *I, u_char *old, int64_t old_size,
 	}
 }
 
+/* The fast engine indexes only every step'th k-gram of the old file, so
+ * any match of at least BSDIFF_FAST_K + step - 1 bytes contains an indexed
+ * k-gram within its first step positions. */
+#define BSDIFF_FAST_K 16
+#define BSDIFF_FAST_STEP 8
+
+/* An index of the old file for diff_core() to find matches in: its suffix
+ * array, or with BSDIFF_DIFF_FAST a table of the first old position seen
+ * for each k-gram hash. */
+typedef struct {
+	int64_t *I;
+	int64_t *table;
+	int shift;
+	int step;
+} cindex;
+
+/* Effort levels: the match engine, the fast engine's k-gram step, a cap on
+ * tune.scan_work (0 for none), and the compressors make_small() tries for
+ * BSDIFF_ENC_ANY, with their presets. An encoding asked for by name is
+ * always tried. Level 9 is the default. */
+typedef struct {
+	int fast;
+	int step;
+	int64_t work;
+	unsigned int trials;
+	int gzip;
+	int xz;
+	int xz_extreme;
+	int bzip2;
+} ceffort;
+
+#define TRY(enc) (1 << (enc))
+#define TRY_ALL (TRY(BSDIFF_ENC_GZIP) | TRY(BSDIFF_ENC_XZ) | TRY(BSDIFF_ENC_BZIP2))
+
+static const ceffort efforts[] = {
+	[1] = { 1, 32, 8, TRY(BSDIFF_ENC_GZIP), 1, 0, 0, 9 },
+	[2] = { 1, 16, 8, TRY(BSDIFF_ENC_GZIP), 6, 0, 0, 9 },
+	[3] = { 1, 8, 16, TRY(BSDIFF_ENC_GZIP) | TRY(BSDIFF_ENC_XZ), 9, 1, 0, 9 },
+	[4] = { 1, 8, 16, TRY(BSDIFF_ENC_GZIP) | TRY(BSDIFF_ENC_XZ), 9, 6, 0, 9 },
+	[5] = { 1, 4, 32, TRY_ALL, 9, 6, 0, 9 },
+	[6] = { 0, 0, 32, TRY(BSDIFF_ENC_GZIP) | TRY(BSDIFF_ENC_XZ), 9, 6, 0, 9 },
+	[7] = { 0, 0, 0, TRY_ALL, 9, 6, 0, 9 },
+	[8] = { 0, 0, 0, TRY_ALL, 9, 9, 0, 9 },
+	[9] = { 0, 0, 0, TRY_ALL, 9, 9, 1, 9 },
+};
+
+static const ceffort *ctx_effort(bsdiff_ctx *ctx)
+{
+	return &efforts[ctx->effort ? ctx->effort : BSDIFF_EFFORT_MAX];
+}
+
+/* Whether make_small() should compress with enc when asked for want. */
+static int try_enc(const ceffort *e, int want, int enc)
+{
+	return want == enc || (want == BSDIFF_ENC_ANY && (e->trials & TRY(enc)));
+}
+
+static uint64_t kgram_hash(u_char *p)
+{
+	uint64_t a, b;
+
+	memcpy(&a, p, 8);
+	memcpy(&b, p + 8, 8);
+	return ((a * 0x9e3779b97f4a7c15ULL) ^ b) * 0xc2b2ae3d27d4eb4fULL;
+}
+
+/* The table has a power of two slots, at least two per indexed k-gram. */
+static size_t fast_slots(int64_t old_size, int step)
+{
+	size_t slots = 1024;
+
+	while (slots < 2 * (uint64_t)old_size / step) {
+		slots *= 2;
+	}
+	return slots;
+}
+
+static void fast_index(cindex *ix, size_t slots, u_char *old, int64_t old_size)
+{
+	size_t h;
+	int64_t q;
+
+	for (h = 0; h < slots; h++) {
+		ix->table[h] = -1;
+	}
+	for (ix->shift = 64; slots > 1; slots /= 2) {
+		ix->shift--;
+	}
+	for (q = 0; q + BSDIFF_FAST_K <= old_size; q += ix->step) {
+		h = kgram_hash(old + q) >> ix->shift;
+		if (ix->table[h] < 0) {
+			ix->table[h] = q;
+		}
+	}
+}
+
+/* The counterpart of search() for the fast engine: tries the indexed
+ * k-gram each of the next step positions of new may anchor,
+ * and keeps the longest match that starts at new. */
+static void fast_search(cindex *ix, u_char *old, int64_t old_size,
+			u_char *new, int64_t new_size,
+			int64_t *old_pos, int64_t *max_len)
+{
+	int64_t j, q, len;
+
+	*old_pos = 0;
+	*max_len = 0;
+	for (j = 0; j < ix->step && j + BSDIFF_FAST_K <= new_size; j++) {
+		q = ix->table[kgram_hash(new + j) >> ix->shift];
+		if (q < j) {
+			continue;
+		}
+		len = matchlen(old + q - j, old_size - (q - j), new, new_size);
+		if (len > *max_len) {
+			*max_len = len;
+			*old_pos = q - j;
+		}
+	}
+}
+
 static inline void offtout(int64_t x, u_char *buf)
 {
 	*((int64_t *)buf) = htole64(x);
 }
 
+static inline int64_t offtin(u_char *buf)
+{
+	return le64toh(*((int64_t *)buf));
+}
+
 /* zlib provides compress2, which deflates to deflate (zlib) format. This is
  * unfortunately distinct from gzip format in that the headers wrapping the
  * decompressed data are different. gbspatch reads gzip-compressed data using
@@ -195,10 +322,6 @@ static int compress2gzip(Bytef *dest, size_t *destLen,
 	return err;
 }
 
-#ifdef BSDIFF_WITH_LZMA
-static pthread_mutex_t lzma_mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif
-
 static uint64_t count_nonzero(unsigned char *buf, uint64_t len)
 {
 	uint64_t count = 0;
@@ -220,6 +343,7 @@ static uint64_t count_nonzero(unsigned char *buf, uint64_t len)
 static char make_small(u_char **buf,
 		       uint64_t *buf_len,
 		       int enc,
+		       bsdiff_ctx *ctx,
 		       __attribute__((unused)) char *file,
 		       char *blockname)
 {
@@ -229,7 +353,7 @@ static char make_small(u_char **buf,
 	u_char *bz2;
 	unsigned int bz2_len;
 	int bz2_err;
-	int bzip_penalty = 512;
+	int64_t bzip_penalty = ctx->tune.bzip2_penalty;
 #endif
 #ifdef BSDIFF_WITH_LZMA
 	u_char *lzma = NULL;
@@ -237,6 +361,7 @@ static char make_small(u_char **buf,
 	lzma_ret lzma_err;
 	lzma_check lzma_ck;
 #endif
+	const ceffort *e = ctx_effort(ctx);
 	u_char *gz;
 	size_t gz_len;
 	int gz_err;
@@ -274,8 +399,11 @@ static char make_small(u_char **buf,
 
 	/* we do gzip first. it's fast on decompression and does quite well on compression */
 	gz_len = source_len + 1;
-	gz = malloc(gz_len);
-	gz_err = compress2gzip(gz, &gz_len, source, source_len, 9);
+	gz = NULL;
+	gz_err = Z_DATA_ERROR;
+	if (try_enc(e, enc, BSDIFF_ENC_GZIP) && (gz = malloc(gz_len)) != NULL) {
+		gz_err = compress2gzip(gz, &gz_len, source, source_len, e->gzip);
+	}
 	if (gz_err == Z_OK) {
 		gzip_size = gz_len;
 
@@ -295,12 +423,10 @@ static char make_small(u_char **buf,
 
 #ifdef BSDIFF_WITH_LZMA
 	/* xz/lzma are slower on decompression, but esp for bigger files, compress better */
-	pthread_mutex_lock(&lzma_mutex);
 	lzma_len = source_len + 1000;
-	lzma = malloc(lzma_len);
 	lzma_pos = 0;
 
-	/* Equivalent to the options used by xz -9 -e. */
+	/* Equivalent to the options used by xz -9 -e, at the top effort level. */
 	/*
 	 * We'd like to set LZMA_CHECK_NONE, since we do our own sha based checksum at the end.
 	 * However, that seems to generate undecodable compressed blocks, so we'll just do the
@@ -310,10 +436,13 @@ static char make_small(u_char **buf,
 	if (!lzma_check_is_supported(lzma_ck)) {
 		lzma_ck = LZMA_CHECK_CRC32;
 	}
-	lzma_err = lzma_easy_buffer_encode(9 | LZMA_PRESET_EXTREME,
-					   lzma_ck, NULL,
-					   source, source_len,
-					   lzma, &lzma_pos, lzma_len);
+	lzma_err = LZMA_PROG_ERROR;
+	if (try_enc(e, enc, BSDIFF_ENC_XZ) && (lzma = malloc(lzma_len)) != NULL) {
+		lzma_err = lzma_easy_buffer_encode(e->xz | (e->xz_extreme ? LZMA_PRESET_EXTREME : 0),
+						   lzma_ck, NULL,
+						   source, source_len,
+						   lzma, &lzma_pos, lzma_len);
+	}
 	if (lzma_err == LZMA_OK) {
 		xz_size = lzma_pos;
 		if (1.01 * lzma_pos + 64 < *buf_len &&
@@ -329,22 +458,22 @@ static char make_small(u_char **buf,
 		free(lzma);
 		lzma = NULL;
 	}
-
-	pthread_mutex_unlock(&lzma_mutex);
 #endif /* BSDIFF_WITH_LZMA */
 
 #ifdef BSDIFF_WITH_BZIP2
 	/* bzip2 is the slowed of the set on decompress, but for some times of inputs, does really really well */
 	bz2_len = source_len + 1;
-	bz2 = malloc(bz2_len);
-	bz2_err =
-	    BZ2_bzBuffToBuffCompress((char *)bz2, &bz2_len, (char *)source,
-				     source_len, 9, 0, 0);
+	bz2 = NULL;
+	bz2_err = BZ_PARAM_ERROR;
+	if (try_enc(e, enc, BSDIFF_ENC_BZIP2) && (bz2 = malloc(bz2_len)) != NULL) {
+		bz2_err = BZ2_bzBuffToBuffCompress((char *)bz2, &bz2_len, (char *)source,
+						   source_len, e->bzip2, 0, 0);
+	}
 	if (bz2_err == BZ_OK) {
 		bzip_size = bz2_len;
 
-		/* we add a 5% + 1/2 Kb penalty to bzip2, due to the high cost on the client */
-		if (1.05 * bz2_len + bzip_penalty < (unsigned int)*buf_len &&
+		/* we add a 5% + 1/2 Kb penalty to bzip2 by default, due to the high cost on the client */
+		if (ctx->tune.bzip2_factor * bz2_len + bzip_penalty < (unsigned int)*buf_len &&
 		    (enc == BSDIFF_ENC_ANY || enc == BSDIFF_ENC_BZIP2)) {
 			smallest = BSDIFF_ENC_BZIP2;
 			*buf = bz2;
@@ -381,292 +510,602 @@ static char make_small(u_char **buf,
 	return smallest;
 }
 
-/* returns <0 on error, 0 on success, and 1 on "success" with a FULLDL header */
-int make_bsdiff_delta(char *old_filename, char *new_filename, char *delta_filename, int enc)
+/* A delta is written to a stdio stream, a writer, or memory. Memory is either
+ * a fixed buffer supplied by the caller or one grown with realloc(). */
+typedef struct {
+	FILE *f;
+	struct bsdiff_writer *w;
+	u_char *buf;
+	size_t len;
+	size_t cap;
+	int growable;
+} csink;
+
+static int sink_write(csink *s, const void *data, size_t len)
 {
-	int fd, efd;
-	u_char *old_data, *new_data;
-	int64_t old_size, new_size;
-	int64_t *I, *V;
-	uint64_t cblen, dblen, eblen;
-	u_char *cb, *db, *eb;
-	struct stat new_stat;
-	struct stat old_stat;
-	int ret, smallfile;
-	off_t first_block;
-	int c_enc, d_enc, e_enc;
-	enc_flags_t encodings;
-	char delta_filename_unique[2 * PATH_MAX];
-
-	struct header_v20 large_header;
-	struct header_v21 small_header;
-
-	sprintf(delta_filename_unique, "%s.%i", delta_filename, getpid());
-	FILE *pf;
+	u_char *buf;
+	size_t cap;
 
-	ret = lstat(old_filename, &old_stat);
-	if (ret < 0) {
-		return -1;
+	if (len == 0) {
+		return 0;
 	}
-
-	ret = lstat(new_filename, &new_stat);
-	if (ret < 0) {
-		return -1;
+	if (s->f) {
+		return fwrite(data, len, 1, s->f) == 1 ? 0 : -1;
+	}
+	if (s->w) {
+		if (writer_write(s->w, data, len, s->len) < 0) {
+			return -1;
+		}
+		s->len += len;
+		return 0;
+	}
+	if (s->len + len > s->cap) {
+		if (!s->growable) {
+			return -1;
+		}
+		cap = s->cap ? 2 * s->cap : 4096;
+		while (cap < s->len + len) {
+			cap *= 2;
+		}
+		if ((buf = realloc(s->buf, cap)) == NULL) {
+			return -1;
+		}
+		s->buf = buf;
+		s->cap = cap;
 	}
+	memcpy(s->buf + s->len, data, len);
+	s->len += len;
 
-	ret = 0;
+	return 0;
+}
 
-	if (S_ISDIR(new_stat.st_mode) || S_ISDIR(old_stat.st_mode)) {
-		/* no delta on symlinks ! */
-		return -1;
-	}
+/* A FULLDL delta is nothing but its magic. */
+static int write_fulldl(csink *s)
+{
+	return sink_write(s, BSDIFF_HDR_FULLDL, 8);
+}
 
-	if ((new_stat.st_size < 65536) && (old_stat.st_size < 65536)) {
-		smallfile = 1;
-	} else {
-		smallfile = 0;
-	}
+/* Opens a stdio sink on a fresh file at path, which must not exist yet. */
+static int sink_open(csink *s, char *path)
+{
+	int fd;
 
-	fd = open(old_filename, O_RDONLY, 0);
+	memset(s, 0, sizeof(csink));
+	fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 00644);
 	if (fd < 0) {
 		return -1;
 	}
-	if (fstat(fd, &old_stat) != 0) {
+	if ((s->f = fdopen(fd, "w")) == NULL) {
 		close(fd);
+		unlink(path);
 		return -1;
 	}
+	return 0;
+}
 
-	old_size = old_stat.st_size;
+/* Closes a sink opened by sink_open() on unique, and moves the file to path
+ * if ret says it is complete. Returns ret, or -1 if closing failed. */
+static int sink_commit(csink *s, int ret, char *unique, char *path)
+{
+	if (fclose(s->f) != 0) {
+		ret = -1;
+	}
+	if (ret < 0) {
+		unlink(unique);
+	} else if (rename(unique, path) != 0) {
+		unlink(unique);
+		ret = -1;
+	}
+	return ret;
+}
 
-	/* We may start with an empty file, if so, just mark it for full download
-	 * to throw into the pack. In the case that newfile is <200, it will quit
-	 * and ask for fulldownload, so we only need to check old_size */
-	if (old_size == 0) {
-		memset(&small_header, 0, sizeof(struct header_v21));
-		memcpy(&small_header.magic, BSDIFF_HDR_FULLDL, 8);
+static uint64_t usec_now(void)
+{
+	struct timespec ts;
 
-		efd = open(delta_filename_unique, O_CREAT | O_EXCL | O_WRONLY, 00644);
-		if (efd < 0) {
-			close(fd);
-			return -1;
-		}
-		if ((pf = fdopen(efd, "w")) == NULL) {
-			close(efd);
-			close(fd);
-			return -1;
-		}
-		if (fwrite(&small_header, 8, 1, pf) != 1) {
-			fclose(pf);
-			close(fd);
-			return -1;
-		}
-		fclose(pf);
-		close(fd);
-		rename(delta_filename_unique, delta_filename);
-		return 1;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	/* TODO: investigate why this needs to be +1 to not overrun; coverity complains
-	 * that we overrun old_data when we calculate differences otherwise. Tenatively,
-	 * since this is used in qsufsort, it may need to be +1 like I and V because of
-	 * a sentinel byte when sorting. However, new_size does not cause any overruns
-	 * when created with the regular file size */
-	old_data = mmap(NULL, old_size + 1, PROT_READ, MAP_SHARED, fd, 0);
-	close(fd);
+/* Suffix sorts old_data into the context's scratch space, or into a mapped
+ * scratch file when that would take more than the context's sort memory.
+ * Returns the suffix array, or NULL on failure. */
+static int64_t *sort_old(bsdiff_ctx *ctx, u_char *old_data, int64_t old_size)
+{
+	uint64_t start = usec_now();
+	int64_t *I, *V;
 
-	if (old_data == MAP_FAILED) {
-		old_data = NULL;
-		return -1;
+	if (ctx->sa_map) {
+		munmap(ctx->sa_map, ctx->sa_map_len);
+		ctx->sa_map = NULL;
+	}
+	if (ctx->sort_mem && (uint64_t)(old_size + 1) * 2 * sizeof(int64_t) > ctx->sort_mem) {
+		I = ext_sufsort(old_data, old_size, ctx->sort_dir, ctx->sort_mem,
+				&ctx->stats.spilled);
+		if (I == NULL) {
+			return NULL;
+		}
+		ctx->sa_map = I;
+		ctx->sa_map_len = (old_size + 1) * sizeof(int64_t);
+		ctx->stats.external++;
+		goto done;
 	}
 
 	/* These arrays are size + 1 because suffix sort needs space for the
 	 * data + 1 sentinel element to actually do the sorting. Not because
 	 * old_size might be 0. */
-	if ((I = malloc((old_size + 1) * sizeof(int64_t))) == NULL) {
-		munmap(old_data, old_size);
-		return -1;
+	if ((I = ctx_buf(ctx, BSDIFF_BUF_I, (old_size + 1) * sizeof(int64_t))) == NULL) {
+		return NULL;
 	}
-	if ((V = malloc((old_size + 1) * sizeof(int64_t))) == NULL) {
-		munmap(old_data, old_size);
-		free(I);
-		return -1;
+	if ((V = ctx_buf(ctx, BSDIFF_BUF_V, (old_size + 1) * sizeof(int64_t))) == NULL) {
+		return NULL;
 	}
-
 	if (qsufsort(I, V, old_data, old_size) != 0) {
-		munmap(old_data, old_size);
-		free(I);
-		free(V);
-		return -1;
+		return NULL;
 	}
+done:
+	ctx->stats.sorted += old_size;
+	ctx->stats.sort_usec += usec_now() - start;
 
-	free(V);
+	return I;
+}
 
-	if ((fd = open(new_filename, O_RDONLY, 0)) < 0) {
-		munmap(old_data, old_size);
-		free(I);
-		return -1;
+/* Builds the index of old_data that diff_core() searches: its suffix array
+ * from sort_old(), or with BSDIFF_DIFF_FAST or a low effort level a k-gram
+ * table in the same scratch space. Returns 0, or -1 on failure. */
+static int index_old(bsdiff_ctx *ctx, u_char *old_data, int64_t old_size, cindex *ix)
+{
+	const ceffort *e = ctx_effort(ctx);
+	size_t slots;
+
+	memset(ix, 0, sizeof(cindex));
+	if (!e->fast && !(ctx->diff_flags & BSDIFF_DIFF_FAST)) {
+		ix->I = sort_old(ctx, old_data, old_size);
+		return ix->I ? 0 : -1;
 	}
 
-	if (fstat(fd, &new_stat) != 0) {
-		munmap(old_data, old_size);
-		free(I);
-		close(fd);
+	ix->step = e->step ? e->step : BSDIFF_FAST_STEP;
+	slots = fast_slots(old_size, ix->step);
+	if ((ix->table = ctx_buf(ctx, BSDIFF_BUF_I, slots * sizeof(int64_t))) == NULL) {
 		return -1;
 	}
+	fast_index(ix, slots, old_data, old_size);
 
-	new_size = new_stat.st_size;
+	return 0;
+}
 
-	/* Note: testing this to see how diffs between small files affect
-	 * updates. Small files seem to cause some problems between certain
-	 * files (buffer overrun/underrun perhaps). We try to avoid this
-	 * preemptively by marking the file as a FULLDL file and not create
-	 * a bsdiff at all, which leaves us with small files that may fail
-	 * the "is bsdiff < 90% of newfile size" check that would otherwise
-	 * be performed later on.
-	 */
-	if (new_size < 200) {
-		memset(&small_header, 0, sizeof(struct header_v21));
-		memcpy(&small_header.magic, BSDIFF_HDR_FULLDL, 8);
+/* The early FULLDL check compresses this many chunks of the new file, and
+ * leaves smaller ones to the full diff. */
+#define BSDIFF_PREDICT_CHUNK 4096
+#define BSDIFF_PREDICT_CHUNKS 16
 
-		efd = open(delta_filename_unique, O_CREAT | O_EXCL | O_WRONLY, 00644);
-		if (efd < 0) {
-			close(fd);
-			munmap(old_data, old_size);
-			free(I);
-			return -1;
-		}
-		if ((pf = fdopen(efd, "w")) == NULL) {
-			close(efd);
-			close(fd);
-			munmap(old_data, old_size);
-			free(I);
-			return -1;
-		}
-		if (fwrite(&small_header, 8, 1, pf) != 1) {
-			fclose(pf);
-			close(fd);
-			munmap(old_data, old_size);
+/* A sample not found whole is looked for by halves of this many bytes, and
+ * a half found counts if most of this many bytes from there agree. */
+#define BSDIFF_PREDICT_HALF (BSDIFF_FAST_K / 2)
+#define BSDIFF_PREDICT_NEAR 64
 
-			free(I);
-			return -1;
-		}
-		fclose(pf);
-		close(fd);
-		munmap(old_data, old_size);
-		free(I);
-		rename(delta_filename_unique, delta_filename);
-		return 1;
+static uint64_t half_hash(u_char *p)
+{
+	uint64_t a;
+
+	memcpy(&a, p, 8);
+	return a * 0x9e3779b97f4a7c15ULL;
+}
+
+/* Whether at least three quarters of the bytes old and new start with
+ * agree, over BSDIFF_PREDICT_NEAR bytes or what is left of either. */
+static int near_match(u_char *old, int64_t old_len, u_char *new, int64_t new_len)
+{
+	int64_t len = MIN(BSDIFF_PREDICT_NEAR, MIN(old_len, new_len)), i, same = 0;
+
+	for (i = 0; i < len; i++) {
+		same += old[i] == new[i];
 	}
+	return len >= BSDIFF_FAST_K && 4 * same >= 3 * len;
+}
 
-	if ((new_data = malloc(new_size)) == NULL) {
-		close(fd);
-		munmap(old_data, old_size);
-		free(I);
-		return -1;
+/* Guesses, before anything is sorted, whether the delta from old_data to
+ * new_data will be FULLDL. Up to tune.predict_samples k-grams spread over
+ * new_data are looked for in one pass over old_data, and the part of
+ * new_data they do not find is expected to cost as much as spread chunks
+ * of it do compressed. Samples not found whole get a second pass for near
+ * matches. That compression ratio is stored in *ratio, or 0 when nothing
+ * was sampled. Returns 1 if the expected delta is over the
+ * FULLDL limit, else 0. */
+static int predict_fulldl(bsdiff_ctx *ctx, u_char *old_data, int64_t old_size,
+			  u_char *new_data, int64_t new_size, double *ratio)
+{
+	int64_t n = ctx->tune.predict_samples, i, q, found = 0, gap;
+	size_t slots, s, in_len = 0, out_len;
+	uint64_t *hash = NULL, h;
+	uint32_t *count = NULL;
+	int32_t *table = NULL;
+	u_char *in = NULL, *out = NULL;
+	int shift, half, ret = 0;
+
+	*ratio = 0;
+	if (n == 0 || ctx->enc == BSDIFF_ENC_NONE ||
+	    new_size < BSDIFF_PREDICT_CHUNK * BSDIFF_PREDICT_CHUNKS) {
+		return 0;
 	}
 
-	if (pread(fd, new_data, new_size, 0) != new_size) {
-		close(fd);
-		munmap(old_data, old_size);
-		free(new_data);
-		free(I);
-		return -1;
+	in = malloc(BSDIFF_PREDICT_CHUNK * BSDIFF_PREDICT_CHUNKS);
+	out_len = compressBound(BSDIFF_PREDICT_CHUNK * BSDIFF_PREDICT_CHUNKS) + 32;
+	out = malloc(out_len);
+	if (!in || !out) {
+		goto out;
 	}
-	if (close(fd) == -1) {
-		munmap(old_data, old_size);
-		free(new_data);
-		free(I);
-		return -1;
+	gap = (new_size - BSDIFF_PREDICT_CHUNK) / (BSDIFF_PREDICT_CHUNKS - 1);
+	for (i = 0; i < BSDIFF_PREDICT_CHUNKS; i++) {
+		memcpy(in + in_len, new_data + i * gap, BSDIFF_PREDICT_CHUNK);
+		in_len += BSDIFF_PREDICT_CHUNK;
+	}
+	if (compress2gzip(out, &out_len, in, in_len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		goto out;
 	}
+	*ratio = (double)out_len / in_len;
 
-	/* we can write 3 8 byte tupples extra, so allocate some headroom */
-	if ((cb = malloc(new_size + 25)) == NULL) {
-		munmap(old_data, old_size);
-		free(new_data);
-		free(I);
-		return -1;
+	/* new data that compresses this well pays off even with no matches */
+	if (*ratio <= ctx->tune.fulldl_ratio) {
+		goto out;
 	}
-	if ((db = malloc(new_size + 25)) == NULL) {
-		munmap(old_data, old_size);
-		free(new_data);
-		free(cb);
-		free(I);
-		return -1;
+
+	/* the samples go in an open addressed table at most a quarter full;
+	 * a sample equal to one already there only adds to its count */
+	n = MIN(n, new_size / BSDIFF_FAST_K);
+	gap = (new_size - BSDIFF_FAST_K) / n;
+	slots = 1024;
+	while (slots < 4 * (uint64_t)n) {
+		slots *= 2;
 	}
-	if ((eb = malloc(new_size + 25)) == NULL) {
-		munmap(old_data, old_size);
-		free(new_data);
-		free(cb);
-		free(db);
-		free(I);
-		return -1;
+	for (shift = 64, s = slots; s > 1; s /= 2) {
+		shift--;
+	}
+	hash = malloc(n * sizeof(uint64_t));
+	count = calloc(n, sizeof(uint32_t));
+	table = malloc(slots * sizeof(int32_t));
+	if (!hash || !count || !table) {
+		*ratio = 0;
+		goto out;
+	}
+	memset(table, 0xff, slots * sizeof(int32_t));
+	for (i = 0; i < n; i++) {
+		hash[i] = kgram_hash(new_data + i * gap);
+		for (s = hash[i] >> shift; table[s] >= 0; s = (s + 1) & (slots - 1)) {
+			if (hash[table[s]] == hash[i] &&
+			    memcmp(new_data + table[s] * gap, new_data + i * gap, BSDIFF_FAST_K) == 0) {
+				break;
+			}
+		}
+		if (table[s] < 0) {
+			table[s] = i;
+		}
+		count[table[s]]++;
 	}
-	cblen = 0;
-	dblen = 0;
-	eblen = 0;
-
-	/* Compute the differences */
-	int64_t new_pos = 0;
-	int64_t old_pos = 0;
-	int64_t match_len = 0;
-	int64_t last_new_pos = 0;
-	int64_t last_old_pos = 0;
-	int64_t last_offset = 0;
-	while (new_pos < new_size) {
-		// Find an exact match between old and new files, and require
-		// that more than 8 of the matching bytes "mismatch" from the
-		// previous exact match. A score (old_score) is used to track
-		// how many bytes match starting from new_pos in new, and from
-		// old_pos in the previous iteration.
-		// NOTE: the magic value 8 is a heuristic; further testing is
-		// needed to prove whether this is the best number, or if the
-		// number should vary according to other factors, etc.
-		int64_t old_score = 0;
-		int64_t new_peek;
-		for (new_peek = new_pos += match_len; new_pos < new_size; new_pos++) {
-			search(I, old_data, old_size, new_data + new_pos, new_size - new_pos,
-			       0, old_size, &old_pos, &match_len);
 
-			for (; new_peek < new_pos + match_len; new_peek++) {
-				if ((new_peek + last_offset < old_size) &&
-				    (old_data[new_peek + last_offset] == new_data[new_peek])) {
-					old_score++;
+	/* a found sample's count is cleared; stop as soon as enough are
+	 * found for the delta to pay off */
+	for (q = 0; q + BSDIFF_FAST_K <= old_size; q++) {
+		h = kgram_hash(old_data + q);
+		for (s = h >> shift; table[s] >= 0; s = (s + 1) & (slots - 1)) {
+			i = table[s];
+			if (count[i] && hash[i] == h &&
+			    memcmp(old_data + q, new_data + i * gap, BSDIFF_FAST_K) == 0) {
+				found += count[i];
+				count[i] = 0;
+				if ((1 - (double)found / n) * *ratio <= ctx->tune.fulldl_ratio) {
+					goto out;
 				}
 			}
+		}
+	}
 
-			if (((match_len == old_score) && (match_len != 0)) ||
-			    (match_len > old_score + 8)) {
-				break;
+	/* Dense small edits can leave no k-gram of new_data intact while the
+	 * delta stays tiny, so look again for the samples not found by either
+	 * half, and take a half whose surroundings mostly agree as found. The
+	 * table holds two entries per sample here, so it is at most half full. */
+	memset(table, 0xff, slots * sizeof(int32_t));
+	for (i = 0; i < n; i++) {
+		for (half = 0; count[i] && half < 2; half++) {
+			s = half_hash(new_data + i * gap + half * BSDIFF_PREDICT_HALF) >> shift;
+			while (table[s] >= 0) {
+				s = (s + 1) & (slots - 1);
 			}
-
-			// Before beginning the next loop iteration, decrement
-			// old_score if needed, since new_pos will be
-			// incremented.
-			if ((new_pos + last_offset < old_size) &&
-			    (old_data[new_pos + last_offset] == new_data[new_pos])) {
-				old_score--;
+			table[s] = 2 * i + half;
+		}
+	}
+	for (q = 0; q + BSDIFF_PREDICT_HALF <= old_size; q++) {
+		h = half_hash(old_data + q);
+		for (s = h >> shift; table[s] >= 0; s = (s + 1) & (slots - 1)) {
+			i = table[s] / 2;
+			half = table[s] % 2;
+			if (count[i] && q >= half * BSDIFF_PREDICT_HALF &&
+			    memcmp(old_data + q, new_data + i * gap + half * BSDIFF_PREDICT_HALF,
+				   BSDIFF_PREDICT_HALF) == 0 &&
+			    near_match(old_data + q - half * BSDIFF_PREDICT_HALF,
+				       old_size - q + half * BSDIFF_PREDICT_HALF,
+				       new_data + i * gap, new_size - i * gap)) {
+				found += count[i];
+				count[i] = 0;
+				if ((1 - (double)found / n) * *ratio <= ctx->tune.fulldl_ratio) {
+					goto out;
+				}
 			}
 		}
+	}
+	ret = 1;
 
-		if ((match_len != old_score) || (new_pos == new_size)) {
-			int64_t bytes = 0, max = 0;
-			// Compute the length of a fuzzy match starting from
-			// the beginning of the fuzzy match recorded at the end
-			// of the previous iteration (i.e. len_fuzzybackward
-			// less than the previous match positions). At least
-			// half of the bytes match between old and new. This
-			// fuzzy match will be used to construct a diff string
-			// in the diff block.
-			// NOTE: "at least half matching bytes" is a heuristic
-			// for both fuzzy regions being constructed below;
-			// further testing is needed to prove whether this is
-			// the best percentage, or if the percentage should
-			// vary according to other factors, etc.
-			int64_t len_fuzzyforward = 0;
-			for (int64_t i = 0;
-			     (last_new_pos + i < new_pos) && (last_old_pos + i < old_size);) {
-				if (old_data[last_old_pos + i] == new_data[last_new_pos + i]) {
-					bytes++;
+out:
+	free(in);
+	free(out);
+	free(hash);
+	free(count);
+	free(table);
+
+	return ret;
+}
+
+/* Adds the block encodings of a written delta to the statistics. */
+static void count_encodings(bsdiff_ctx *ctx, enc_flags_t encodings)
+{
+	if (cblock_get_enc(encodings) == BSDIFF_ENC_NONE) {
+		ctx->stats.none++;
+	}
+	if (dblock_get_enc(encodings) == BSDIFF_ENC_NONE) {
+		ctx->stats.none++;
+	}
+	if (eblock_get_enc(encodings) == BSDIFF_ENC_NONE) {
+		ctx->stats.none++;
+	}
+	if (cblock_get_enc(encodings) == BSDIFF_ENC_GZIP) {
+		ctx->stats.gzip++;
+	}
+	if (dblock_get_enc(encodings) == BSDIFF_ENC_GZIP) {
+		ctx->stats.gzip++;
+	}
+	if (eblock_get_enc(encodings) == BSDIFF_ENC_GZIP) {
+		ctx->stats.gzip++;
+	}
+	if (cblock_get_enc(encodings) == BSDIFF_ENC_BZIP2) {
+		ctx->stats.bzip2++;
+	}
+	if (dblock_get_enc(encodings) == BSDIFF_ENC_BZIP2) {
+		ctx->stats.bzip2++;
+	}
+	if (eblock_get_enc(encodings) == BSDIFF_ENC_BZIP2) {
+		ctx->stats.bzip2++;
+	}
+	if (cblock_get_enc(encodings) == BSDIFF_ENC_XZ) {
+		ctx->stats.xz++;
+	}
+	if (dblock_get_enc(encodings) == BSDIFF_ENC_XZ) {
+		ctx->stats.xz++;
+	}
+	if (eblock_get_enc(encodings) == BSDIFF_ENC_XZ) {
+		ctx->stats.xz++;
+	}
+	if (dblock_get_enc(encodings) == BSDIFF_ENC_ZEROS) {
+		ctx->stats.zeros++;
+	}
+	if (eblock_get_enc(encodings) == BSDIFF_ENC_ZEROS) {
+		ctx->stats.zeros++;
+	}
+}
+
+/* Compresses one frame of a stream delta, made of ntuples control tuples
+ * and the diff and extra bytes they use, and appends it to sink, adding
+ * its size to *offset. */
+static int write_frame(bsdiff_ctx *ctx, csink *sink, uint32_t ntuples,
+		       u_char *cb, uint64_t cblen, u_char *db, uint64_t dblen,
+		       u_char *eb, uint64_t eblen, uint64_t *offset)
+{
+	struct frame_stream frame;
+	enc_flags_t encoding;
+	u_char *block[3] = { NULL, NULL, NULL };
+	uint64_t len[3] = { cblen, dblen, eblen };
+	u_char *src[3] = { cb, db, eb };
+	int enc[3], i, ret = 0;
+
+	/* make_small() takes over the buffers it is given */
+	for (i = 0; i < 3; i++) {
+		if ((block[i] = malloc(len[i] + 1)) == NULL) {
+			ret = -1;
+			goto out;
+		}
+		memcpy(block[i], src[i], len[i]);
+	}
+	enc[0] = make_small(&block[0], &len[0], ctx->enc, ctx, NULL, "control");
+	enc[1] = make_small(&block[1], &len[1], ctx->enc, ctx, NULL, "diff   ");
+	enc[2] = make_small(&block[2], &len[2], ctx->enc, ctx, NULL, "extra  ");
+
+	memset(&frame, 0, sizeof(struct frame_stream));
+	frame.tuples = ntuples;
+	frame.control_length = len[0];
+	frame.diff_length = len[1];
+	frame.extra_length = len[2];
+	memset(&encoding, 0, sizeof(enc_flags_t));
+	cblock_set_enc(&encoding, enc[0]);
+	dblock_set_enc(&encoding, enc[1]);
+	eblock_set_enc(&encoding, enc[2]);
+	frame.encoding = encoding;
+	count_encodings(ctx, encoding);
+
+	if (sink_write(sink, &frame, sizeof(struct frame_stream)) < 0 ||
+	    sink_write(sink, block[0], len[0]) < 0 ||
+	    sink_write(sink, block[1], len[1]) < 0 ||
+	    sink_write(sink, block[2], len[2]) < 0) {
+		ret = -1;
+	}
+	*offset += sizeof(struct frame_stream) + len[0] + len[1] + len[2];
+
+out:
+	for (i = 0; i < 3; i++) {
+		free(block[i]);
+	}
+	return ret;
+}
+
+/* Adds a match of len bytes at new_pos to hints, or lengthens the last
+ * one if it runs on at the same offset. */
+static int hint_add(chints *hints, int64_t new_pos, int64_t len, int64_t offset)
+{
+	chint *last = hints->len ? &hints->v[hints->len - 1] : NULL;
+	chint *v;
+
+	if (last && last->offset == offset && new_pos <= last->end) {
+		last->end = MAX(last->end, new_pos + len);
+		return 0;
+	}
+	if (hints->len == hints->cap) {
+		hints->cap = hints->cap ? 2 * hints->cap : 4096;
+		if ((v = realloc(hints->v, hints->cap * sizeof(chint))) == NULL) {
+			return -1;
+		}
+		hints->v = v;
+	}
+	hints->v[hints->len].start = new_pos;
+	hints->v[hints->len].end = new_pos + len;
+	hints->v[hints->len].offset = offset;
+	hints->len++;
+
+	return 0;
+}
+
+/* When a diff's scans have to stop, in usec_now() time, or 0 for never.
+ * Taken once per diff, so the windows of one share tune.scan_seconds. */
+static uint64_t scan_deadline(bsdiff_ctx *ctx)
+{
+	if (ctx->tune.scan_seconds <= 0) {
+		return 0;
+	}
+	return usec_now() + ctx->tune.scan_seconds * 1e6;
+}
+
+/* The bsdiff match loop: computes the control, diff and extra blocks from
+ * old_data, indexed into ix by index_old(), to new_data. cb, db and eb
+ * each need room for new_size + 25 bytes, and their lengths are stored in
+ * *cblen, *dblen and *eblen. Returns -1 if the control block would
+ * overflow, and 1 as soon as the extra block grows past eb_limit. The
+ * matches it finds along the way are added to hints, if given.
+ *
+ * Runs of new data that keep finding long matches a little better than
+ * the current alignment cost a search each, as long as the match, for
+ * every byte, which is quadratic. Once the searches have compared more
+ * than tune.scan_work bytes per new byte, or the effort level's cap if
+ * that is lower, a rejected match lets the scan skip half its length
+ * instead of a byte; once the deadline from scan_deadline() has passed,
+ * the rest of new_data goes out as it is. */
+static int diff_core(bsdiff_ctx *ctx, cindex *ix,
+		     u_char *old_data, int64_t old_size,
+		     u_char *new_data, int64_t new_size,
+		     u_char *cb, uint64_t *cblen, u_char *db, uint64_t *dblen,
+		     u_char *eb, uint64_t *eblen, uint64_t eb_limit, uint64_t deadline,
+		     chints *hints)
+{
+	int64_t new_pos = 0;
+	int64_t old_pos = 0;
+	int64_t match_len = 0;
+	int64_t last_new_pos = 0;
+	int64_t last_old_pos = 0;
+	int64_t last_offset = 0;
+	const struct bsdiff_tunables *tune = &ctx->tune;
+	int64_t per_byte = tune->scan_work, cap = ctx_effort(ctx)->work;
+	uint64_t work = 0, searches = 0, budget;
+	int coarse = 0;
+
+	if (cap && (per_byte == 0 || per_byte > cap)) {
+		per_byte = cap;
+	}
+	budget = per_byte ? per_byte * (uint64_t)(new_size + 1) : UINT64_MAX;
+
+	*cblen = 0;
+	*dblen = 0;
+	*eblen = 0;
+	while (new_pos < new_size) {
+		// Find an exact match between old and new files, and require
+		// that more than match_margin (8 by default) of the matching
+		// bytes "mismatch" from the previous exact match. A score
+		// (old_score) is used to track how many bytes match starting
+		// from new_pos in new, and from old_pos in the previous
+		// iteration.
+		// NOTE: the margin is a heuristic; bstune can sweep it over
+		// a corpus to find the best value for that data.
+		int64_t old_score = 0;
+		int64_t new_peek;
+		for (new_peek = new_pos += match_len; new_pos < new_size; new_pos++) {
+			if (ix->table) {
+				fast_search(ix, old_data, old_size, new_data + new_pos,
+					    new_size - new_pos, &old_pos, &match_len);
+			} else {
+				search(ix->I, old_data, old_size, new_data + new_pos,
+				       new_size - new_pos, 0, old_size, &old_pos, &match_len);
+			}
+			work += match_len + 1;
+			if (hints && match_len > tune->match_margin &&
+			    hint_add(hints, new_pos, match_len, old_pos - new_pos) < 0) {
+				return -1;
+			}
+
+			for (; new_peek < new_pos + match_len; new_peek++) {
+				if ((new_peek + last_offset < old_size) &&
+				    (old_data[new_peek + last_offset] == new_data[new_peek])) {
+					old_score++;
+				}
+			}
+
+			if (((match_len == old_score) && (match_len != 0)) ||
+			    (match_len > old_score + tune->match_margin)) {
+				break;
+			}
+
+			// Before beginning the next loop iteration, decrement
+			// old_score if needed, since new_pos will be
+			// incremented.
+			if ((new_pos + last_offset < old_size) &&
+			    (old_data[new_pos + last_offset] == new_data[new_pos])) {
+				old_score--;
+			}
+
+			if (!coarse && work > budget) {
+				coarse = 1;
+				ctx->stats.coarse++;
+			}
+			if (deadline && (++searches & 1023) == 0 && usec_now() > deadline) {
+				ctx->stats.timeouts++;
+				new_pos = new_size;
+				break;
+			}
+			// Skipping keeps new_pos inside the match, so old_score
+			// still covers new_pos up to new_peek.
+			for (int64_t skip = coarse ? match_len / 2 : 0;
+			     skip > 0 && new_pos + 1 < new_size; skip--) {
+				new_pos++;
+				if ((new_pos + last_offset < old_size) &&
+				    (old_data[new_pos + last_offset] == new_data[new_pos])) {
+					old_score--;
+				}
+			}
+		}
+
+		if ((match_len != old_score) || (new_pos == new_size)) {
+			int64_t bytes = 0, max = 0;
+			// Compute the length of a fuzzy match starting from
+			// the beginning of the fuzzy match recorded at the end
+			// of the previous iteration (i.e. len_fuzzybackward
+			// less than the previous match positions). At least
+			// half of the bytes match between old and new. This
+			// fuzzy match will be used to construct a diff string
+			// in the diff block.
+			// NOTE: "at least half matching bytes" is a heuristic
+			// for both fuzzy regions being constructed below;
+			// further testing is needed to prove whether this is
+			// the best percentage, or if the percentage should
+			// vary according to other factors, etc.
+			int64_t len_fuzzyforward = 0;
+			for (int64_t i = 0;
+			     (last_new_pos + i < new_pos) && (last_old_pos + i < old_size);) {
+				if (old_data[last_old_pos + i] == new_data[last_new_pos + i]) {
+					bytes++;
 				}
 				i++;
 				if (bytes * 2 - i > max * 2 - len_fuzzyforward) {
@@ -735,28 +1174,25 @@ int make_bsdiff_delta(char *old_filename, char *new_filename, char *delta_filena
 			// bspatch) this operation is reversed, by performing
 			// additions.
 			for (int64_t i = 0; i < len_fuzzyforward; i++) {
-				db[dblen + i] =
+				db[*dblen + i] =
 				    new_data[last_new_pos + i] - old_data[last_old_pos + i];
 			}
 			// Set the extra string in the extra block. The
 			// contents are the bytes in new file between the fuzzy
 			// forward and fuzzy backward regions.
 			for (int64_t i = 0; i < (new_pos - len_fuzzybackward) - (last_new_pos + len_fuzzyforward); i++) {
-				eb[eblen + i] = new_data[last_new_pos + len_fuzzyforward + i];
+				eb[*eblen + i] = new_data[last_new_pos + len_fuzzyforward + i];
 			}
 
-			dblen += len_fuzzyforward;
-			eblen += (new_pos - len_fuzzybackward) - (last_new_pos + len_fuzzyforward);
+			*dblen += len_fuzzyforward;
+			*eblen += (new_pos - len_fuzzybackward) - (last_new_pos + len_fuzzyforward);
+			if (*eblen > eb_limit) {
+				return 1;
+			}
 
 			/* checking for control block overflow...
 			 * See regression test #15 for an example */
-			if ((int64_t)(cblen + 24) > (new_size + 25)) {
-				munmap(old_data, old_size);
-				free(new_data);
-				free(cb);
-				free(db);
-				free(eb);
-				free(I);
+			if ((int64_t)(*cblen + 24) > (new_size + 25)) {
 				return -1;
 			}
 
@@ -767,14 +1203,14 @@ int make_bsdiff_delta(char *old_filename, char *new_filename, char *delta_filena
 			//  2. INSERT instruction (value: length of the extra
 			//     string)
 			//  3. offset in old file for the next ADD instruction
-			offtout(len_fuzzyforward, cb + cblen);
-			cblen += 8;
+			offtout(len_fuzzyforward, cb + *cblen);
+			*cblen += 8;
 
-			offtout((new_pos - len_fuzzybackward) - (last_new_pos + len_fuzzyforward), cb + cblen);
-			cblen += 8;
+			offtout((new_pos - len_fuzzybackward) - (last_new_pos + len_fuzzyforward), cb + *cblen);
+			*cblen += 8;
 
-			offtout((old_pos - len_fuzzybackward) - (last_old_pos + len_fuzzyforward), cb + cblen);
-			cblen += 8;
+			offtout((old_pos - len_fuzzybackward) - (last_old_pos + len_fuzzyforward), cb + *cblen);
+			*cblen += 8;
 
 			// Save old/new file positions to the beginning of the
 			// fuzzy backward region, since the next fuzzy forward
@@ -784,182 +1220,1393 @@ int make_bsdiff_delta(char *old_filename, char *new_filename, char *delta_filena
 			last_offset = old_pos - new_pos;
 		}
 	}
-	free(I);
 
-	c_enc = make_small(&cb, &cblen, enc, new_filename, "control");
-	d_enc = make_small(&db, &dblen, enc, new_filename, "diff   ");
-	e_enc = make_small(&eb, &eblen, enc, new_filename, "extra  ");
+	return 0;
+}
 
-	if ((!cb) || (!db) || (!eb)) {
-		ret = -1;
-		goto fulldl_free;
+/* The gzip compressed size of three blocks, a quick stand-in for what
+ * make_small() will make of them. */
+static uint64_t packed_size(u_char *cb, uint64_t cblen, u_char *db,
+			    uint64_t dblen, u_char *eb, uint64_t eblen)
+{
+	u_char *block[3] = { cb, db, eb };
+	uint64_t len[3] = { cblen, dblen, eblen };
+	uint64_t total = 0;
+	size_t out_len;
+	u_char *out;
+	int i;
+
+	if ((out = malloc(compressBound(MAX(cblen, MAX(dblen, eblen))) + 32)) == NULL) {
+		return UINT64_MAX;
+	}
+	for (i = 0; i < 3; i++) {
+		out_len = compressBound(len[i]) + 32;
+		if (compress2gzip(out, &out_len, block[i], len[i], Z_DEFAULT_COMPRESSION) != Z_OK) {
+			total = UINT64_MAX;
+			break;
+		}
+		total += out_len;
 	}
+	free(out);
 
-	/* Create the patch file */
+	return total;
+}
 
-	efd = open(delta_filename_unique, O_CREAT | O_EXCL | O_WRONLY, 00644);
-	if (efd < 0) {
-		ret = -1;
-		goto fulldl_free;
+/* diff_core(), followed with BSDIFF_DIFF_OPTIMAL by opt_parse() over
+ * the matches the scan found, whose blocks replace the scan's when they
+ * are estimated to be smaller and really do compress smaller. Returns as
+ * diff_core() does. */
+static int diff_blocks(bsdiff_ctx *ctx, cindex *ix,
+		       u_char *old_data, int64_t old_size,
+		       u_char *new_data, int64_t new_size,
+		       u_char *cb, uint64_t *cblen, u_char *db, uint64_t *dblen,
+		       u_char *eb, uint64_t *eblen, uint64_t eb_limit, uint64_t deadline)
+{
+	u_char *pcb = NULL, *pdb = NULL, *peb = NULL;
+	uint64_t pcblen, pdblen, peblen, cost;
+	chints hints;
+	int ret;
+
+	if (!(ctx->diff_flags & BSDIFF_DIFF_OPTIMAL)) {
+		return diff_core(ctx, ix, old_data, old_size, new_data, new_size,
+				 cb, cblen, db, dblen, eb, eblen, eb_limit, deadline, NULL);
+	}
+
+	memset(&hints, 0, sizeof(chints));
+	ret = diff_core(ctx, ix, old_data, old_size, new_data, new_size,
+			cb, cblen, db, dblen, eb, eblen, eb_limit, deadline, &hints);
+	if (ret != 0) {
+		goto out;
 	}
-	if ((pf = fdopen(efd, "w")) == NULL) {
-		close(efd);
+	if ((pcb = malloc(new_size + 25)) == NULL ||
+	    (pdb = malloc(new_size + 1)) == NULL ||
+	    (peb = malloc(new_size + 1)) == NULL) {
 		ret = -1;
-		goto fulldl_free;
+		goto out;
+	}
+	/* a parse with too many tuples just leaves the scan's blocks */
+	if (opt_parse(old_data, old_size, new_data, new_size, &hints,
+		      pcb, &pcblen, pdb, &pdblen, peb, &peblen, &cost) == 0 &&
+	    cost < parse_cost(*cblen, db, *dblen, *eblen) &&
+	    packed_size(pcb, pcblen, pdb, pdblen, peb, peblen) <
+		    packed_size(cb, *cblen, db, *dblen, eb, *eblen)) {
+		memcpy(cb, pcb, pcblen);
+		memcpy(db, pdb, pdblen);
+		memcpy(eb, peb, peblen);
+		*cblen = pcblen;
+		*dblen = pdblen;
+		*eblen = peblen;
+		ctx->stats.reparsed++;
 	}
 
-	if (smallfile && (cblen < 256) && (dblen < 65536) && (eblen < 65536)) {
-		memset(&small_header, 0, sizeof(struct header_v21));
-		memcpy(&small_header.magic, BSDIFF_HDR_MAGIC_V21, 8);
+out:
+	free(hints.v);
+	free(pcb);
+	free(pdb);
+	free(peb);
 
-		/* in the future we may need to push first_block out further to squeeze
-		 * something extra into the header */
-		first_block = sizeof(struct header_v21);
-		small_header.offset_to_first_block = first_block;
-		small_header.control_length = cblen;
-		small_header.diff_length = dblen;
-		small_header.extra_length = eblen;
-		small_header.old_file_length = old_size;
-		small_header.new_file_length = new_size;
-		small_header.file_mode = new_stat.st_mode;
-		small_header.file_owner = new_stat.st_uid;
-		small_header.file_group = new_stat.st_gid;
+	return ret;
+}
 
-		cblock_set_enc(&small_header.encoding, c_enc);
-		dblock_set_enc(&small_header.encoding, d_enc);
-		eblock_set_enc(&small_header.encoding, e_enc);
-		encodings = small_header.encoding;
+/* Cuts control tuples into stream frames. Tuples that would overflow a
+ * frame are split: an ADD or INSERT can be cut anywhere, and only the last
+ * piece of a tuple carries its seek. It is fed the blocks of one or more
+ * runs of diff_core() in turn, and a frame never spans two of them. Frames
+ * go to frames, and their index entries to index. */
+typedef struct {
+	csink *frames;
+	csink index;
+	uint64_t offset;  /* frame bytes written */
+	uint64_t new_pos; /* at the end of the last frame */
+	uint64_t old_pos;
+	u_char *fc;
+} cframer;
+
+static int framer_init(cframer *fr, csink *frames)
+{
+	memset(fr, 0, sizeof(cframer));
+	fr->frames = frames;
+	fr->index.growable = 1;
+	if ((fr->fc = malloc(MAX(BSDIFF_STREAM_FRAME / 24, 1) * 24)) == NULL) {
+		return -1;
+	}
+	return 0;
+}
 
-		if ((first_block + cblen + dblen + eblen > 0.90 * new_size) && (enc != BSDIFF_ENC_NONE)) { /* tune */
-			memcpy(&small_header.magic, BSDIFF_HDR_FULLDL, 8);
-			ret = 1;
-			if (fwrite(&small_header, 8, 1, pf) != 1) {
-				ret = -1;
-				goto fulldl_close_free;
+static void framer_free(cframer *fr)
+{
+	free(fr->fc);
+	free(fr->index.buf);
+}
+
+static int framer_add(bsdiff_ctx *ctx, cframer *fr, u_char *cb, uint64_t cblen,
+		      u_char *db, u_char *eb)
+{
+	const uint64_t frame_size = BSDIFF_STREAM_FRAME;
+	const uint32_t max_tuples = MAX(frame_size / 24, 1);
+	struct stream_index_entry entry;
+	u_char *fc = fr->fc;
+	uint64_t fclen = 0, fnew = 0, dpos = 0, dlen = 0, epos = 0, elen = 0, room, i;
+	uint64_t new_pos = fr->new_pos, old_pos = fr->old_pos, start_old = fr->old_pos;
+	int64_t add, ins, seek;
+	uint32_t ntuples = 0;
+	int ret = 0;
+
+	for (i = 0; i <= cblen && ret == 0; i += 24) {
+		/* one pass more than there are tuples, to flush the last frame */
+		if (i + 24 > cblen) {
+			add = ins = seek = 0;
+		} else {
+			add = offtin(cb + i);
+			ins = offtin(cb + i + 8);
+			seek = offtin(cb + i + 16);
+		}
+		while (ret == 0) {
+			if (ntuples > 0 && (ntuples == max_tuples || fnew == frame_size ||
+					    i + 24 > cblen)) {
+				entry.offset = fr->offset;
+				entry.new_pos = new_pos;
+				entry.old_pos = start_old;
+				ret = sink_write(&fr->index, &entry, sizeof(struct stream_index_entry));
+				if (ret == 0) {
+					ret = write_frame(ctx, fr->frames, ntuples, fc, fclen,
+							  db + dpos, dlen, eb + epos, elen,
+							  &fr->offset);
+				}
+				new_pos += fnew;
+				start_old = old_pos;
+				dpos += dlen;
+				epos += elen;
+				fclen = fnew = dlen = elen = 0;
+				ntuples = 0;
+				continue;
+			}
+			if (i + 24 > cblen) {
+				break;
+			}
+			room = frame_size - fnew;
+			if ((uint64_t)add > room) {
+				offtout(room, fc + fclen);
+				offtout(0, fc + fclen + 8);
+				offtout(0, fc + fclen + 16);
+				dlen += room;
+				fnew += room;
+				old_pos += room;
+				add -= room;
+			} else if ((uint64_t)(add + ins) > room) {
+				offtout(add, fc + fclen);
+				offtout(room - add, fc + fclen + 8);
+				offtout(0, fc + fclen + 16);
+				dlen += add;
+				elen += room - add;
+				fnew += room;
+				old_pos += add;
+				ins -= room - add;
+				add = 0;
+			} else {
+				offtout(add, fc + fclen);
+				offtout(ins, fc + fclen + 8);
+				offtout(seek, fc + fclen + 16);
+				dlen += add;
+				elen += ins;
+				fnew += add + ins;
+				old_pos += add + seek;
+				fclen += 24;
+				ntuples++;
+				break;
 			}
-			bsdiff_fulldl++;
-			goto fulldl_close_free;
+			fclen += 24;
+			ntuples++;
 		}
+	}
 
-		if (fwrite(&small_header, sizeof(struct header_v21), 1, pf) != 1) {
-			ret = -1;
-			goto fulldl_close_free;
-		}
-	} else {
-		smallfile = 0;
+	fr->new_pos = new_pos;
+	fr->old_pos = old_pos;
+	return ret;
+}
 
-		memset(&large_header, 0, sizeof(struct header_v20));
-		memcpy(&large_header.magic, BSDIFF_HDR_MAGIC_V20, 8);
+/* Fills in the header of a stream delta, or of a seekable one with entries
+ * index entries, and returns its size. */
+static uint64_t stream_header(bsdiff_ctx *ctx, struct header_stream *header,
+			      struct header_seekable *sheader, uint64_t entries,
+			      int64_t old_size, int64_t new_size,
+			      mode_t mode, uid_t uid, gid_t gid)
+{
+	if (ctx->diff_flags & BSDIFF_DIFF_SEEKABLE) {
+		memset(sheader, 0, sizeof(struct header_seekable));
+		memcpy(&sheader->magic, BSDIFF_HDR_MAGIC_SEEKABLE, 8);
+		sheader->offset_to_first_block = sizeof(struct header_seekable);
+		sheader->frame_size = BSDIFF_STREAM_FRAME;
+		sheader->entries = entries;
+		sheader->old_file_length = old_size;
+		sheader->new_file_length = new_size;
+		sheader->file_mode = mode;
+		sheader->file_owner = uid;
+		sheader->file_group = gid;
+		return sizeof(struct header_seekable) + entries * sizeof(struct stream_index_entry);
+	}
+	memset(header, 0, sizeof(struct header_stream));
+	memcpy(&header->magic, BSDIFF_HDR_MAGIC_STREAM, 8);
+	header->offset_to_first_block = sizeof(struct header_stream);
+	header->frame_size = BSDIFF_STREAM_FRAME;
+	header->old_file_length = old_size;
+	header->new_file_length = new_size;
+	header->file_mode = mode;
+	header->file_owner = uid;
+	header->file_group = gid;
+	return sizeof(struct header_stream);
+}
 
-		/* in the future we may need to push this out further to squeeze
-		 * something extra into the header */
-		first_block = sizeof(struct header_v20);
-		large_header.offset_to_first_block = first_block;
-		large_header.control_length = cblen;
-		large_header.diff_length = dblen;
-		large_header.extra_length = eblen;
-		large_header.old_file_length = old_size;
-		large_header.new_file_length = new_size;
-		large_header.file_mode = new_stat.st_mode;
-		large_header.file_owner = new_stat.st_uid;
-		large_header.file_group = new_stat.st_gid;
+/* Writes a header filled in by stream_header(), and the index that goes
+ * with a seekable one. */
+static int stream_header_write(bsdiff_ctx *ctx, csink *sink, struct header_stream *header,
+			       struct header_seekable *sheader, csink *index)
+{
+	if (ctx->diff_flags & BSDIFF_DIFF_SEEKABLE) {
+		if (sink_write(sink, sheader, sizeof(struct header_seekable)) < 0) {
+			return -1;
+		}
+		return sink_write(sink, index->buf, index->len);
+	}
+	return sink_write(sink, header, sizeof(struct header_stream));
+}
 
-		cblock_set_enc(&large_header.encoding, c_enc);
-		dblock_set_enc(&large_header.encoding, d_enc);
-		eblock_set_enc(&large_header.encoding, e_enc);
-		encodings = large_header.encoding;
+/* Writes the uncompressed blocks of diff_sorted() as a stream delta. The
+ * frames are built in memory first so that a delta that does not pay off
+ * can still become FULLDL, and so that a seekable delta can put the index
+ * of the frames in front of them. */
+static int write_stream(bsdiff_ctx *ctx, u_char *cb, uint64_t cblen,
+			u_char *db, u_char *eb, int64_t old_size, int64_t new_size,
+			mode_t mode, uid_t uid, gid_t gid, csink *sink)
+{
+	struct header_stream header;
+	struct header_seekable sheader;
+	uint64_t entries, hlen;
+	cframer fr;
+	csink frames;
+	int ret;
+
+	memset(&frames, 0, sizeof(csink));
+	frames.growable = 1;
+	if (framer_init(&fr, &frames) < 0) {
+		return -1;
+	}
 
-		if ((first_block + cblen + dblen + eblen > 0.90 * new_size) && (enc != BSDIFF_ENC_NONE)) { /* tune */
-			memcpy(&large_header.magic, BSDIFF_HDR_FULLDL, 8);
-			ret = 1;
-			if (fwrite(&large_header, 8, 1, pf) != 1) {
-				ret = -1;
-				goto fulldl_close_free;
-			}
-			bsdiff_fulldl++;
-			goto fulldl_close_free;
-		}
+	ret = framer_add(ctx, &fr, cb, cblen, db, eb);
+	entries = fr.index.len / sizeof(struct stream_index_entry);
+	if (ret < 0 || entries > UINT32_MAX) {
+		free(frames.buf);
+		framer_free(&fr);
+		return -1;
+	}
 
-		if (fwrite(&large_header, sizeof(struct header_v20), 1, pf) != 1) {
-			ret = -1;
-			goto fulldl_close_free;
-		}
+	hlen = stream_header(ctx, &header, &sheader, entries, old_size, new_size,
+			     mode, uid, gid);
+
+	if ((hlen + frames.len > ctx->tune.fulldl_ratio * new_size) && (ctx->enc != BSDIFF_ENC_NONE)) { /* tune */
+		free(frames.buf);
+		framer_free(&fr);
+		ctx->stats.fulldl++;
+		return write_fulldl(sink) < 0 ? -1 : 1;
 	}
 
-	if (fwrite(cb, cblen, 1, pf) != 1) {
-		ret = -1;
-		goto fulldl_close_free;
+	ret = stream_header_write(ctx, sink, &header, &sheader, &fr.index);
+	if (ret == 0) {
+		ret = sink_write(sink, frames.buf, frames.len);
 	}
-	if (dblen > 0 && fwrite(db, dblen, 1, pf) != 1) {
-		ret = -1;
-		goto fulldl_close_free;
+	if (ret == 0) {
+		ctx->stats.files++;
+		ctx->stats.newbytes += new_size;
+		ctx->stats.outputbytes += hlen + frames.len;
 	}
-	if (eblen > 0 && fwrite(eb, eblen, 1, pf) != 1) {
-		ret = -1;
-		goto fulldl_close_free;
+	free(frames.buf);
+	framer_free(&fr);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/* Windowed diff, for files too large to suffix sort whole. The new file is
+ * cut into segments of BSDIFF_WINDOW_NEW bytes, and each is diffed against
+ * a window of BSDIFF_WINDOW_OLD bytes of the old file, so only the window
+ * is ever sorted. The window is where most of the segment's blocks are
+ * found through a coarse index of the old file: the rolling hash of every
+ * aligned BSDIFF_WINDOW_BLOCK bytes. The output is a stream delta, whose
+ * seeks are relative and whose positions are 64-bit. */
+#define BSDIFF_WINDOW_NEW (16 * 1024 * 1024)
+#define BSDIFF_WINDOW_OLD (2 * BSDIFF_WINDOW_NEW)
+#define BSDIFF_WINDOW_BLOCK 4096
+#define BSDIFF_WINDOW_CHUNKS 8 /* votes are counted per 1/8 of a window */
+#define BSDIFF_WINDOW_HASH 0x01000193u
+
+/* Index slots hold hash << 32 | (block + 1), or 0 when free. A hash seen in
+ * more than one block has its block set to BSDIFF_WINDOW_AMBIGUOUS, since
+ * a match on it says nothing about where the segment is. */
+#define BSDIFF_WINDOW_AMBIGUOUS 0xffffffffu
+
+typedef struct {
+	uint64_t *slot;
+	uint64_t mask;
+	uint32_t top; /* BSDIFF_WINDOW_HASH to the power BSDIFF_WINDOW_BLOCK - 1 */
+} cwindex;
+
+static uint32_t window_hash(const u_char *p)
+{
+	uint32_t h = 0;
+	int i;
+
+	for (i = 0; i < BSDIFF_WINDOW_BLOCK; i++) {
+		h = h * BSDIFF_WINDOW_HASH + p[i];
 	}
+	return h;
+}
 
-	bsdiff_files++;
-	bsdiff_newbytes += new_size;
-	bsdiff_outputbytes += first_block + cblen + dblen + eblen;
+static int windex_build(cwindex *x, u_char *old_data, int64_t old_size)
+{
+	uint64_t blocks = old_size / BSDIFF_WINDOW_BLOCK, size = 1, b, i, v;
+	uint32_t h;
+	int k;
 
-	if (cblock_get_enc(encodings) == BSDIFF_ENC_NONE) {
-		bsdiff_none++;
+	while (size < 2 * blocks) {
+		size *= 2;
 	}
-	if (dblock_get_enc(encodings) == BSDIFF_ENC_NONE) {
-		bsdiff_none++;
+	if (blocks >= BSDIFF_WINDOW_AMBIGUOUS - 1 ||
+	    (x->slot = calloc(size, sizeof(uint64_t))) == NULL) {
+		return -1;
 	}
-	if (eblock_get_enc(encodings) == BSDIFF_ENC_NONE) {
-		bsdiff_none++;
+	x->mask = size - 1;
+	x->top = 1;
+	for (k = 1; k < BSDIFF_WINDOW_BLOCK; k++) {
+		x->top *= BSDIFF_WINDOW_HASH;
 	}
-	if (cblock_get_enc(encodings) == BSDIFF_ENC_GZIP) {
-		bsdiff_gzip++;
+
+	for (b = 0; b < blocks; b++) {
+		h = window_hash(old_data + b * BSDIFF_WINDOW_BLOCK);
+		for (i = h & x->mask;; i = (i + 1) & x->mask) {
+			v = x->slot[i];
+			if (v == 0) {
+				x->slot[i] = (uint64_t)h << 32 | (b + 1);
+				break;
+			}
+			if (v >> 32 == h) {
+				x->slot[i] = (uint64_t)h << 32 | BSDIFF_WINDOW_AMBIGUOUS;
+				break;
+			}
+		}
 	}
-	if (dblock_get_enc(encodings) == BSDIFF_ENC_GZIP) {
-		bsdiff_gzip++;
+	return 0;
+}
+
+/* Returns the old block whose hash is h, or -1 if none or several. */
+static int64_t windex_find(cwindex *x, uint32_t h)
+{
+	uint64_t i, v;
+
+	for (i = h & x->mask; (v = x->slot[i]) != 0; i = (i + 1) & x->mask) {
+		if (v >> 32 == h) {
+			v &= 0xffffffffu;
+			return v == BSDIFF_WINDOW_AMBIGUOUS ? -1 : (int64_t)v - 1;
+		}
 	}
-	if (eblock_get_enc(encodings) == BSDIFF_ENC_GZIP) {
-		bsdiff_gzip++;
+	return -1;
+}
+
+/* a block of the new segment found in the old file */
+typedef struct {
+	int64_t new_off; /* from the start of the segment */
+	int64_t old_off;
+} cwmatch;
+
+/* Picks the start of the old window for new_data[start, start + len):
+ * the run of chunks where the most of its blocks are found, or the same
+ * relative place in the old file if none are. The blocks found are put in
+ * m, which has room for len / BSDIFF_WINDOW_BLOCK, and counted in *nm. */
+static int64_t window_pick(cwindex *x, uint64_t *votes, uint64_t chunks,
+			   u_char *old_data, int64_t old_size, u_char *new_data,
+			   int64_t new_size, int64_t start, int64_t len,
+			   cwmatch *m, size_t *nm)
+{
+	const int64_t chunk = BSDIFF_WINDOW_OLD / BSDIFF_WINDOW_CHUNKS;
+	uint64_t sum, best = 0, total = 0;
+	int64_t p, b, best_chunk = 0, window_chunks = BSDIFF_WINDOW_CHUNKS;
+	uint32_t h = 0;
+	int fresh = 1;
+	u_char *n = new_data + start;
+
+	memset(votes, 0, chunks * sizeof(uint64_t));
+	*nm = 0;
+	for (p = 0; p + BSDIFF_WINDOW_BLOCK <= len;) {
+		if (fresh) {
+			h = window_hash(n + p);
+			fresh = 0;
+		}
+		b = windex_find(x, h);
+		if (b >= 0 && memcmp(old_data + b * BSDIFF_WINDOW_BLOCK, n + p,
+				     BSDIFF_WINDOW_BLOCK) == 0) {
+			votes[b * BSDIFF_WINDOW_BLOCK / chunk]++;
+			m[*nm].new_off = p;
+			m[*nm].old_off = b * BSDIFF_WINDOW_BLOCK;
+			(*nm)++;
+			total++;
+			p += BSDIFF_WINDOW_BLOCK;
+			fresh = 1;
+			continue;
+		}
+		if (p + BSDIFF_WINDOW_BLOCK < len) {
+			h = (h - n[p] * x->top) * BSDIFF_WINDOW_HASH + n[p + BSDIFF_WINDOW_BLOCK];
+		}
+		p++;
 	}
-	if (cblock_get_enc(encodings) == BSDIFF_ENC_BZIP2) {
-		bsdiff_bzip2++;
+
+	if (total == 0) {
+		p = (int64_t)((double)start / new_size * old_size);
+		return MAX(0, MIN(p, old_size - BSDIFF_WINDOW_OLD));
 	}
-	if (dblock_get_enc(encodings) == BSDIFF_ENC_BZIP2) {
-		bsdiff_bzip2++;
+
+	for (sum = 0, b = 0; b < (int64_t)chunks; b++) {
+		sum += votes[b];
+		if (b >= window_chunks) {
+			sum -= votes[b - window_chunks];
+		}
+		if (sum > best) {
+			best = sum;
+			best_chunk = MAX(0, b - window_chunks + 1);
+		}
 	}
-	if (eblock_get_enc(encodings) == BSDIFF_ENC_BZIP2) {
-		bsdiff_bzip2++;
+	return MAX(0, MIN(best_chunk * chunk, old_size - BSDIFF_WINDOW_OLD));
+}
+
+/* Shortens a segment of len bytes whose blocks are found both in its
+ * window at os and elsewhere: it is cut where they move into or out of the
+ * window, and the rest gets a window of its own. A cut keeps at least a
+ * quarter of the segment. Sets *repick when what is kept lies outside the
+ * window. */
+static int64_t window_cut(cwmatch *m, size_t nm, int64_t os, int64_t len, int *repick)
+{
+	size_t i, first = nm, last = nm;
+
+	*repick = 0;
+	for (i = 0; i < nm; i++) {
+		if (m[i].old_off >= os && m[i].old_off + BSDIFF_WINDOW_BLOCK <= os + BSDIFF_WINDOW_OLD) {
+			if (first == nm) {
+				first = i;
+			}
+			last = i;
+		}
 	}
-	if (cblock_get_enc(encodings) == BSDIFF_ENC_XZ) {
-		bsdiff_xz++;
+	if (first == nm) {
+		return len;
 	}
-	if (dblock_get_enc(encodings) == BSDIFF_ENC_XZ) {
-		bsdiff_xz++;
+	if (first > 0 && m[first].new_off >= len / 4) {
+		*repick = 1;
+		return m[first].new_off;
 	}
-	if (eblock_get_enc(encodings) == BSDIFF_ENC_XZ) {
-		bsdiff_xz++;
+	if (last + 1 < nm && m[last].new_off + BSDIFF_WINDOW_BLOCK >= len / 4) {
+		return m[last].new_off + BSDIFF_WINDOW_BLOCK;
 	}
-	if (dblock_get_enc(encodings) == BSDIFF_ENC_ZEROS) {
-		bsdiff_zeros++;
+	return len;
+}
+
+/* Files above BSDIFF_MAX_FILESZ, which bspatch could not hold in memory as
+ * a v2 delta, are always diffed in windows. */
+static int use_windows(bsdiff_ctx *ctx, int64_t old_size, int64_t new_size)
+{
+	return (ctx->diff_flags & BSDIFF_DIFF_WINDOWED) ||
+	       old_size > BSDIFF_MAX_FILESZ || new_size > BSDIFF_MAX_FILESZ;
+}
+
+static int diff_windowed(bsdiff_ctx *ctx, u_char *old_data, int64_t old_size,
+			 u_char *new_data, int64_t new_size,
+			 mode_t mode, uid_t uid, gid_t gid, csink *sink)
+{
+	const int64_t chunk = BSDIFF_WINDOW_OLD / BSDIFF_WINDOW_CHUNKS;
+	int seekable = ctx->diff_flags & BSDIFF_DIFF_SEEKABLE;
+	struct header_stream header;
+	struct header_seekable sheader;
+	uint64_t chunks = (old_size + chunk - 1) / chunk, entries, hlen, cblen, dblen, eblen;
+	int64_t start, len, os, olen, sorted = -1;
+	u_char *cb = NULL, *db = NULL, *eb = NULL;
+	uint64_t *votes = NULL, deadline = scan_deadline(ctx);
+	cindex ix;
+	cwmatch *m = NULL;
+	size_t nm;
+	int repick;
+	csink frames;
+	cframer fr;
+	cwindex x;
+	int ret = -1;
+
+	memset(&x, 0, sizeof(cwindex));
+	memset(&frames, 0, sizeof(csink));
+	frames.growable = 1;
+	/* the index of a seekable delta goes in front, so its frames are
+	 * gathered first */
+	if (framer_init(&fr, seekable ? &frames : sink) < 0) {
+		return -1;
 	}
-	if (eblock_get_enc(encodings) == BSDIFF_ENC_ZEROS) {
-		bsdiff_zeros++;
+	if (windex_build(&x, old_data, old_size) < 0 ||
+	    (votes = malloc(MAX(chunks, 1) * sizeof(uint64_t))) == NULL ||
+	    (m = malloc(BSDIFF_WINDOW_NEW / BSDIFF_WINDOW_BLOCK * sizeof(cwmatch))) == NULL ||
+	    (cb = malloc(BSDIFF_WINDOW_NEW + 25 + 24)) == NULL ||
+	    (db = malloc(BSDIFF_WINDOW_NEW + 25)) == NULL ||
+	    (eb = malloc(BSDIFF_WINDOW_NEW + 25)) == NULL) {
+		goto out;
 	}
 
+	if (!seekable) {
+		hlen = stream_header(ctx, &header, &sheader, 0, old_size, new_size,
+				     mode, uid, gid);
+		if (stream_header_write(ctx, sink, &header, &sheader, NULL) < 0) {
+			goto out;
+		}
+	}
+
+	for (start = 0; start < new_size; start += len) {
+		len = MIN(BSDIFF_WINDOW_NEW, new_size - start);
+		os = window_pick(&x, votes, chunks, old_data, old_size, new_data,
+				 new_size, start, len, m, &nm);
+		len = window_cut(m, nm, os, len, &repick);
+		if (repick) {
+			os = window_pick(&x, votes, chunks, old_data, old_size, new_data,
+					 new_size, start, len, m, &nm);
+		}
+		olen = MIN(BSDIFF_WINDOW_OLD, old_size - os);
+
+		/* a window that has not moved is still sorted */
+		if (os != sorted) {
+			if (index_old(ctx, old_data + os, olen, &ix) < 0) {
+				goto out;
+			}
+			sorted = os;
+		}
+
+		if (diff_blocks(ctx, &ix, old_data + os, olen, new_data + start, len,
+				cb + 24, &cblen, db, &dblen, eb, &eblen, UINT64_MAX, deadline) < 0) {
+			goto out;
+		}
+		/* the tuples are relative to the window; lead in with a seek
+		 * from wherever the last segment left off */
+		offtout(0, cb);
+		offtout(0, cb + 8);
+		offtout(os - fr.old_pos, cb + 16);
+		if (framer_add(ctx, &fr, cb, cblen + 24, db, eb) < 0) {
+			goto out;
+		}
+	}
+
+	entries = fr.index.len / sizeof(struct stream_index_entry);
+	if (seekable) {
+		if (entries > UINT32_MAX) {
+			goto out;
+		}
+		hlen = stream_header(ctx, &header, &sheader, entries, old_size, new_size,
+				     mode, uid, gid);
+		if (stream_header_write(ctx, sink, &header, &sheader, &fr.index) < 0 ||
+		    sink_write(sink, frames.buf, frames.len) < 0) {
+			goto out;
+		}
+	}
+
+	ctx->stats.files++;
+	ctx->stats.newbytes += new_size;
+	ctx->stats.outputbytes += hlen + fr.offset;
 	ret = 0;
 
-fulldl_close_free:
-	if (fclose(pf)) {
+out:
+	free(cb);
+	free(db);
+	free(eb);
+	free(votes);
+	free(m);
+	free(x.slot);
+	free(frames.buf);
+	framer_free(&fr);
+	return ret;
+}
+
+/* Computes the delta from old_data, indexed into ix by index_old(), to
+ * new_data, and writes it to sink with the given file metadata. smallfile
+ * allows the v21 header, and ratio is the compression ratio found by
+ * predict_fulldl(), if any. Returns <0 on error, 0 on success, and 1 when
+ * a FULLDL header was written instead. */
+static int diff_sorted(bsdiff_ctx *ctx, cindex *ix,
+		       u_char *old_data, int64_t old_size,
+		       u_char *new_data, int64_t new_size,
+		       mode_t mode, uid_t uid, gid_t gid, int smallfile,
+		       double ratio, csink *sink)
+{
+	int enc = ctx->enc;
+	uint64_t cblen, dblen, eblen, eb_limit = UINT64_MAX;
+	u_char *cb, *db, *eb;
+	int ret;
+	off_t first_block;
+	int c_enc, d_enc, e_enc;
+	enc_flags_t encodings;
+
+	struct header_v20 large_header;
+	struct header_v21 small_header;
+	struct header_v30 v3_header;
+	u_char v3_buf[BSDIFF_V30_MAX_HEADER];
+	digest_ctx digest;
+	uint32_t sample;
+
+	/* we can write 3 8 byte tupples extra, so allocate some headroom */
+	if ((cb = malloc(new_size + 25)) == NULL) {
+		return -1;
+	}
+	if ((db = malloc(new_size + 25)) == NULL) {
+		free(cb);
+		return -1;
+	}
+	if ((eb = malloc(new_size + 25)) == NULL) {
+		free(cb);
+		free(db);
+		return -1;
+	}
+
+	/* the extra block should compress about as well as the new file, so
+	 * past this the delta can only be FULLDL */
+	if (ratio > 0) {
+		eb_limit = ctx->tune.fulldl_ratio * new_size / ratio;
+	}
+	ret = diff_blocks(ctx, ix, old_data, old_size, new_data, new_size,
+			  cb, &cblen, db, &dblen, eb, &eblen, eb_limit, scan_deadline(ctx));
+	if (ret != 0) {
+		if (ret > 0) {
+			ret = write_fulldl(sink) < 0 ? -1 : 1;
+			ctx->stats.fulldl++;
+			ctx->stats.early++;
+		}
+		goto out;
+	}
+
+	if (ctx->diff_flags & (BSDIFF_DIFF_STREAM | BSDIFF_DIFF_SEEKABLE)) {
+		ret = write_stream(ctx, cb, cblen, db, eb, old_size, new_size,
+				   mode, uid, gid, sink);
+		goto out;
+	}
+
+	c_enc = make_small(&cb, &cblen, enc, ctx, NULL, "control");
+	d_enc = make_small(&db, &dblen, enc, ctx, NULL, "diff   ");
+	e_enc = make_small(&eb, &eblen, enc, ctx, NULL, "extra  ");
+
+	if ((!cb) || (!db) || (!eb)) {
 		ret = -1;
+		goto out;
 	}
-	rename(delta_filename_unique, delta_filename);
-fulldl_free:
-	/* Free the memory we used */
-	munmap(old_data, old_size);
-	free(new_data);
+
+	if (ctx->diff_flags & (BSDIFF_DIFF_V3 | BSDIFF_DIFF_CHECKSUM |
+			       BSDIFF_DIFF_DIGEST | BSDIFF_DIFF_DIGEST_SHA256 |
+			       BSDIFF_DIFF_OLD_DIGEST | BSDIFF_DIFF_OLD_SAMPLES)) {
+		memset(&v3_header, 0, sizeof(struct header_v30));
+		v3_header.old_file_length = old_size;
+		v3_header.new_file_length = new_size;
+		v3_header.file_mode = mode;
+		v3_header.file_owner = uid;
+		v3_header.file_group = gid;
+		v3_header.encoding[BSDIFF_BLOCK_CONTROL] = c_enc;
+		v3_header.encoding[BSDIFF_BLOCK_DIFF] = d_enc;
+		v3_header.encoding[BSDIFF_BLOCK_EXTRA] = e_enc;
+		v3_header.length[BSDIFF_BLOCK_CONTROL] = cblen;
+		v3_header.length[BSDIFF_BLOCK_DIFF] = dblen;
+		v3_header.length[BSDIFF_BLOCK_EXTRA] = eblen;
+		if (ctx->diff_flags & BSDIFF_DIFF_CHECKSUM) {
+			v3_header.features |= BSDIFF_V30_BLOCK_CRC;
+			v3_header.crc[BSDIFF_BLOCK_CONTROL] = crc32(0, cb, cblen);
+			v3_header.crc[BSDIFF_BLOCK_DIFF] = crc32(0, db, dblen);
+			v3_header.crc[BSDIFF_BLOCK_EXTRA] = crc32(0, eb, eblen);
+		}
+		if (ctx->diff_flags & (BSDIFF_DIFF_DIGEST | BSDIFF_DIFF_DIGEST_SHA256)) {
+			v3_header.features |= BSDIFF_V30_NEW_DIGEST;
+			v3_header.digest_alg = ctx->diff_flags & BSDIFF_DIFF_DIGEST_SHA256 ?
+						       BSDIFF_DIGEST_SHA256 : BSDIFF_DIGEST_CRC32;
+			digest_init(&digest, v3_header.digest_alg);
+			digest_update(&digest, new_data, new_size);
+			digest_final(&digest, v3_header.new_digest);
+		}
+		if (ctx->diff_flags & BSDIFF_DIFF_OLD_DIGEST) {
+			v3_header.features |= BSDIFF_V30_OLD_DIGEST;
+			v3_header.old_digest_alg = ctx->diff_flags & BSDIFF_DIFF_DIGEST_SHA256 ?
+							   BSDIFF_DIGEST_SHA256 : BSDIFF_DIGEST_CRC32;
+			digest_init(&digest, v3_header.old_digest_alg);
+			digest_update(&digest, old_data, old_size);
+			digest_final(&digest, v3_header.old_digest);
+		}
+		if (ctx->diff_flags & BSDIFF_DIFF_OLD_SAMPLES) {
+			v3_header.features |= BSDIFF_V30_OLD_SAMPLES;
+			v3_header.sample_size = BSDIFF_OLD_SAMPLE_SIZE;
+			v3_header.sample_count = MIN(BSDIFF_OLD_SAMPLES,
+						     (old_size + BSDIFF_OLD_SAMPLE_SIZE - 1) /
+							     BSDIFF_OLD_SAMPLE_SIZE);
+			for (sample = 0; sample < v3_header.sample_count; sample++) {
+				v3_header.samples[sample] = old_sample(old_data, old_size,
+								       BSDIFF_OLD_SAMPLE_SIZE,
+								       v3_header.sample_count, sample);
+			}
+		}
+		first_block = header_v30_write(v3_buf, &v3_header);
+
+		memset(&encodings, 0, sizeof(enc_flags_t));
+		cblock_set_enc(&encodings, c_enc);
+		dblock_set_enc(&encodings, d_enc);
+		eblock_set_enc(&encodings, e_enc);
+
+		if ((first_block + cblen + dblen + eblen > ctx->tune.fulldl_ratio * new_size) && (enc != BSDIFF_ENC_NONE)) { /* tune */
+			ret = write_fulldl(sink) < 0 ? -1 : 1;
+			ctx->stats.fulldl++;
+			goto out;
+		}
+
+		if (sink_write(sink, v3_buf, first_block) < 0) {
+			ret = -1;
+			goto out;
+		}
+	} else if (smallfile && (cblen < 256) && (dblen < 65536) && (eblen < 65536)) {
+		memset(&small_header, 0, sizeof(struct header_v21));
+		memcpy(&small_header.magic, BSDIFF_HDR_MAGIC_V21, 8);
+
+		/* in the future we may need to push first_block out further to squeeze
+		 * something extra into the header */
+		first_block = sizeof(struct header_v21);
+		small_header.offset_to_first_block = first_block;
+		small_header.control_length = cblen;
+		small_header.diff_length = dblen;
+		small_header.extra_length = eblen;
+		small_header.old_file_length = old_size;
+		small_header.new_file_length = new_size;
+		small_header.file_mode = mode;
+		small_header.file_owner = uid;
+		small_header.file_group = gid;
+
+		cblock_set_enc(&small_header.encoding, c_enc);
+		dblock_set_enc(&small_header.encoding, d_enc);
+		eblock_set_enc(&small_header.encoding, e_enc);
+		encodings = small_header.encoding;
+
+		if ((first_block + cblen + dblen + eblen > ctx->tune.fulldl_ratio * new_size) && (enc != BSDIFF_ENC_NONE)) { /* tune */
+			memcpy(&small_header.magic, BSDIFF_HDR_FULLDL, 8);
+			ret = 1;
+			if (sink_write(sink, &small_header, 8) < 0) {
+				ret = -1;
+				goto out;
+			}
+			ctx->stats.fulldl++;
+			goto out;
+		}
+
+		if (sink_write(sink, &small_header, sizeof(struct header_v21)) < 0) {
+			ret = -1;
+			goto out;
+		}
+	} else {
+		smallfile = 0;
+
+		memset(&large_header, 0, sizeof(struct header_v20));
+		memcpy(&large_header.magic, BSDIFF_HDR_MAGIC_V20, 8);
+
+		/* in the future we may need to push this out further to squeeze
+		 * something extra into the header */
+		first_block = sizeof(struct header_v20);
+		large_header.offset_to_first_block = first_block;
+		large_header.control_length = cblen;
+		large_header.diff_length = dblen;
+		large_header.extra_length = eblen;
+		large_header.old_file_length = old_size;
+		large_header.new_file_length = new_size;
+		large_header.file_mode = mode;
+		large_header.file_owner = uid;
+		large_header.file_group = gid;
+
+		cblock_set_enc(&large_header.encoding, c_enc);
+		dblock_set_enc(&large_header.encoding, d_enc);
+		eblock_set_enc(&large_header.encoding, e_enc);
+		encodings = large_header.encoding;
+
+		if ((first_block + cblen + dblen + eblen > ctx->tune.fulldl_ratio * new_size) && (enc != BSDIFF_ENC_NONE)) { /* tune */
+			memcpy(&large_header.magic, BSDIFF_HDR_FULLDL, 8);
+			ret = 1;
+			if (sink_write(sink, &large_header, 8) < 0) {
+				ret = -1;
+				goto out;
+			}
+			ctx->stats.fulldl++;
+			goto out;
+		}
+
+		if (sink_write(sink, &large_header, sizeof(struct header_v20)) < 0) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	if (sink_write(sink, cb, cblen) < 0) {
+		ret = -1;
+		goto out;
+	}
+	if (sink_write(sink, db, dblen) < 0) {
+		ret = -1;
+		goto out;
+	}
+	if (sink_write(sink, eb, eblen) < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	ctx->stats.files++;
+	ctx->stats.newbytes += new_size;
+	ctx->stats.outputbytes += first_block + cblen + dblen + eblen;
+
+	count_encodings(ctx, encodings);
+
+	ret = 0;
+
+out:
 	free(cb);
 	free(db);
 	free(eb);
 
 	return ret;
 }
+
+/* Writes the delta between two files to sink. Returns <0 on error, 0 on
+ * success, and 1 on "success" with a FULLDL header */
+static int diff_files(bsdiff_ctx *ctx, char *old_filename, char *new_filename,
+		      csink *sink)
+{
+	unsigned int flags = ctx->diff_flags;
+	int fd;
+	u_char *old_data, *new_data;
+	int64_t old_size, new_size;
+	cindex ix;
+	struct stat new_stat;
+	struct stat old_stat;
+	int ret, smallfile, indexed, hopeless;
+	double ratio;
+	bsio *io = NULL;
+
+	ret = lstat(old_filename, &old_stat);
+	if (ret < 0) {
+		return -1;
+	}
+
+	ret = lstat(new_filename, &new_stat);
+	if (ret < 0) {
+		return -1;
+	}
+
+	ret = 0;
+
+	if (S_ISDIR(new_stat.st_mode) || S_ISDIR(old_stat.st_mode)) {
+		/* no delta on symlinks ! */
+		return -1;
+	}
+
+	if ((new_stat.st_size < ctx->tune.small_max) && (old_stat.st_size < ctx->tune.small_max)) {
+		smallfile = 1;
+	} else {
+		smallfile = 0;
+	}
+
+	fd = open(old_filename, O_RDONLY, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &old_stat) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	old_size = old_stat.st_size;
+
+	/* We may start with an empty file, if so, just mark it for full download
+	 * to throw into the pack. In the case that newfile is <200, it will quit
+	 * and ask for fulldownload, so we only need to check old_size */
+	if (old_size == 0) {
+		close(fd);
+		return write_fulldl(sink) < 0 ? -1 : 1;
+	}
+
+	/* TODO: investigate why this needs to be +1 to not overrun; coverity complains
+	 * that we overrun old_data when we calculate differences otherwise. Tenatively,
+	 * since this is used in qsufsort, it may need to be +1 like I and V because of
+	 * a sentinel byte when sorting. However, new_size does not cause any overruns
+	 * when created with the regular file size */
+	old_data = mmap(NULL, old_size + 1, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (old_data == MAP_FAILED) {
+		old_data = NULL;
+		return -1;
+	}
+
+	if ((fd = open(new_filename, O_RDONLY, 0)) < 0) {
+		munmap(old_data, old_size);
+		return -1;
+	}
+
+	if (fstat(fd, &new_stat) != 0) {
+		munmap(old_data, old_size);
+		close(fd);
+		return -1;
+	}
+
+	new_size = new_stat.st_size;
+
+	/* Note: testing this to see how diffs between small files affect
+	 * updates. Small files seem to cause some problems between certain
+	 * files (buffer overrun/underrun perhaps). We try to avoid this
+	 * preemptively by marking the file as a FULLDL file and not create
+	 * a bsdiff at all, which leaves us with small files that may fail
+	 * the "is bsdiff < 90% of newfile size" check that would otherwise
+	 * be performed later on.
+	 */
+	if (new_size < ctx->tune.fulldl_min_size) {
+		close(fd);
+		munmap(old_data, old_size);
+		return write_fulldl(sink) < 0 ? -1 : 1;
+	}
+
+	/* windows only ever need part of either file at a time */
+	if (use_windows(ctx, old_size, new_size)) {
+		new_data = mmap(NULL, new_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (new_data == MAP_FAILED) {
+			munmap(old_data, old_size);
+			return -1;
+		}
+		ret = diff_windowed(ctx, old_data, old_size, new_data, new_size,
+				    new_stat.st_mode, new_stat.st_uid, new_stat.st_gid, sink);
+		munmap(new_data, new_size);
+		munmap(old_data, old_size);
+		return ret;
+	}
+
+	if ((new_data = ctx_buf(ctx, BSDIFF_BUF_NEW, new_size)) == NULL) {
+		close(fd);
+		munmap(old_data, old_size);
+		return -1;
+	}
+
+	/* With the io_uring engine the new file is read while the old file
+	 * is being sorted; otherwise it is read here, up front. */
+	if (flags & BSDIFF_DIFF_IO_URING) {
+		io = bsio_open(new_data, new_size);
+	}
+	if (io && bsio_read(io, fd, new_data, new_size, 0) < 0) {
+		bsio_close(io);
+		io = NULL;
+	}
+	if (io) {
+		ret = 0;
+	} else {
+		ret = pread(fd, new_data, new_size, 0) == new_size ? 0 : -1;
+	}
+	if (ret < 0) {
+		close(fd);
+		munmap(old_data, old_size);
+		return -1;
+	}
+
+	/* a hopeless pair is not worth sorting; with io_uring the new file
+	 * is only all here once the sort is done, which leaves the scan and
+	 * the compression to save */
+	hopeless = io ? 0 : predict_fulldl(ctx, old_data, old_size, new_data, new_size, &ratio);
+	indexed = hopeless ? 0 : index_old(ctx, old_data, old_size, &ix);
+
+	if (io) {
+		ret = bsio_wait(io);
+		bsio_close(io);
+		/* a ring that failed part way leaves holes; read it all again */
+		if (ret < 0) {
+			ret = pread(fd, new_data, new_size, 0) == new_size ? 0 : -1;
+		}
+	}
+	if (close(fd) == -1) {
+		ret = -1;
+	}
+	if (indexed < 0 || ret < 0) {
+		munmap(old_data, old_size);
+		return -1;
+	}
+
+	if (io) {
+		hopeless = predict_fulldl(ctx, old_data, old_size, new_data, new_size, &ratio);
+	}
+	if (hopeless) {
+		ret = write_fulldl(sink) < 0 ? -1 : 1;
+		ctx->stats.fulldl++;
+		ctx->stats.early++;
+	} else {
+		ret = diff_sorted(ctx, &ix, old_data, old_size, new_data, new_size,
+				  new_stat.st_mode, new_stat.st_uid, new_stat.st_gid,
+				  smallfile, ratio, sink);
+	}
+
+	munmap(old_data, old_size);
+
+	return ret;
+}
+
+/* Directory archives (DIR_V20). The tree under newdir is walked in sorted
+ * order, directories before their contents, and each regular file becomes
+ * a delta against the same name under olddir, or a FULLDL entry when there
+ * is no such file or no useful delta. Symlinks and special files are left
+ * to the caller. */
+
+typedef struct {
+	csink index;
+	csink solid;
+	FILE *data; /* data area, until the sizes before it are known */
+	uint64_t data_len;
+	uint32_t entries;
+} carchive;
+
+static int dir_add(carchive *a, int type, char *name, struct stat *sb,
+		   uint64_t offset, uint64_t length)
+{
+	struct dir_entry_v20 e;
+	size_t len = strlen(name);
+
+	if (len > UINT16_MAX || a->entries == UINT32_MAX) {
+		return -1;
+	}
+	memset(&e, 0, sizeof(struct dir_entry_v20));
+	e.type = type;
+	e.name_length = len;
+	e.file_mode = sb->st_mode;
+	e.file_owner = sb->st_uid;
+	e.file_group = sb->st_gid;
+	e.offset = offset;
+	e.length = length;
+	if (sink_write(&a->index, &e, sizeof(struct dir_entry_v20)) < 0 ||
+	    sink_write(&a->index, name, len) < 0) {
+		return -1;
+	}
+	a->entries++;
+
+	return 0;
+}
+
+static int dir_add_file(bsdiff_ctx *ctx, carchive *a, char *old_filename,
+			char *new_filename, char *name, struct stat *sb)
+{
+	struct stat old_stat;
+	csink sink;
+	int enc = ctx->enc;
+	int ret;
+
+	if (lstat(old_filename, &old_stat) != 0 || !S_ISREG(old_stat.st_mode)) {
+		return dir_add(a, BSDIFF_DIR_FULLDL, name, sb, 0, 0);
+	}
+
+	/* Deltas that fit the small v21 header go into the solid stream
+	 * with raw blocks. The FULLDL shortcuts for tiny and empty files do
+	 * not depend on the encoding, so they hold for both passes. */
+	memset(&sink, 0, sizeof(csink));
+	sink.growable = 1;
+	ret = -1;
+	if (sb->st_size < ctx->tune.small_max && old_stat.st_size < ctx->tune.small_max) {
+		ctx->enc = BSDIFF_ENC_NONE;
+		ret = diff_files(ctx, old_filename, new_filename, &sink);
+		ctx->enc = enc;
+		if (ret == 0 && memcmp(sink.buf, BSDIFF_HDR_MAGIC_V21, 8) == 0) {
+			ret = dir_add(a, BSDIFF_DIR_SOLID, name, sb, a->solid.len, sink.len);
+			if (ret == 0) {
+				ret = sink_write(&a->solid, sink.buf, sink.len);
+			}
+			free(sink.buf);
+			return ret;
+		}
+		free(sink.buf);
+		sink.buf = NULL;
+		sink.len = sink.cap = 0;
+	}
+	if (ret != 1) {
+		ret = diff_files(ctx, old_filename, new_filename, &sink);
+	}
+
+	/* files bsdiff can't handle are left to full download, like a
+	 * delta that does not pay off */
+	if (ret != 0) {
+		ret = dir_add(a, BSDIFF_DIR_FULLDL, name, sb, 0, 0);
+	} else {
+		ret = dir_add(a, BSDIFF_DIR_DELTA, name, sb, a->data_len, sink.len);
+		if (ret == 0 && fwrite(sink.buf, sink.len, 1, a->data) != 1) {
+			ret = -1;
+		}
+		a->data_len += sink.len;
+	}
+	free(sink.buf);
+
+	return ret;
+}
+
+static int dir_walk(bsdiff_ctx *ctx, carchive *a, char *olddir, char *newdir,
+		    char *name)
+{
+	char path[PATH_MAX], old_path[PATH_MAX], new_path[PATH_MAX];
+	struct dirent **list;
+	struct stat sb;
+	int i, n, ret = 0;
+
+	if (snprintf(path, PATH_MAX, "%s/%s", newdir, name) >= PATH_MAX) {
+		return -1;
+	}
+	if ((n = scandir(path, &list, NULL, alphasort)) < 0) {
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		char *d = list[i]->d_name;
+
+		if (ret < 0 || strcmp(d, ".") == 0 || strcmp(d, "..") == 0) {
+			continue;
+		}
+		if (snprintf(path, PATH_MAX, "%s%s%s", name, *name ? "/" : "", d) >= PATH_MAX ||
+		    snprintf(old_path, PATH_MAX, "%s/%s", olddir, path) >= PATH_MAX ||
+		    snprintf(new_path, PATH_MAX, "%s/%s", newdir, path) >= PATH_MAX ||
+		    lstat(new_path, &sb) != 0) {
+			ret = -1;
+		} else if (S_ISDIR(sb.st_mode)) {
+			ret = dir_add(a, BSDIFF_DIR_DIR, path, &sb, 0, 0);
+			if (ret == 0) {
+				ret = dir_walk(ctx, a, olddir, newdir, path);
+			}
+		} else if (S_ISREG(sb.st_mode)) {
+			ret = dir_add_file(ctx, a, old_path, new_path, path, &sb);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		free(list[i]);
+	}
+	free(list);
+
+	return ret;
+}
+
+int bsdiff_ctx_diff_dir(bsdiff_ctx *ctx, char *olddir, char *newdir, char *archive)
+{
+	char archive_unique[2 * PATH_MAX];
+	struct header_dir_v20 header;
+	enc_flags_t encoding;
+	u_char *index, *solid, buf[BUFSIZ];
+	uint64_t index_len, solid_len;
+	int index_enc, solid_enc;
+	struct stat sb;
+	carchive a;
+	csink out;
+	size_t n;
+	int ret;
+
+	if (stat(newdir, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+		return -1;
+	}
+
+	memset(&a, 0, sizeof(carchive));
+	a.index.growable = 1;
+	a.solid.growable = 1;
+	if ((a.data = tmpfile()) == NULL) {
+		return -1;
+	}
+	if ((ret = dir_walk(ctx, &a, olddir, newdir, "")) < 0) {
+		goto out;
+	}
+
+	/* make_small() takes over the buffers */
+	index = a.index.buf;
+	index_len = a.index.len;
+	a.index.buf = NULL;
+	index_enc = make_small(&index, &index_len, ctx->enc, ctx, NULL, "index");
+	solid = a.solid.buf;
+	solid_len = a.solid.len;
+	a.solid.buf = NULL;
+	solid_enc = make_small(&solid, &solid_len, ctx->enc, ctx, NULL, "solid");
+
+	memset(&header, 0, sizeof(struct header_dir_v20));
+	memcpy(&header.magic, BSDIFF_HDR_DIR_V20, 8);
+	header.offset_to_first_block = sizeof(struct header_dir_v20);
+	header.entries = a.entries;
+	header.index_length = index_len;
+	header.index_size = a.index.len;
+	header.solid_length = solid_len;
+	header.solid_size = a.solid.len;
+	header.data_length = a.data_len;
+	header.file_mode = sb.st_mode;
+	header.file_owner = sb.st_uid;
+	header.file_group = sb.st_gid;
+	memset(&encoding, 0, sizeof(enc_flags_t));
+	cblock_set_enc(&encoding, index_enc);
+	dblock_set_enc(&encoding, solid_enc);
+	eblock_set_enc(&encoding, BSDIFF_ENC_NONE);
+	header.encoding = encoding;
+
+	sprintf(archive_unique, "%s.%i", archive, getpid());
+	if (sink_open(&out, archive_unique) < 0) {
+		ret = -1;
+	} else {
+		ret = 0;
+		if (sink_write(&out, &header, sizeof(struct header_dir_v20)) < 0 ||
+		    sink_write(&out, index, index_len) < 0 ||
+		    sink_write(&out, solid, solid_len) < 0) {
+			ret = -1;
+		}
+		rewind(a.data);
+		while (ret == 0 && (n = fread(buf, 1, BUFSIZ, a.data)) > 0) {
+			ret = sink_write(&out, buf, n);
+		}
+		if (ferror(a.data)) {
+			ret = -1;
+		}
+		ret = sink_commit(&out, ret, archive_unique, archive);
+	}
+	free(index);
+	free(solid);
+
+out:
+	free(a.index.buf);
+	free(a.solid.buf);
+	fclose(a.data);
+
+	return ret;
+}
+
+int bsdiff_ctx_diff(bsdiff_ctx *ctx, char *old_filename, char *new_filename,
+		    char *delta_filename)
+{
+	char delta_filename_unique[2 * PATH_MAX];
+	struct stat old_stat, new_stat;
+	csink sink;
+	int ret;
+
+	/* two directories make an archive */
+	if (stat(old_filename, &old_stat) == 0 && S_ISDIR(old_stat.st_mode) &&
+	    stat(new_filename, &new_stat) == 0 && S_ISDIR(new_stat.st_mode)) {
+		return bsdiff_ctx_diff_dir(ctx, old_filename, new_filename, delta_filename);
+	}
+
+	sprintf(delta_filename_unique, "%s.%i", delta_filename, getpid());
+	if (sink_open(&sink, delta_filename_unique) < 0) {
+		return -1;
+	}
+	ret = diff_files(ctx, old_filename, new_filename, &sink);
+
+	return sink_commit(&sink, ret, delta_filename_unique, delta_filename);
+}
+
+/* The reader counterpart of diff_files(). Readers carry no file metadata,
+ * so the header gets mode 0644 and the caller's uid and gid. */
+static int diff_readers(bsdiff_ctx *ctx, struct bsdiff_reader *old,
+			struct bsdiff_reader *new, csink *sink)
+{
+	u_char *old_data, *new_data;
+	int64_t old_size, new_size;
+	int old_mapped, new_mapped;
+	cindex ix;
+	double ratio;
+	int ret;
+
+	if ((old_size = old->size(old->opaque)) < 0) {
+		return -1;
+	}
+	if ((new_size = new->size(new->opaque)) < 0) {
+		return -1;
+	}
+
+	/* same FULLDL shortcuts as for files, see diff_files() */
+	if (old_size == 0 || new_size < ctx->tune.fulldl_min_size) {
+		return write_fulldl(sink) < 0 ? -1 : 1;
+	}
+
+	old_data = reader_load(ctx, BSDIFF_BUF_OLD, old, old_size, &old_mapped);
+	if (old_data == NULL) {
+		return -1;
+	}
+	new_data = reader_load(ctx, BSDIFF_BUF_NEW, new, new_size, &new_mapped);
+	if (new_data == NULL) {
+		reader_unload(old, old_data, old_mapped);
+		return -1;
+	}
+
+	if (use_windows(ctx, old_size, new_size)) {
+		ret = diff_windowed(ctx, old_data, old_size, new_data, new_size,
+				    S_IFREG | 0644, getuid(), getgid(), sink);
+	} else if (predict_fulldl(ctx, old_data, old_size, new_data, new_size, &ratio)) {
+		ret = write_fulldl(sink) < 0 ? -1 : 1;
+		ctx->stats.fulldl++;
+		ctx->stats.early++;
+	} else if (index_old(ctx, old_data, old_size, &ix) < 0) {
+		ret = -1;
+	} else {
+		ret = diff_sorted(ctx, &ix, old_data, old_size, new_data, new_size,
+				  S_IFREG | 0644, getuid(), getgid(),
+				  old_size < ctx->tune.small_max && new_size < ctx->tune.small_max,
+				  ratio, sink);
+	}
+
+	reader_unload(new, new_data, new_mapped);
+	reader_unload(old, old_data, old_mapped);
+
+	return ret;
+}
+
+int bsdiff_ctx_diff_io(bsdiff_ctx *ctx, struct bsdiff_reader *old,
+		       struct bsdiff_reader *new, struct bsdiff_writer *delta)
+{
+	csink sink;
+
+	memset(&sink, 0, sizeof(csink));
+	sink.w = delta;
+
+	return diff_readers(ctx, old, new, &sink);
+}
+
+int bsdiff_ctx_diff_mem(bsdiff_ctx *ctx, const void *old, size_t old_len,
+			const void *new, size_t new_len,
+			void **delta, size_t *delta_len)
+{
+	struct bsdiff_reader old_r, new_r;
+	memio old_m, new_m;
+	csink sink;
+	int ret;
+
+	memset(&sink, 0, sizeof(csink));
+	if (*delta == NULL) {
+		sink.growable = 1;
+	} else {
+		sink.buf = *delta;
+		sink.cap = *delta_len;
+	}
+
+	reader_mem(&old_r, &old_m, old, old_len);
+	reader_mem(&new_r, &new_m, new, new_len);
+	ret = diff_readers(ctx, &old_r, &new_r, &sink);
+
+	if (ret < 0) {
+		if (sink.growable) {
+			free(sink.buf);
+		}
+		return ret;
+	}
+	*delta = sink.buf;
+	*delta_len = sink.len;
+
+	return ret;
+}
+
+int make_bsdiff_delta(char *old_filename, char *new_filename, char *delta_filename, int enc)
+{
+	return make_bsdiff_delta_flags(old_filename, new_filename, delta_filename, enc, 0);
+}
+
+int make_bsdiff_delta_flags(char *old_filename, char *new_filename, char *delta_filename,
+			    int enc, unsigned int flags)
+{
+	bsdiff_ctx ctx;
+	int ret;
+
+	bsdiff_ctx_init(&ctx);
+	ctx.enc = enc;
+	ctx.diff_flags = flags;
+	ret = bsdiff_ctx_diff(&ctx, old_filename, new_filename, delta_filename);
+	bsdiff_ctx_release(&ctx);
+
+	return ret;
+}
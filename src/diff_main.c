@@ -30,11 +30,14 @@
  */
 
 #define _GNU_SOURCE
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 
 #include "bsdiff.h"
+#include "programs.h"
 
 /* parse encoding as string and return value as enum
  */
@@ -58,27 +61,283 @@ static int get_encoding(char *encoding)
 	}
 }
 
+static const struct option prog_opts[] = {
+	{"io-uring", no_argument, NULL, 'u'},
+	{"stream", no_argument, NULL, 'S'},
+	{"seekable", no_argument, NULL, 'k'},
+	{"windowed", no_argument, NULL, 'w'},
+	{"fast", no_argument, NULL, 'f'},
+	{"optimal", no_argument, NULL, 'p'},
+	{"effort", required_argument, NULL, 'e'},
+	{"tune", required_argument, NULL, 't'},
+	{"v3", no_argument, NULL, '3'},
+	{"checksum", no_argument, NULL, 'c'},
+	{"digest", required_argument, NULL, 'd'},
+	{"old-digest", no_argument, NULL, 'o'},
+	{"old-samples", no_argument, NULL, 'O'},
+	{"batch", required_argument, NULL, 'b'},
+	{"jobs", required_argument, NULL, 'j'},
+	{"mem-limit", required_argument, NULL, 'm'},
+	{"sort-mem", required_argument, NULL, 'x'},
+	{"scratch", required_argument, NULL, 'T'},
+	{"stats", no_argument, NULL, 's'},
+	{NULL, 0, NULL, 0}
+};
+
+static void usage(char *name)
+{
+	printf("Usage: %s [OPTION]... oldfile newfile deltafile [encoding]\n", name);
+	printf("  or:  %s [OPTION]... --batch manifest [encoding]\n\n", name);
+	printf("Creates a binary diff DELTAFILE from OLDFILE to NEWFILE.");
+	printf(" If ENCODING is specified, accepted values are 'raw', 'bzip2',");
+	printf(" 'gzip', 'xz', 'zeros', or 'any'. The 'raw' value will force");
+	printf(" no compression.\n\n");
+	printf(" If OLDFILE and NEWFILE are directories, DELTAFILE is an archive");
+	printf(" of deltas for every file under NEWFILE.\n\n");
+	printf(" In batch mode, each line of MANIFEST names an oldfile, newfile");
+	printf(" and deltafile, separated by whitespace.\n\n");
+	printf("  -u, --io-uring       Read NEWFILE with io_uring while OLDFILE is sorted\n");
+	printf("  -S, --stream         Write a delta bspatch can apply as it reads it\n");
+	printf("  -k, --seekable       Like --stream, with an index for bspatch --extract\n");
+	printf("  -w, --windowed       Diff in bounded memory, a window at a time; always\n");
+	printf("                       used for files over 512 MiB (implies --stream)\n");
+	printf("  -f, --fast           Match through a hash of sampled old file blocks,\n");
+	printf("                       trading some delta size for a much faster diff\n");
+	printf("  -p, --optimal        Rechoose the matches by the estimated size of the\n");
+	printf("                       whole delta, for a slower diff and a smaller delta\n");
+	printf("  -e, --effort=N       1 (fastest) to 9 (smallest delta, the default);\n");
+	printf("                       1-5 imply --fast, lower levels search less and\n");
+	printf("                       try fewer and lighter compressors\n");
+	printf("  -t, --tune=NAME=VAL  Set a tuning constant (names as for bstune)\n");
+	printf("  -3, --v3             Write the compact, extensible v3 header\n");
+	printf("  -c, --checksum       v3 header with a CRC-32 of each block\n");
+	printf("  -d, --digest=ALG     v3 header with a 'crc32' or 'sha256' digest of\n");
+	printf("                       NEWFILE, which bspatch checks as it writes it\n");
+	printf("  -o, --old-digest     v3 header with a digest of OLDFILE (sha256 with\n");
+	printf("                       --digest=sha256, else crc32)\n");
+	printf("  -O, --old-samples    v3 header with CRC-32s of sampled blocks of OLDFILE\n");
+	printf("  -b, --batch=FILE     Create every delta listed in FILE\n");
+	printf("  -j, --jobs=N         Run N batch jobs at once (default: one per CPU)\n");
+	printf("  -m, --mem-limit=MiB  Memory budget for batch jobs (default: half of RAM)\n");
+	printf("  -x, --sort-mem=MiB   Sort old files on disk when sorting in memory would\n");
+	printf("                       take more than MiB (16 bytes per old byte)\n");
+	printf("  -T, --scratch=DIR    Directory for on-disk sorts (default: $TMPDIR or /tmp)\n");
+	printf("  -s, --stats          Report sort throughput, peak memory and early FULLDLs\n");
+}
+
+static void print_sort_stats(struct bsdiff_stats *st)
+{
+	struct rusage ru;
+	double secs = st->sort_usec / 1e6;
+
+	printf("Sorted:        %llu bytes in %.2f s (%.1f MiB/s), %llu on disk\n",
+	       (unsigned long long)st->sorted, secs,
+	       secs > 0 ? st->sorted / secs / (1 << 20) : 0.0,
+	       (unsigned long long)st->external);
+	printf("Spilled:       %llu bytes\n", (unsigned long long)st->spilled);
+	printf("Early FULLDL:  %llu of %llu\n", (unsigned long long)st->early,
+	       (unsigned long long)st->fulldl);
+	printf("Coarse scans:  %llu, %llu cut short\n", (unsigned long long)st->coarse,
+	       (unsigned long long)st->timeouts);
+	printf("Reparsed:      %llu\n", (unsigned long long)st->reparsed);
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+		printf("Peak RSS:      %ld KiB\n", ru.ru_maxrss);
+	}
+}
+
+static int run_batch(char *manifest, int enc, unsigned int flags, int effort,
+		     struct bsdiff_tunables *tune, unsigned int threads, uint64_t mem_limit, uint64_t sort_mem,
+		     char *scratch)
+{
+	struct bsdiff_job *jobs;
+	struct bsdiff_stats st;
+	size_t njobs, i, fulldl = 0, failed = 0;
+	bsdiff_ctx *ctx;
+	int ret;
+
+	if (read_manifest(manifest, &jobs, &njobs) < 0) {
+		printf("Failed to read manifest %s\n", manifest);
+		free_manifest(jobs, njobs);
+		return -EXIT_FAILURE;
+	}
+	if ((ctx = bsdiff_ctx_new()) == NULL) {
+		free_manifest(jobs, njobs);
+		return -EXIT_FAILURE;
+	}
+	bsdiff_ctx_set_encoding(ctx, enc);
+	bsdiff_ctx_set_diff_flags(ctx, flags);
+	bsdiff_ctx_set_effort(ctx, effort);
+	bsdiff_ctx_set_sort_memory(ctx, sort_mem, scratch);
+	if (bsdiff_ctx_set_tunables(ctx, tune) < 0) {
+		printf("Tunable out of range\n");
+		bsdiff_ctx_free(ctx);
+		free_manifest(jobs, njobs);
+		return -EXIT_FAILURE;
+	}
+
+	ret = bsdiff_ctx_diff_batch(ctx, jobs, njobs, threads, mem_limit);
+
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].ret < 0) {
+			printf("Failed to create delta (%d): %s\n", jobs[i].ret,
+			       jobs[i].delta_filename);
+			failed++;
+		} else if (jobs[i].ret == 1) {
+			fulldl++;
+		}
+	}
+	bsdiff_ctx_get_stats(ctx, &st);
+	printf("Jobs:          %zu (%zu deltas, %zu full downloads, %zu failed)\n",
+	       njobs, njobs - fulldl - failed, fulldl, failed);
+	printf("New bytes:     %llu\n", (unsigned long long)st.newbytes);
+	printf("Delta bytes:   %llu\n", (unsigned long long)st.outputbytes);
+	printf("Block methods: none %llu, bzip2 %llu, gzip %llu, xz %llu, zeros %llu\n",
+	       (unsigned long long)st.none, (unsigned long long)st.bzip2,
+	       (unsigned long long)st.gzip, (unsigned long long)st.xz,
+	       (unsigned long long)st.zeros);
+	print_sort_stats(&st);
+
+	bsdiff_ctx_free(ctx);
+	free_manifest(jobs, njobs);
+
+	return ret < 0 ? -EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
-	int ret, enc = BSDIFF_ENC_ANY;
-
-	if (argc < 4) {
-		printf("Usage: %s oldfile newfile deltafile [encoding]\n\n", argv[0]);
-		printf("Creates a binary diff DELTAFILE from OLDFILE to NEWFILE.");
-		printf(" If ENCODING is specified, accepted values are 'raw', 'bzip2',");
-		printf(" 'gzip', 'xz', 'zeros', or 'any'. The 'raw' value will force");
-		printf(" no compression.\n");
+	int ret, opt, enc = BSDIFF_ENC_ANY;
+	unsigned int flags = 0, threads = 0;
+	uint64_t mem_limit = 0, sort_mem = 0;
+	char *manifest = NULL, *scratch = NULL;
+	struct bsdiff_tunables tune;
+	struct bsdiff_stats st;
+	bsdiff_ctx *ctx;
+	int stats = 0, effort = BSDIFF_EFFORT_MAX;
+
+	bsdiff_tunables_init(&tune);
+	while ((opt = getopt_long(argc, argv, "uSkwfpe:t:3cd:oOb:j:m:x:T:s", prog_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'u':
+			flags |= BSDIFF_DIFF_IO_URING;
+			break;
+		case 'S':
+			flags |= BSDIFF_DIFF_STREAM;
+			break;
+		case 'k':
+			flags |= BSDIFF_DIFF_SEEKABLE;
+			break;
+		case 'w':
+			flags |= BSDIFF_DIFF_WINDOWED;
+			break;
+		case 'f':
+			flags |= BSDIFF_DIFF_FAST;
+			break;
+		case 'p':
+			flags |= BSDIFF_DIFF_OPTIMAL;
+			break;
+		case 'e':
+			effort = strtol(optarg, NULL, 10);
+			if (effort < BSDIFF_EFFORT_MIN || effort > BSDIFF_EFFORT_MAX) {
+				printf("Effort must be %d to %d\n", BSDIFF_EFFORT_MIN,
+				       BSDIFF_EFFORT_MAX);
+				return -EXIT_FAILURE;
+			}
+			break;
+		case '3':
+			flags |= BSDIFF_DIFF_V3;
+			break;
+		case 'c':
+			flags |= BSDIFF_DIFF_CHECKSUM;
+			break;
+		case 'd':
+			if (strcmp(optarg, "crc32") == 0) {
+				flags |= BSDIFF_DIFF_DIGEST;
+			} else if (strcmp(optarg, "sha256") == 0) {
+				flags |= BSDIFF_DIFF_DIGEST_SHA256;
+			} else {
+				printf("Unknown digest algorithm\n");
+				return -EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			flags |= BSDIFF_DIFF_OLD_DIGEST;
+			break;
+		case 'O':
+			flags |= BSDIFF_DIFF_OLD_SAMPLES;
+			break;
+		case 'b':
+			manifest = optarg;
+			break;
+		case 'j':
+			threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			mem_limit = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 't':
+			if (parse_tunable(&tune, optarg) < 0) {
+				printf("Unknown tunable or bad value: %s\n", optarg);
+				return -EXIT_FAILURE;
+			}
+			break;
+		case 'x':
+			sort_mem = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 'T':
+			scratch = optarg;
+			break;
+		case 's':
+			stats = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return -EXIT_FAILURE;
+		}
+	}
+
+	if (manifest) {
+		if (argc - optind > 1) {
+			usage(argv[0]);
+			return -EXIT_FAILURE;
+		}
+		if (argc - optind == 1 && (enc = get_encoding(argv[optind])) < 0) {
+			printf("Unknown encoding algorithm\n");
+			return -EXIT_FAILURE;
+		}
+		return run_batch(manifest, enc, flags, effort, &tune, threads, mem_limit,
+				 sort_mem, scratch);
+	}
+
+	if (argc - optind < 3) {
+		usage(argv[0]);
 		return -EXIT_FAILURE;
 	}
 
-	if (argc > 4) {
-		if ((enc = get_encoding(argv[4])) < 0) {
+	if (argc - optind > 3) {
+		if ((enc = get_encoding(argv[optind + 3])) < 0) {
 			printf("Unknown encoding algorithm\n");
 			return -EXIT_FAILURE;
 		}
 	}
 
-	ret = make_bsdiff_delta(argv[1], argv[2], argv[3], enc);
+	if ((ctx = bsdiff_ctx_new()) == NULL) {
+		return -EXIT_FAILURE;
+	}
+	bsdiff_ctx_set_encoding(ctx, enc);
+	bsdiff_ctx_set_diff_flags(ctx, flags);
+	bsdiff_ctx_set_effort(ctx, effort);
+	bsdiff_ctx_set_sort_memory(ctx, sort_mem, scratch);
+	if (bsdiff_ctx_set_tunables(ctx, &tune) < 0) {
+		printf("Tunable out of range\n");
+		bsdiff_ctx_free(ctx);
+		return -EXIT_FAILURE;
+	}
+	ret = bsdiff_ctx_diff(ctx, argv[optind], argv[optind + 1], argv[optind + 2]);
+	bsdiff_ctx_get_stats(ctx, &st);
+	bsdiff_ctx_free(ctx);
+	if (stats) {
+		print_sort_stats(&st);
+	}
 
 	if (ret != 0) {
 		printf("Failed to create delta (%d)\n", ret);
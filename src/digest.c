@@ -0,0 +1,190 @@
+/*
+ *   This file is part of bsdiff.
+ *
+ *      Copyright © 2012-2016 Intel Corporation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <zlib.h>
+
+#include "bsdiff.h"
+#include "bsheader.h"
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t *h, const u_char *p)
+{
+	uint32_t w[64], s[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+		       (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+	}
+	for (; i < 64; i++) {
+		w[i] = w[i - 16] + w[i - 7] +
+		       (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+		       (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+	}
+
+	memcpy(s, h, sizeof(s));
+	for (i = 0; i < 64; i++) {
+		t1 = s[7] + (ROR32(s[4], 6) ^ ROR32(s[4], 11) ^ ROR32(s[4], 25)) +
+		     ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+		t2 = (ROR32(s[0], 2) ^ ROR32(s[0], 13) ^ ROR32(s[0], 22)) +
+		     ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(s + 1, s, 7 * sizeof(uint32_t));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; i++) {
+		h[i] += s[i];
+	}
+}
+
+size_t digest_size(int alg)
+{
+	switch (alg) {
+	case BSDIFF_DIGEST_CRC32:
+		return 4;
+	case BSDIFF_DIGEST_SHA256:
+		return 32;
+	default:
+		return 0;
+	}
+}
+
+void digest_init(digest_ctx *d, int alg)
+{
+	static const uint32_t sha256_h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memset(d, 0, sizeof(digest_ctx));
+	d->alg = alg;
+	if (alg == BSDIFF_DIGEST_CRC32) {
+		d->crc = crc32(0, NULL, 0);
+	} else if (alg == BSDIFF_DIGEST_SHA256) {
+		memcpy(d->h, sha256_h, sizeof(sha256_h));
+	}
+}
+
+void digest_update(digest_ctx *d, const void *data, size_t len)
+{
+	const u_char *p = data;
+	size_t n;
+
+	if (d->alg == BSDIFF_DIGEST_CRC32) {
+		/* zlib's crc32() takes a uInt length */
+		while (len > 0) {
+			n = MIN(len, (size_t)1 << 30);
+			d->crc = crc32(d->crc, p, n);
+			p += n;
+			len -= n;
+		}
+		return;
+	}
+	if (d->alg != BSDIFF_DIGEST_SHA256) {
+		return;
+	}
+
+	d->total += len;
+	if (d->used > 0) {
+		n = MIN(len, 64 - d->used);
+		memcpy(d->buf + d->used, p, n);
+		d->used += n;
+		p += n;
+		len -= n;
+		if (d->used < 64) {
+			return;
+		}
+		sha256_block(d->h, d->buf);
+		d->used = 0;
+	}
+	for (; len >= 64; p += 64, len -= 64) {
+		sha256_block(d->h, p);
+	}
+	memcpy(d->buf, p, len);
+	d->used = len;
+}
+
+/* Stores the digest, digest_size() bytes, big-endian as is usual for each
+ * algorithm. */
+void digest_final(digest_ctx *d, u_char *out)
+{
+	uint64_t bits;
+	int i;
+
+	if (d->alg == BSDIFF_DIGEST_CRC32) {
+		for (i = 0; i < 4; i++) {
+			out[i] = d->crc >> (24 - 8 * i);
+		}
+		return;
+	}
+	if (d->alg != BSDIFF_DIGEST_SHA256) {
+		return;
+	}
+
+	bits = d->total * 8;
+	d->buf[d->used++] = 0x80;
+	if (d->used > 56) {
+		memset(d->buf + d->used, 0, 64 - d->used);
+		sha256_block(d->h, d->buf);
+		d->used = 0;
+	}
+	memset(d->buf + d->used, 0, 56 - d->used);
+	for (i = 0; i < 8; i++) {
+		d->buf[56 + i] = bits >> (56 - 8 * i);
+	}
+	sha256_block(d->h, d->buf);
+	for (i = 0; i < 32; i++) {
+		out[i] = d->h[i / 4] >> (24 - 8 * (i % 4));
+	}
+}
+
+uint32_t old_sample(const u_char *old, uint64_t size, uint64_t sample_size,
+		    uint32_t count, uint32_t i)
+{
+	uint64_t off = (size / count) * i;
+
+	return crc32(0, old + off, MIN(sample_size, size - off));
+}
@@ -180,6 +180,123 @@ static void print_v21_header(struct header_v21 *h, FILE *f)
 	printf("Gid:\t%d\n", h->file_group);
 }
 
+static int print_v30_header(FILE *f, char *filename)
+{
+	static const char *blocks[3] = { "Cblock", "Dblock", "Eblock" };
+	u_char buf[BSDIFF_V30_MAX_HEADER];
+	struct header_v30 h;
+	size_t len;
+	int i;
+
+	rewind(f);
+	len = fread(buf, 1, sizeof(buf), f);
+	if (header_v30_read(buf, len, &h) < 0) {
+		printf("v3 magic, but bad header (%s)\n", filename);
+		return -1;
+	}
+
+	printf("First block offset:\t%3llu\n", (long long unsigned int)h.offset_to_first_block);
+	printf("Features:        %#10llx\n", (long long unsigned int)h.features);
+	for (i = 0; i < 3; i++) {
+		printf("%s length:   %10llu\n", blocks[i], (long long unsigned int)h.length[i]);
+		printf("     encoding:   %10s\n", algos[h.encoding[i]]);
+		if (h.features & BSDIFF_V30_BLOCK_CRC) {
+			printf("     crc32:      %#10x\n", h.crc[i]);
+		}
+	}
+	printf("Old file length: %10llu\n", (long long unsigned int)h.old_file_length);
+	printf("New file length: %10llu\n", (long long unsigned int)h.new_file_length);
+	if (h.features & BSDIFF_V30_NEW_DIGEST) {
+		printf("New file %s:\t", h.digest_alg == BSDIFF_DIGEST_SHA256 ? "sha256" : "crc32");
+		for (i = 0; i < (int)digest_size(h.digest_alg); i++) {
+			printf("%02x", h.new_digest[i]);
+		}
+		printf("\n");
+	}
+	if (h.features & BSDIFF_V30_OLD_DIGEST) {
+		printf("Old file %s:\t", h.old_digest_alg == BSDIFF_DIGEST_SHA256 ? "sha256" : "crc32");
+		for (i = 0; i < (int)digest_size(h.old_digest_alg); i++) {
+			printf("%02x", h.old_digest[i]);
+		}
+		printf("\n");
+	}
+	if (h.features & BSDIFF_V30_OLD_SAMPLES) {
+		printf("Old file samples:%10u x %llu bytes\n", h.sample_count,
+		       (long long unsigned int)h.sample_size);
+	}
+	printf("Mode:\t%4o\n", h.file_mode);
+	printf("Uid:\t%d\n", h.file_owner);
+	printf("Gid:\t%d\n", h.file_group);
+	return 0;
+}
+
+/* Walks the frames of a stream delta, which has no totals in its header.
+ * A seekable one has its index listed first. */
+static int print_stream(FILE *f, char *filename, int seekable)
+{
+	struct header_stream h;
+	struct header_seekable sh;
+	struct stream_index_entry e;
+	struct frame_stream fr;
+	uint64_t frames = 0, tuples = 0, clen = 0, dlen = 0, elen = 0;
+	uint32_t i;
+
+	rewind(f);
+	if (seekable) {
+		if (fread(&sh, sizeof(struct header_seekable), 1, f) < 1) {
+			printf("seekable magic, but short header (%s)\n", filename);
+			return -1;
+		}
+		h.offset_to_first_block = sh.offset_to_first_block;
+		h.frame_size = sh.frame_size;
+		h.old_file_length = sh.old_file_length;
+		h.new_file_length = sh.new_file_length;
+		h.file_mode = sh.file_mode;
+		h.file_owner = sh.file_owner;
+		h.file_group = sh.file_group;
+	} else if (fread(&h, sizeof(struct header_stream), 1, f) < 1) {
+		printf("stream magic, but short header (%s)\n", filename);
+		return -1;
+	}
+	printf("First block offset:\t%3u\n", h.offset_to_first_block);
+	printf("Frame size:      %10u\n", h.frame_size);
+	if (seekable) {
+		printf("Index entries:   %10u\n", sh.entries);
+		for (i = 0; i < sh.entries; i++) {
+			if (fread(&e, sizeof(struct stream_index_entry), 1, f) < 1) {
+				printf("     short index\n");
+				return -1;
+			}
+			printf("     frame %u: offset %llu, new %llu, old %llu\n", i,
+			       (long long unsigned int)e.offset,
+			       (long long unsigned int)e.new_pos,
+			       (long long unsigned int)e.old_pos);
+		}
+	}
+	while (fread(&fr, sizeof(struct frame_stream), 1, f) == 1) {
+		frames++;
+		tuples += fr.tuples;
+		clen += fr.control_length;
+		dlen += fr.diff_length;
+		elen += fr.extra_length;
+		if (fseeko(f, (off_t)fr.control_length + fr.diff_length + fr.extra_length,
+			   SEEK_CUR) != 0) {
+			break;
+		}
+	}
+	printf("Frames:          %10llu\n", (long long unsigned int)frames);
+	printf("Control tuples:  %10llu\n", (long long unsigned int)tuples);
+	printf("Cblock lengths:  %10llu\n", (long long unsigned int)clen);
+	printf("Dblock lengths:  %10llu\n", (long long unsigned int)dlen);
+	printf("Eblock lengths:  %10llu\n", (long long unsigned int)elen);
+	printf("Old file length: %10llu\n", (long long unsigned int)(h.old_file_length));
+	printf("New file length: %10llu\n", (long long unsigned int)(h.new_file_length));
+	printf("Mode:\t%4o\n", h.file_mode);
+	printf("Uid:\t%d\n", h.file_owner);
+	printf("Gid:\t%d\n", h.file_group);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	FILE *infile;
@@ -229,17 +346,39 @@ int main(int argc, char **argv)
 		printf("Magic: %s (v2.1)\n", BSDIFF_HDR_MAGIC_V21);
 		print_v21_header(&h, infile);
 
+	} else if (memcmp(&magic, BSDIFF_HDR_MAGIC_V30, 8) == 0) {
+		printf("Magic: %s (v3)\n", BSDIFF_HDR_MAGIC_V30);
+		ret = print_v30_header(infile, argv[1]);
+
+	} else if (memcmp(&magic, BSDIFF_HDR_MAGIC_STREAM, 8) == 0) {
+		printf("Magic: %s (stream)\n", BSDIFF_HDR_MAGIC_STREAM);
+		ret = print_stream(infile, argv[1], 0);
+
+	} else if (memcmp(&magic, BSDIFF_HDR_MAGIC_SEEKABLE, 8) == 0) {
+		printf("Magic: %s (seekable stream)\n", BSDIFF_HDR_MAGIC_SEEKABLE);
+		ret = print_stream(infile, argv[1], 1);
+
 	} else if (memcmp(&magic, BSDIFF_HDR_DIR_V20, 8) == 0) {
-		/* directory: anything interesting to print? */
-		struct header_v20 h;
-		memset(&h, 0, sizeof(struct header_v20));
+		/* directory archive */
+		struct header_dir_v20 h;
 
-		ret = read_v20_header(&h, infile, argv[1]);
-		if (ret != 0) {
+		rewind(infile);
+		if (fread(&h, sizeof(struct header_dir_v20), 1, infile) < 1) {
+			printf("dir magic, but short header (%s)\n", argv[1]);
+			ret = -1;
 			goto out;
 		}
 
 		printf("Magic:\t%s\n", BSDIFF_HDR_DIR_V20);
+		printf("First block offset:\t%3u\n", h.offset_to_first_block);
+		printf("Entries:         %10u\n", h.entries);
+		printf("Index length:    %10llu\n", (long long unsigned int)(h.index_length));
+		printf("      size:      %10llu\n", (long long unsigned int)(h.index_size));
+		printf("      encoding:  %10s\n", algos[cblock_get_enc(h.encoding)]);
+		printf("Solid length:    %10llu\n", (long long unsigned int)(h.solid_length));
+		printf("      size:      %10llu\n", (long long unsigned int)(h.solid_size));
+		printf("      encoding:  %10s\n", algos[dblock_get_enc(h.encoding)]);
+		printf("Data length:     %10llu\n", (long long unsigned int)(h.data_length));
 		printf("Mode:\t%4o\n", h.file_mode);
 		printf("Uid:\t%d\n", h.file_owner);
 		printf("Gid:\t%d\n", h.file_group);
@@ -0,0 +1,564 @@
+/*
+ *   This file is part of bsdiff.
+ *
+ *      Copyright © 2012-2016 Intel Corporation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* External suffix sorting, for old files whose suffix array and ranks do
+ * not fit in memory. This is prefix doubling over files: each suffix is
+ * first ranked by its first 8 bytes, then every round sorts the pairs
+ * (rank[i], rank[i + h]) to rank the first 2h bytes, until no two ranks
+ * are equal. The sorts keep runs of at most half the memory budget,
+ * spill them to unlinked scratch files and merge them, so every file is
+ * read and written sequentially in large blocks. The result has the same
+ * layout as the I array of qsufsort(). */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "bsheader.h"
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+
+/* I/O block for the rank and suffix array files, and the smallest block a
+ * merge reads from each run */
+#define SORT_BLOCK (1 << 20)
+#define SORT_MIN_BLOCK (64 << 10)
+/* the smallest run, whatever the budget */
+#define SORT_MIN_RUN 1024
+
+typedef struct {
+	uint64_t key[2];
+	int64_t pos;
+} sarec;
+
+/* buffered sequential I/O on a scratch file, from off up to end */
+typedef struct {
+	int fd;
+	u_char *buf;
+	size_t size;
+	size_t len;
+	size_t used;
+	uint64_t off;
+	uint64_t end;
+	uint64_t *spilled;
+} cxfile;
+
+typedef struct {
+	int (*cmp)(const void *, const void *);
+	const char *dir;
+	sarec *buf;
+	size_t cap;
+	size_t len;
+	size_t mem;
+	int fd;
+	cxfile out;
+	uint64_t *runs;
+	size_t nruns;
+	/* merge state: one reader and current record per run, and a heap
+	 * of runs ordered by their current record */
+	cxfile *in;
+	sarec *head;
+	size_t *heap;
+	size_t nheap;
+	size_t next;
+	uint64_t *spilled;
+} csorter;
+
+/* Opens a new file under dir that is already unlinked, so that nothing is
+ * left behind however the sort ends. */
+static int scratch_open(const char *dir)
+{
+	char *path;
+	int fd;
+
+	if (asprintf(&path, "%s/bsdiff-sort.XXXXXX", dir) < 0) {
+		return -1;
+	}
+	fd = mkstemp(path);
+	if (fd >= 0) {
+		unlink(path);
+	}
+	free(path);
+
+	return fd;
+}
+
+static int xf_init(cxfile *xf, int fd, size_t size, uint64_t off, uint64_t end,
+		   uint64_t *spilled)
+{
+	memset(xf, 0, sizeof(cxfile));
+	if ((xf->buf = malloc(size)) == NULL) {
+		return -1;
+	}
+	xf->fd = fd;
+	xf->size = size;
+	xf->off = off;
+	xf->end = end;
+	xf->spilled = spilled;
+
+	return 0;
+}
+
+static void xf_free(cxfile *xf)
+{
+	free(xf->buf);
+	xf->buf = NULL;
+}
+
+static int xf_flush(cxfile *xf)
+{
+	u_char *p = xf->buf;
+	size_t len = xf->len;
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(xf->fd, p, len, xf->off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+		xf->off += n;
+	}
+	if (xf->spilled) {
+		*xf->spilled += xf->len;
+	}
+	xf->len = 0;
+
+	return 0;
+}
+
+static int xf_write(cxfile *xf, const void *p, size_t len)
+{
+	const u_char *src = p;
+	size_t n;
+
+	while (len > 0) {
+		if (xf->len == xf->size && xf_flush(xf) < 0) {
+			return -1;
+		}
+		n = MIN(len, xf->size - xf->len);
+		memcpy(xf->buf + xf->len, src, n);
+		xf->len += n;
+		src += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Reads the next len bytes. Returns 1, 0 at the end, or -1. */
+static int xf_read(cxfile *xf, void *p, size_t len)
+{
+	ssize_t n;
+
+	if (xf->used + len > xf->len) {
+		/* records never straddle a block, so the rest is unused */
+		if (xf->off >= xf->end) {
+			return 0;
+		}
+		n = MIN(xf->size - xf->size % len, xf->end - xf->off);
+		do {
+			n = pread(xf->fd, xf->buf, n, xf->off);
+		} while (n < 0 && errno == EINTR);
+		if (n < (ssize_t)len) {
+			return -1;
+		}
+		xf->off += n;
+		xf->len = n;
+		xf->used = 0;
+	}
+	memcpy(p, xf->buf + xf->used, len);
+	xf->used += len;
+
+	return 1;
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+	const sarec *x = a, *y = b;
+
+	if (x->key[0] != y->key[0]) {
+		return x->key[0] < y->key[0] ? -1 : 1;
+	}
+	if (x->key[1] != y->key[1]) {
+		return x->key[1] < y->key[1] ? -1 : 1;
+	}
+	return 0;
+}
+
+static int cmp_pos(const void *a, const void *b)
+{
+	const sarec *x = a, *y = b;
+
+	return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+static int sorter_init(csorter *s, int (*cmp)(const void *, const void *),
+		       const char *dir, size_t mem, uint64_t *spilled)
+{
+	memset(s, 0, sizeof(csorter));
+	s->cmp = cmp;
+	s->dir = dir;
+	s->mem = mem;
+	s->fd = -1;
+	s->spilled = spilled;
+	s->cap = MAX(mem / sizeof(sarec), SORT_MIN_RUN);
+	if ((s->buf = malloc(s->cap * sizeof(sarec))) == NULL) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static void sorter_free(csorter *s)
+{
+	size_t i;
+
+	if (s->in) {
+		for (i = 0; i < s->nruns; i++) {
+			xf_free(&s->in[i]);
+		}
+	}
+	xf_free(&s->out);
+	free(s->in);
+	free(s->head);
+	free(s->heap);
+	free(s->runs);
+	free(s->buf);
+	if (s->fd >= 0) {
+		close(s->fd);
+	}
+	memset(s, 0, sizeof(csorter));
+	s->fd = -1;
+}
+
+/* Sorts the buffered records and appends them to the runs file. */
+static int sorter_spill(csorter *s)
+{
+	uint64_t *runs;
+
+	if (s->fd < 0) {
+		if ((s->fd = scratch_open(s->dir)) < 0) {
+			return -1;
+		}
+		if (xf_init(&s->out, s->fd, SORT_BLOCK, 0, 0, s->spilled) < 0) {
+			return -1;
+		}
+	}
+	if ((runs = realloc(s->runs, (s->nruns + 1) * sizeof(uint64_t))) == NULL) {
+		return -1;
+	}
+	s->runs = runs;
+	s->runs[s->nruns++] = s->len;
+
+	qsort(s->buf, s->len, sizeof(sarec), s->cmp);
+	if (xf_write(&s->out, s->buf, s->len * sizeof(sarec)) < 0) {
+		return -1;
+	}
+	s->len = 0;
+
+	return 0;
+}
+
+static int sorter_push(csorter *s, sarec *rec)
+{
+	if (s->len == s->cap && sorter_spill(s) < 0) {
+		return -1;
+	}
+	s->buf[s->len++] = *rec;
+
+	return 0;
+}
+
+static int heap_less(csorter *s, size_t a, size_t b)
+{
+	int c = s->cmp(&s->head[a], &s->head[b]);
+
+	return c < 0 || (c == 0 && a < b);
+}
+
+static void heap_down(csorter *s, size_t i)
+{
+	size_t c, tmp;
+
+	while ((c = 2 * i + 1) < s->nheap) {
+		if (c + 1 < s->nheap && heap_less(s, s->heap[c + 1], s->heap[c])) {
+			c++;
+		}
+		if (!heap_less(s, s->heap[c], s->heap[i])) {
+			break;
+		}
+		tmp = s->heap[i];
+		s->heap[i] = s->heap[c];
+		s->heap[c] = tmp;
+		i = c;
+	}
+}
+
+/* Ends input. Records that all fit in memory are just sorted there;
+ * otherwise the last run is spilled and a merge of all runs is set up,
+ * with the memory of the run buffer shared out among their readers. */
+static int sorter_done(csorter *s)
+{
+	uint64_t off = 0;
+	size_t block, i;
+	int ret;
+
+	if (s->nruns == 0) {
+		qsort(s->buf, s->len, sizeof(sarec), s->cmp);
+		return 0;
+	}
+	if (s->len > 0 && sorter_spill(s) < 0) {
+		return -1;
+	}
+	if (xf_flush(&s->out) < 0) {
+		return -1;
+	}
+	xf_free(&s->out);
+	free(s->buf);
+	s->buf = NULL;
+
+	block = MAX(s->mem / s->nruns, SORT_MIN_BLOCK);
+	block -= block % sizeof(sarec);
+	s->in = calloc(s->nruns, sizeof(cxfile));
+	s->head = malloc(s->nruns * sizeof(sarec));
+	s->heap = malloc(s->nruns * sizeof(size_t));
+	if (s->in == NULL || s->head == NULL || s->heap == NULL) {
+		return -1;
+	}
+	for (i = 0; i < s->nruns; i++) {
+		if (xf_init(&s->in[i], s->fd, block, off, off + s->runs[i] * sizeof(sarec),
+			    NULL) < 0) {
+			return -1;
+		}
+		off += s->runs[i] * sizeof(sarec);
+		if ((ret = xf_read(&s->in[i], &s->head[i], sizeof(sarec))) < 0) {
+			return -1;
+		}
+		if (ret > 0) {
+			s->heap[s->nheap++] = i;
+		}
+	}
+	for (i = s->nheap / 2; i-- > 0;) {
+		heap_down(s, i);
+	}
+
+	return 0;
+}
+
+/* Returns the next record in order: 1, 0 when there are no more, or -1. */
+static int sorter_next(csorter *s, sarec *rec)
+{
+	size_t run;
+	int ret;
+
+	if (s->nruns == 0) {
+		if (s->next == s->len) {
+			return 0;
+		}
+		*rec = s->buf[s->next++];
+		return 1;
+	}
+	if (s->nheap == 0) {
+		return 0;
+	}
+	run = s->heap[0];
+	*rec = s->head[run];
+	if ((ret = xf_read(&s->in[run], &s->head[run], sizeof(sarec))) < 0) {
+		return -1;
+	}
+	if (ret == 0) {
+		s->heap[0] = s->heap[--s->nheap];
+	}
+	heap_down(s, 0);
+
+	return 1;
+}
+
+/* The first 8 bytes of the suffix at i, big-endian and padded with zeros. */
+static uint64_t prefix8(u_char *old, int64_t old_size, int64_t i)
+{
+	uint64_t key = 0;
+	int j;
+
+	for (j = 0; j < 8; j++) {
+		key <<= 8;
+		if (i + j < old_size) {
+			key |= old[i + j];
+		}
+	}
+	return key;
+}
+
+/* Builds the suffix array of old in a scratch file under dir, in about mem
+ * bytes of memory, and maps it. Returns the (old_size + 1) entries, to be
+ * unmapped by the caller, or NULL on failure. Bytes written to scratch
+ * files are added to *spilled. */
+int64_t *ext_sufsort(u_char *old, int64_t old_size, const char *dir, size_t mem,
+		     uint64_t *spilled)
+{
+	csorter ks, ps;
+	cxfile sa, ra, rb;
+	sarec rec, prev;
+	int64_t i, h, name, count;
+	int sa_fd = -1, rank_fd = -1;
+	int64_t *I = NULL;
+	int unique, ret;
+
+	memset(&sa, 0, sizeof(cxfile));
+	memset(&ra, 0, sizeof(cxfile));
+	memset(&rb, 0, sizeof(cxfile));
+	memset(&ks, 0, sizeof(csorter));
+	memset(&ps, 0, sizeof(csorter));
+	memset(&prev, 0, sizeof(sarec));
+	ks.fd = -1;
+	ps.fd = -1;
+
+	if (dir == NULL && (dir = getenv("TMPDIR")) == NULL) {
+		dir = "/tmp";
+	}
+	if ((sa_fd = scratch_open(dir)) < 0 || (rank_fd = scratch_open(dir)) < 0) {
+		goto out;
+	}
+
+	for (h = 0;; h = h ? 2 * h : 8) {
+		/* rank the first 2h bytes (8 in the first round) of every
+		 * suffix; ranks past the end of old are 0 */
+		if (sorter_init(&ks, cmp_key, dir, mem / 2, spilled) < 0) {
+			goto out;
+		}
+		if (h > 0) {
+			if (xf_init(&ra, rank_fd, SORT_BLOCK, 0, old_size * 8, NULL) < 0 ||
+			    xf_init(&rb, rank_fd, SORT_BLOCK, h * 8, old_size * 8, NULL) < 0) {
+				goto out;
+			}
+		}
+		for (i = 0; i < old_size; i++) {
+			rec.pos = i;
+			if (h == 0) {
+				rec.key[0] = prefix8(old, old_size, i);
+				rec.key[1] = MIN(8, old_size - i);
+			} else {
+				if (xf_read(&ra, &rec.key[0], 8) != 1) {
+					goto out;
+				}
+				rec.key[1] = 0;
+				if (i + h < old_size && xf_read(&rb, &rec.key[1], 8) != 1) {
+					goto out;
+				}
+			}
+			if (sorter_push(&ks, &rec) < 0) {
+				goto out;
+			}
+		}
+		xf_free(&ra);
+		xf_free(&rb);
+		if (sorter_done(&ks) < 0) {
+			goto out;
+		}
+
+		/* name each suffix by the 1-based index of the first with the
+		 * same key, and write the order out in case it is final */
+		if (sorter_init(&ps, cmp_pos, dir, mem / 2, spilled) < 0 ||
+		    xf_init(&sa, sa_fd, SORT_BLOCK, 0, 0, spilled) < 0 ||
+		    xf_write(&sa, &old_size, 8) < 0) {
+			goto out;
+		}
+		unique = 1;
+		name = 0;
+		count = 0;
+		while ((ret = sorter_next(&ks, &rec)) > 0) {
+			count++;
+			if (count == 1 || cmp_key(&rec, &prev) != 0) {
+				name = count;
+			} else {
+				unique = 0;
+			}
+			prev = rec;
+			if (xf_write(&sa, &rec.pos, 8) < 0) {
+				goto out;
+			}
+			rec.key[0] = name;
+			if (sorter_push(&ps, &rec) < 0) {
+				goto out;
+			}
+		}
+		if (ret < 0 || xf_flush(&sa) < 0) {
+			goto out;
+		}
+		xf_free(&sa);
+		sorter_free(&ks);
+		if (unique) {
+			sorter_free(&ps);
+			break;
+		}
+
+		/* ranks back in suffix order, for the next round */
+		if (sorter_done(&ps) < 0 ||
+		    xf_init(&ra, rank_fd, SORT_BLOCK, 0, 0, spilled) < 0) {
+			goto out;
+		}
+		while ((ret = sorter_next(&ps, &rec)) > 0) {
+			if (xf_write(&ra, &rec.key[0], 8) < 0) {
+				goto out;
+			}
+		}
+		if (ret < 0 || xf_flush(&ra) < 0) {
+			goto out;
+		}
+		xf_free(&ra);
+		sorter_free(&ps);
+	}
+
+	I = mmap(NULL, (old_size + 1) * sizeof(int64_t), PROT_READ, MAP_SHARED, sa_fd, 0);
+	if (I == MAP_FAILED) {
+		I = NULL;
+	}
+out:
+	xf_free(&sa);
+	xf_free(&ra);
+	xf_free(&rb);
+	sorter_free(&ks);
+	sorter_free(&ps);
+	if (sa_fd >= 0) {
+		close(sa_fd);
+	}
+	if (rank_fd >= 0) {
+		close(rank_fd);
+	}
+
+	return I;
+}
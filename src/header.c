@@ -0,0 +1,213 @@
+/*
+ *   This file is part of bsdiff.
+ *
+ *      Copyright © 2012-2016 Intel Corporation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <string.h>
+
+#include "bsdiff.h"
+#include "bsheader.h"
+
+static size_t leb128_put(u_char *buf, uint64_t v)
+{
+	size_t n = 0;
+
+	do {
+		buf[n] = v & 0x7f;
+		v >>= 7;
+		if (v) {
+			buf[n] |= 0x80;
+		}
+		n++;
+	} while (v);
+
+	return n;
+}
+
+static int leb128_get(const u_char *buf, size_t len, size_t *pos, uint64_t *v)
+{
+	unsigned int shift = 0;
+
+	*v = 0;
+	while (*pos < len && shift < 64) {
+		*v |= (uint64_t)(buf[*pos] & 0x7f) << shift;
+		if ((buf[(*pos)++] & 0x80) == 0) {
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+}
+
+size_t header_v30_write(u_char *buf, struct header_v30 *h)
+{
+	u_char fields[BSDIFF_V30_MAX_HEADER];
+	uint32_t crc;
+	size_t n = 0, pos;
+	int i;
+
+	n += leb128_put(fields + n, h->features);
+	n += leb128_put(fields + n, h->old_file_length);
+	n += leb128_put(fields + n, h->new_file_length);
+	n += leb128_put(fields + n, h->file_mode);
+	n += leb128_put(fields + n, h->file_owner);
+	n += leb128_put(fields + n, h->file_group);
+	for (i = 0; i < 3; i++) {
+		fields[n++] = h->encoding[i];
+		n += leb128_put(fields + n, h->length[i]);
+	}
+	if (h->features & BSDIFF_V30_BLOCK_CRC) {
+		for (i = 0; i < 3; i++) {
+			crc = htole32(h->crc[i]);
+			memcpy(fields + n, &crc, 4);
+			n += 4;
+		}
+	}
+	if (h->features & BSDIFF_V30_NEW_DIGEST) {
+		fields[n++] = h->digest_alg;
+		memcpy(fields + n, h->new_digest, digest_size(h->digest_alg));
+		n += digest_size(h->digest_alg);
+	}
+	if (h->features & BSDIFF_V30_OLD_DIGEST) {
+		fields[n++] = h->old_digest_alg;
+		memcpy(fields + n, h->old_digest, digest_size(h->old_digest_alg));
+		n += digest_size(h->old_digest_alg);
+	}
+	if (h->features & BSDIFF_V30_OLD_SAMPLES) {
+		n += leb128_put(fields + n, h->sample_size);
+		n += leb128_put(fields + n, h->sample_count);
+		for (i = 0; i < (int)h->sample_count; i++) {
+			crc = htole32(h->samples[i]);
+			memcpy(fields + n, &crc, 4);
+			n += 4;
+		}
+	}
+
+	memcpy(buf, BSDIFF_HDR_MAGIC_V30, 8);
+	pos = 8 + leb128_put(buf + 8, n);
+	memcpy(buf + pos, fields, n);
+	h->offset_to_first_block = pos + n;
+
+	return pos + n;
+}
+
+int header_v30_read(const u_char *buf, size_t len, struct header_v30 *h)
+{
+	uint64_t v, end;
+	uint32_t crc;
+	size_t pos = 8;
+	int i;
+
+	memset(h, 0, sizeof(struct header_v30));
+	if (len < 8 || memcmp(buf, BSDIFF_HDR_MAGIC_V30, 8) != 0 ||
+	    leb128_get(buf, len, &pos, &v) < 0 || v > BSDIFF_V30_MAX_HEADER ||
+	    pos + v > len) {
+		return -1;
+	}
+	end = pos + v;
+
+	if (leb128_get(buf, end, &pos, &h->features) < 0 ||
+	    (h->features & ~(uint64_t)BSDIFF_V30_FEATURES_KNOWN) ||
+	    leb128_get(buf, end, &pos, &h->old_file_length) < 0 ||
+	    leb128_get(buf, end, &pos, &h->new_file_length) < 0) {
+		return -1;
+	}
+	if (leb128_get(buf, end, &pos, &v) < 0 || v > UINT32_MAX) {
+		return -1;
+	}
+	h->file_mode = v;
+	if (leb128_get(buf, end, &pos, &v) < 0 || v > UINT32_MAX) {
+		return -1;
+	}
+	h->file_owner = v;
+	if (leb128_get(buf, end, &pos, &v) < 0 || v > UINT32_MAX) {
+		return -1;
+	}
+	h->file_group = v;
+	for (i = 0; i < 3; i++) {
+		if (pos >= end) {
+			return -1;
+		}
+		h->encoding[i] = buf[pos++];
+		if (h->encoding[i] == BSDIFF_ENC_ANY || h->encoding[i] >= BSDIFF_ENC_LAST ||
+		    leb128_get(buf, end, &pos, &h->length[i]) < 0) {
+			return -1;
+		}
+	}
+	if (h->features & BSDIFF_V30_BLOCK_CRC) {
+		for (i = 0; i < 3; i++) {
+			if (pos + 4 > end) {
+				return -1;
+			}
+			memcpy(&crc, buf + pos, 4);
+			h->crc[i] = le32toh(crc);
+			pos += 4;
+		}
+	}
+	if (h->features & BSDIFF_V30_NEW_DIGEST) {
+		if (pos >= end) {
+			return -1;
+		}
+		h->digest_alg = buf[pos++];
+		v = digest_size(h->digest_alg);
+		if (v == 0 || pos + v > end) {
+			return -1;
+		}
+		memcpy(h->new_digest, buf + pos, v);
+		pos += v;
+	}
+	if (h->features & BSDIFF_V30_OLD_DIGEST) {
+		if (pos >= end) {
+			return -1;
+		}
+		h->old_digest_alg = buf[pos++];
+		v = digest_size(h->old_digest_alg);
+		if (v == 0 || pos + v > end) {
+			return -1;
+		}
+		memcpy(h->old_digest, buf + pos, v);
+		pos += v;
+	}
+	if (h->features & BSDIFF_V30_OLD_SAMPLES) {
+		if (leb128_get(buf, end, &pos, &h->sample_size) < 0 || h->sample_size == 0 ||
+		    leb128_get(buf, end, &pos, &v) < 0 || v > BSDIFF_V30_MAX_SAMPLES ||
+		    pos + 4 * v > end) {
+			return -1;
+		}
+		h->sample_count = v;
+		for (i = 0; i < (int)h->sample_count; i++) {
+			memcpy(&crc, buf + pos, 4);
+			h->samples[i] = le32toh(crc);
+			pos += 4;
+		}
+	}
+
+	h->offset_to_first_block = end;
+	return end;
+}
@@ -0,0 +1,291 @@
+/*
+ *   This file is part of bsdiff.
+ *
+ *      Copyright © 2012-2016 Intel Corporation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "bsheader.h"
+
+/* Built-in backends: files, and memory for the *_mem() API. */
+
+typedef struct {
+	int fd;
+	off_t size;
+} fileio;
+
+static int64_t file_read_at(void *opaque, void *buf, size_t len, uint64_t off)
+{
+	fileio *fio = opaque;
+	ssize_t n;
+
+	do {
+		n = pread(fio->fd, buf, len, off);
+	} while (n < 0 && errno == EINTR);
+
+	return n;
+}
+
+static int64_t file_size(void *opaque)
+{
+	return ((fileio *)opaque)->size;
+}
+
+static const void *file_map(void *opaque)
+{
+	fileio *fio = opaque;
+	void *addr;
+
+	if (fio->size == 0) {
+		return NULL;
+	}
+	addr = mmap(NULL, fio->size, PROT_READ, MAP_SHARED, fio->fd, 0);
+
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+static void file_unmap(void *opaque, const void *addr)
+{
+	munmap((void *)addr, ((fileio *)opaque)->size);
+}
+
+static void file_close(void *opaque)
+{
+	fileio *fio = opaque;
+
+	close(fio->fd);
+	free(fio);
+}
+
+int bsdiff_reader_file(struct bsdiff_reader *r, const char *path)
+{
+	fileio *fio;
+	struct stat sb;
+
+	if ((fio = malloc(sizeof(fileio))) == NULL) {
+		return -1;
+	}
+	if ((fio->fd = open(path, O_RDONLY)) < 0) {
+		free(fio);
+		return -1;
+	}
+	if (fstat(fio->fd, &sb) != 0) {
+		file_close(fio);
+		return -1;
+	}
+	fio->size = sb.st_size;
+
+	memset(r, 0, sizeof(struct bsdiff_reader));
+	r->opaque = fio;
+	r->read_at = file_read_at;
+	r->size = file_size;
+	r->map = file_map;
+	r->unmap = file_unmap;
+	r->close = file_close;
+
+	return 0;
+}
+
+static int64_t file_write_at(void *opaque, const void *buf, size_t len, uint64_t off)
+{
+	fileio *fio = opaque;
+	ssize_t n;
+
+	do {
+		n = pwrite(fio->fd, buf, len, off);
+	} while (n < 0 && errno == EINTR);
+
+	return n;
+}
+
+static int file_wclose(void *opaque)
+{
+	fileio *fio = opaque;
+	int ret;
+
+	ret = close(fio->fd);
+	free(fio);
+
+	return ret;
+}
+
+int bsdiff_writer_file(struct bsdiff_writer *w, const char *path)
+{
+	fileio *fio;
+
+	if ((fio = malloc(sizeof(fileio))) == NULL) {
+		return -1;
+	}
+	if ((fio->fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 00644)) < 0) {
+		free(fio);
+		return -1;
+	}
+	fio->size = 0;
+
+	memset(w, 0, sizeof(struct bsdiff_writer));
+	w->opaque = fio;
+	w->write_at = file_write_at;
+	w->close = file_wclose;
+
+	return 0;
+}
+
+void bsdiff_reader_close(struct bsdiff_reader *r)
+{
+	if (r->close) {
+		r->close(r->opaque);
+	}
+}
+
+int bsdiff_writer_close(struct bsdiff_writer *w)
+{
+	return w->close ? w->close(w->opaque) : 0;
+}
+
+static int64_t mem_read_at(void *opaque, void *buf, size_t len, uint64_t off)
+{
+	memio *mio = opaque;
+
+	if (off >= mio->len) {
+		return 0;
+	}
+	len = len < mio->len - off ? len : mio->len - off;
+	memcpy(buf, mio->buf + off, len);
+
+	return len;
+}
+
+static int64_t mem_size(void *opaque)
+{
+	return ((memio *)opaque)->len;
+}
+
+static const void *mem_map(void *opaque)
+{
+	return ((memio *)opaque)->buf;
+}
+
+/* The reader keeps a pointer to mio, which must outlive it. */
+void reader_mem(struct bsdiff_reader *r, memio *mio, const void *buf, size_t len)
+{
+	mio->buf = buf;
+	mio->len = len;
+
+	memset(r, 0, sizeof(struct bsdiff_reader));
+	r->opaque = mio;
+	r->read_at = mem_read_at;
+	r->size = mem_size;
+	r->map = mem_map;
+}
+
+/* Whether r is a built-in backend, whose read_at() may run on several
+ * threads at once. */
+int reader_builtin(struct bsdiff_reader *r)
+{
+	return r->read_at == file_read_at || r->read_at == mem_read_at;
+}
+
+/* Whether map() of r returns a mapping the library made itself, rather than
+ * memory of the caller's. */
+int reader_own_map(struct bsdiff_reader *r)
+{
+	return r->map == file_map;
+}
+
+/* Reads exactly len bytes at off; short reads are an error. */
+int reader_read(struct bsdiff_reader *r, void *buf, size_t len, uint64_t off)
+{
+	int64_t n;
+
+	while (len > 0) {
+		n = r->read_at(r->opaque, buf, len, off);
+		if (n <= 0) {
+			return -1;
+		}
+		buf = (u_char *)buf + n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+/* Writes exactly len bytes at off. */
+int writer_write(struct bsdiff_writer *w, const void *buf, size_t len, uint64_t off)
+{
+	int64_t n;
+
+	while (len > 0) {
+		n = w->write_at(w->opaque, buf, len, off);
+		if (n <= 0) {
+			return -1;
+		}
+		buf = (const u_char *)buf + n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+/* Returns all size bytes of r: mapped in place when the reader offers it,
+ * otherwise read into scratch buffer WHICH of ctx. *mapped tells
+ * reader_unload() which it was. */
+u_char *reader_load(bsdiff_ctx *ctx, int which, struct bsdiff_reader *r,
+		    int64_t size, int *mapped)
+{
+	const void *addr;
+	u_char *buf;
+
+	*mapped = 0;
+	if (r->map && (addr = r->map(r->opaque)) != NULL) {
+		*mapped = 1;
+		return (u_char *)addr;
+	}
+	if ((buf = ctx_buf(ctx, which, size)) == NULL) {
+		return NULL;
+	}
+	if (reader_read(r, buf, size, 0) < 0) {
+		return NULL;
+	}
+
+	return buf;
+}
+
+void reader_unload(struct bsdiff_reader *r, u_char *data, int mapped)
+{
+	if (mapped && r->unmap) {
+		r->unmap(r->opaque, data);
+	}
+}
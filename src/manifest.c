@@ -0,0 +1,99 @@
+/*
+ *   This file is part of bsdiff.
+ *
+ *      Copyright © 2012-2016 Intel Corporation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bsdiff.h"
+#include "programs.h"
+
+/* Reads the (old, new, delta) triples of a batch manifest. Blank lines and
+ * lines starting with '#' are skipped. */
+int read_manifest(char *filename, struct bsdiff_job **jobs, size_t *njobs)
+{
+	FILE *f;
+	char *line = NULL, *save, *field[3];
+	size_t len = 0, alloc = 0;
+	struct bsdiff_job *j;
+	int i, ret = 0;
+
+	*jobs = NULL;
+	*njobs = 0;
+	if ((f = fopen(filename, "r")) == NULL) {
+		return -1;
+	}
+	while (getline(&line, &len, f) != -1) {
+		field[0] = strtok_r(line, " \t\n", &save);
+		if (field[0] == NULL || field[0][0] == '#') {
+			continue;
+		}
+		field[1] = strtok_r(NULL, " \t\n", &save);
+		field[2] = strtok_r(NULL, " \t\n", &save);
+		if (field[2] == NULL || strtok_r(NULL, " \t\n", &save) != NULL) {
+			ret = -1;
+			break;
+		}
+		if (*njobs == alloc) {
+			alloc = alloc ? 2 * alloc : 64;
+			if ((j = realloc(*jobs, alloc * sizeof(struct bsdiff_job))) == NULL) {
+				ret = -1;
+				break;
+			}
+			*jobs = j;
+		}
+		j = &(*jobs)[(*njobs)++];
+		for (i = 0; i < 3; i++) {
+			field[i] = strdup(field[i]);
+		}
+		j->old_filename = field[0];
+		j->new_filename = field[1];
+		j->delta_filename = field[2];
+		if (!field[0] || !field[1] || !field[2]) {
+			ret = -1;
+			break;
+		}
+	}
+	free(line);
+	fclose(f);
+
+	return ret;
+}
+
+void free_manifest(struct bsdiff_job *jobs, size_t njobs)
+{
+	size_t i;
+
+	for (i = 0; i < njobs; i++) {
+		free(jobs[i].old_filename);
+		free(jobs[i].new_filename);
+		free(jobs[i].delta_filename);
+	}
+	free(jobs);
+}
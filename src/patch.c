@@ -49,13 +49,16 @@ __FBSDID
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <libgen.h>
 #include <limits.h>
 #include <linux/fs.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -64,6 +67,11 @@ __FBSDID
 
 #include "bsheader.h"
 
+#undef MIN
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#undef MAX
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+
 static inline int64_t offtin(u_char *buf)
 {
 	return le64toh(*((int64_t *)buf));
@@ -250,16 +258,218 @@ static size_t xzread(xzfile *xzf, u_char *buf, size_t len, lzma_ret *err)
 }
 #endif /* BSDIFF_WITH_LZMA */
 
+/* zfile reads one gzip member from a FILE*, in the same way xzfile does for
+ * xz. gzdopen() would need a file descriptor, which deltas held in memory
+ * do not have. */
+
+typedef struct {
+	u_char in[BUFSIZ];
+
+	z_stream zs;
+	FILE *f;
+
+	/* Z_OK while more data may follow, Z_STREAM_END once the member is
+	 * complete, or the error that stopped decoding. */
+	int err;
+} zfile;
+
+/* Returns a new zfile reading from f, or NULL on failure. */
+static zfile *zdopen(FILE *f)
+{
+	zfile *zf;
+
+	if (!(zf = malloc(sizeof(zfile)))) {
+		return NULL;
+	}
+	memset(&zf->zs, 0, sizeof(z_stream));
+	zf->f = f;
+	zf->err = Z_OK;
+
+	/* windowBits 31 accepts the gzip wrapper written by diff.c */
+	if (inflateInit2(&zf->zs, 31) != Z_OK) {
+		free(zf);
+		return NULL;
+	}
+
+	return zf;
+}
+
+/* Closes a zfile opened by zdopen, and the underlying FILE*. Returns Z_OK,
+ * or Z_ERRNO if fclose fails. */
+static int zclose(zfile *zf)
+{
+	int z_err = Z_OK;
+
+	inflateEnd(&zf->zs);
+	if (fclose(zf->f) != 0) {
+		z_err = Z_ERRNO;
+	}
+	free(zf);
+
+	return z_err;
+}
+
+/* Reads len uncompressed bytes from zf into buf. Returns the number of bytes
+ * read, which is less than len at the end of the member or on error. */
+static size_t zread(zfile *zf, u_char *buf, size_t len)
+{
+	size_t nread = 0;
+	uInt avail;
+
+	while (zf->err == Z_OK && len > 0) {
+		if (zf->zs.avail_in == 0) {
+			zf->zs.next_in = zf->in;
+			zf->zs.avail_in = fread(zf->in, 1, BUFSIZ, zf->f);
+			if (ferror(zf->f)) {
+				zf->err = Z_ERRNO;
+				break;
+			}
+			if (zf->zs.avail_in == 0) {
+				/* truncated member */
+				zf->err = Z_BUF_ERROR;
+				break;
+			}
+		}
+
+		avail = len > UINT_MAX ? UINT_MAX : len;
+		zf->zs.next_out = buf;
+		zf->zs.avail_out = avail;
+		zf->err = inflate(&zf->zs, Z_NO_FLUSH);
+
+		avail -= zf->zs.avail_out;
+		nread += avail;
+		buf += avail;
+		len -= avail;
+	}
+
+	return nread;
+}
+
+/* The block readers use stdio, so deltas are read through a stdio stream on
+ * top of a struct bsdiff_reader. The decoder threads of one apply read its
+ * three blocks at once, so streams opened on the same reader with the same
+ * cslock share a lock around calls into it, unless it is a built-in one. */
+
+typedef struct {
+	pthread_mutex_t lock;
+	int refs; /* streams still using it */
+} cslock;
+
+typedef struct {
+	struct bsdiff_reader *r;
+	off64_t pos;
+	cslock *lock; /* NULL when reads need not be serialized */
+} ccookie;
+
+static ssize_t ccookie_read(void *cookie, char *buf, size_t size)
+{
+	ccookie *c = cookie;
+	int64_t n;
+
+	if (c->lock) {
+		pthread_mutex_lock(&c->lock->lock);
+	}
+	n = c->r->read_at(c->r->opaque, buf, size, c->pos);
+	if (c->lock) {
+		pthread_mutex_unlock(&c->lock->lock);
+	}
+	if (n > 0) {
+		c->pos += n;
+	}
+	return n;
+}
+
+static int ccookie_seek(void *cookie, off64_t *off, int whence)
+{
+	ccookie *c = cookie;
+	int64_t base = 0;
+
+	if (whence == SEEK_CUR) {
+		base = c->pos;
+	} else if (whence == SEEK_END) {
+		if ((base = c->r->size(c->r->opaque)) < 0) {
+			return -1;
+		}
+	}
+	if (base + *off < 0) {
+		return -1;
+	}
+	c->pos = base + *off;
+	*off = c->pos;
+
+	return 0;
+}
+
+/* Drops a stream's reference to its lock, freeing it with the last one. */
+static void cslock_put(cslock *l)
+{
+	int last;
+
+	if (l == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&l->lock);
+	last = --l->refs == 0;
+	pthread_mutex_unlock(&l->lock);
+	if (last) {
+		pthread_mutex_destroy(&l->lock);
+		free(l);
+	}
+}
+
+static int ccookie_close(void *cookie)
+{
+	ccookie *c = cookie;
+
+	cslock_put(c->lock);
+	free(c);
+	return 0;
+}
+
+/* Opens a stream on r. Streams that may be read on different threads pass
+ * the same *lock, initially NULL; the first of them allocates it, and the
+ * last to close frees it. A stream read on one thread only passes NULL. */
+static FILE *csopen(struct bsdiff_reader *r, cslock **lock)
+{
+	cookie_io_functions_t io = { ccookie_read, NULL, ccookie_seek, ccookie_close };
+	ccookie *c;
+	FILE *f;
+
+	if ((c = malloc(sizeof(ccookie))) == NULL) {
+		return NULL;
+	}
+	c->r = r;
+	c->pos = 0;
+	c->lock = NULL;
+	if (lock && !reader_builtin(r)) {
+		if (*lock == NULL) {
+			if ((*lock = calloc(1, sizeof(cslock))) == NULL) {
+				free(c);
+				return NULL;
+			}
+			pthread_mutex_init(&(*lock)->lock, NULL);
+		}
+		pthread_mutex_lock(&(*lock)->lock);
+		(*lock)->refs++;
+		pthread_mutex_unlock(&(*lock)->lock);
+		c->lock = *lock;
+	}
+	if ((f = fopencookie(c, "rb", io)) == NULL) {
+		cslock_put(c->lock);
+		free(c);
+	}
+	return f;
+}
+
 /* cfile is a uniform interface to read from maybe-compressed files. */
 
 typedef struct {
 	FILE *f; /* method = NONE, BZIP2, ZEROS */
-	int fd;	 /* method = BZIP2 */
 	union {
 #ifdef BSDIFF_WITH_BZIP2
 		BZFILE *bz2; /* method = BZIP2 */
 #endif
-		gzFile gz; /* method = GZIP */
+		zfile *gz; /* method = GZIP */
 #ifdef BSDIFF_WITH_LZMA
 		xzfile *xz; /* method = XZ */
 #endif
@@ -268,11 +478,11 @@ typedef struct {
 	unsigned char method;
 } cfile;
 
-/* Opens a file at path, seeks to offset off, and prepares for reading using
- * the specified method in enum BSDIFF_ENCODINGS.  The tag is an identifier
- * for error reporting. */
-static int cfopen(cfile *cf, const char *path, int64_t off,
-		  const char *tag, unsigned char method)
+/* Opens a stream on src, seeks to offset off, and prepares for reading using the
+ * specified method in enum BSDIFF_ENCODINGS.  The tag is an identifier
+ * for error reporting, and lock is as for csopen(). */
+static int cfopen(cfile *cf, struct bsdiff_reader *src, int64_t off,
+		  const char *tag, unsigned char method, cslock **lock)
 {
 #ifdef BSDIFF_WITH_BZIP2
 	int bz2_err;
@@ -281,60 +491,56 @@ static int cfopen(cfile *cf, const char *path, int64_t off,
 	lzma_ret lzma_err;
 #endif
 
-	if (method == BSDIFF_ENC_NONE ||
-	    method == BSDIFF_ENC_BZIP2 ||
-	    method == BSDIFF_ENC_XZ ||
-	    method == BSDIFF_ENC_ZEROS) {
-		/* Use stdio for uncompressed files. The bzip interface also
-		 * sits on top of a stdio FILE* but does not take "ownership"
-		 * of the FILE*. The xz/lzma2 interface sits on top of a FILE*
-		 * and does take ownership of the FILE*. */
-		if ((cf->f = fopen(path, "rb")) == NULL) {
-			return -1;
-		}
-		if ((fseeko(cf->f, off, SEEK_SET)) != 0) {
+	if (method != BSDIFF_ENC_NONE &&
+	    method != BSDIFF_ENC_BZIP2 &&
+	    method != BSDIFF_ENC_GZIP &&
+	    method != BSDIFF_ENC_XZ &&
+	    method != BSDIFF_ENC_ZEROS) {
+		return -1;
+	}
+
+	/* Every method reads through stdio. The bzip interface sits on top
+	 * of a stdio FILE* but does not take "ownership" of the FILE*. The
+	 * gzip and xz/lzma2 interfaces sit on top of a FILE* and do take
+	 * ownership of the FILE*. */
+	if ((cf->f = csopen(src, lock)) == NULL) {
+		return -1;
+	}
+	if ((fseeko(cf->f, off, SEEK_SET)) != 0) {
+		fclose(cf->f);
+		return -1;
+	}
+	if (method == BSDIFF_ENC_BZIP2) {
+#ifdef BSDIFF_WITH_BZIP2
+		if ((cf->u.bz2 = BZ2_bzReadOpen(&bz2_err, cf->f, 0, 0,
+						NULL, 0)) == NULL) {
 			fclose(cf->f);
 			return -1;
 		}
-		if (method == BSDIFF_ENC_BZIP2) {
-#ifdef BSDIFF_WITH_BZIP2
-			if ((cf->u.bz2 = BZ2_bzReadOpen(&bz2_err, cf->f, 0, 0,
-							NULL, 0)) == NULL) {
-				fclose(cf->f);
-				return -1;
-			}
 #else /*BSDIFF_WITHOUT_BZIP2*/
-			fclose(cf->f);
-			return -1;
-#endif
-		} else if (method == BSDIFF_ENC_XZ) {
-#ifdef BSDIFF_WITH_LZMA
-			if ((cf->u.xz = xzdopen(cf->f, &lzma_err)) == NULL) {
-				fclose(cf->f);
-				return -1;
-			}
-			/* cf->f belongs to the xzfile now, don't access it
-			 * from here. */
-			cf->f = NULL;
-#else /* BSDIFF_WITHOUT_LZMA */
-			fclose(cf->f);
-			return -1;
+		fclose(cf->f);
+		return -1;
 #endif
-		}
 	} else if (method == BSDIFF_ENC_GZIP) {
-		if ((cf->fd = open(path, O_RDONLY)) < 0) {
-			return -1;
-		}
-		if (lseek(cf->fd, off, SEEK_SET) != off) {
-			close(cf->fd);
+		if ((cf->u.gz = zdopen(cf->f)) == NULL) {
+			fclose(cf->f);
 			return -1;
 		}
-		if ((cf->u.gz = gzdopen(cf->fd, "rb")) == NULL) {
-			close(cf->fd);
+		/* cf->f belongs to the zfile now */
+		cf->f = NULL;
+	} else if (method == BSDIFF_ENC_XZ) {
+#ifdef BSDIFF_WITH_LZMA
+		if ((cf->u.xz = xzdopen(cf->f, &lzma_err)) == NULL) {
+			fclose(cf->f);
 			return -1;
 		}
-	} else {
+		/* cf->f belongs to the xzfile now, don't access it
+		 * from here. */
+		cf->f = NULL;
+#else /* BSDIFF_WITHOUT_LZMA */
+		fclose(cf->f);
 		return -1;
+#endif
 	}
 
 	cf->tag = tag;
@@ -368,7 +574,7 @@ static void cfclose(cfile *cf)
 			return;
 		}
 	} else if (cf->method == BSDIFF_ENC_GZIP) {
-		if ((gz_err = gzclose(cf->u.gz)) != Z_OK) {
+		if ((gz_err = zclose(cf->u.gz)) != Z_OK) {
 			return;
 		}
 	} else if (cf->method == BSDIFF_ENC_XZ) {
@@ -388,7 +594,6 @@ static int cfread(cfile *cf, u_char *buf, size_t len, int block, uint64_t *zeros
 #ifdef BSDIFF_WITH_BZIP2
 	int bz2_err;
 #endif
-	int gz_err;
 #ifdef BSDIFF_WITH_LZMA
 	lzma_ret lzma_err;
 #endif
@@ -412,9 +617,7 @@ static int cfread(cfile *cf, u_char *buf, size_t len, int block, uint64_t *zeros
 		return -1;
 #endif
 	} else if (cf->method == BSDIFF_ENC_GZIP) {
-		if ((nread = gzread(cf->u.gz, buf, len)) != len) {
-			gz_err = Z_OK;
-			gzerror(cf->u.gz, &gz_err);
+		if ((nread = zread(cf->u.gz, buf, len)) != len) {
 			return -1;
 		}
 	} else if (cf->method == BSDIFF_ENC_XZ) {
@@ -449,6 +652,371 @@ static int cfread(cfile *cf, u_char *buf, size_t len, int block, uint64_t *zeros
 	return 0;
 }
 
+/* Pipelined decoding: when the new file is large enough, the control, diff
+ * and extra blocks are each decompressed on their own thread into a bounded
+ * ring buffer, and apply_delta_v2() only runs the add/copy loop. The control
+ * decoder tells the diff and extra decoders how many bytes the tuples it has
+ * decoded so far require, so no decoder ever reads past the end of its block. */
+
+/* new files smaller than this are decoded inline */
+#define BSDIFF_PIPELINE_MINSZ (64 * 1024)
+/* capacity of each ring; the control ring holds whole 24 byte tuples */
+#define BSDIFF_RING_SIZE (1024 * 1024)
+#define BSDIFF_CTRL_RING_SIZE (24 * 1024)
+/* largest span a decoder produces before handing it to the consumer */
+#define BSDIFF_RING_CHUNK (64 * 1024)
+
+/* Readahead: the control decoder runs up to a control ring ahead of the
+ * add/copy loop, so it knows which old file ranges are about to be read and
+ * asks the kernel for them with MADV_WILLNEED. Nearby ranges are merged into
+ * one request, and only the head of a long ADD span is requested; the rest of
+ * such a span is read sequentially, which MADV_SEQUENTIAL tells the kernel. */
+#define BSDIFF_READAHEAD_MERGE (256 * 1024)
+#define BSDIFF_READAHEAD_MAX (8 * 1024 * 1024)
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	u_char *buf;
+	uint64_t size;
+	uint64_t head;	 /* total bytes produced */
+	uint64_t tail;	 /* total bytes consumed */
+	uint64_t target; /* total bytes the producer has been asked for */
+	int final;	 /* target will not grow any further */
+	int err;	 /* producer failed */
+	int abort;	 /* consumer gave up */
+} cring;
+
+struct cpipe;
+
+typedef struct {
+	struct cpipe *pipe;
+	cfile *cf;
+	int block;
+	uint64_t zeros; /* remaining count for BSDIFF_ENC_ZEROS blocks */
+	cring ring;
+	pthread_t thread;
+	int running;
+} cdecoder;
+
+typedef struct cpipe {
+	cdecoder dec[3]; /* indexed by enum BSDIFF_BLOCKS */
+	off_t new_size;
+	int threaded;
+
+	/* readahead state, owned by the control decoder */
+	u_char *old_data; /* NULL when readahead is off */
+	off_t old_size;
+	off_t ra_start;
+	off_t ra_len;
+	long page;
+} cpipe;
+
+static int cring_init(cring *r, uint64_t size)
+{
+	memset(r, 0, sizeof(cring));
+	if ((r->buf = malloc(size)) == NULL) {
+		return -1;
+	}
+	r->size = size;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	return 0;
+}
+
+static void cring_destroy(cring *r)
+{
+	if (r->buf == NULL) {
+		return;
+	}
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	free(r->buf);
+	r->buf = NULL;
+}
+
+/* Grows the number of bytes the producer must decode. */
+static void cring_request(cring *r, uint64_t len, int final)
+{
+	pthread_mutex_lock(&r->lock);
+	r->target += len;
+	r->final |= final;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void cring_fail(cring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->err = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* Waits until the producer may write into the ring, and returns the length
+ * of the contiguous writable span at *dst, capped at max. Returns 0 once the
+ * final target has been produced or the consumer aborted. */
+static uint64_t cring_claim(cring *r, u_char **dst, uint64_t max)
+{
+	uint64_t len = 0;
+	uint64_t off;
+
+	pthread_mutex_lock(&r->lock);
+	while (!r->abort) {
+		if (r->head == r->target && r->final) {
+			break;
+		}
+		if (r->head < r->target && r->head - r->tail < r->size) {
+			off = r->head % r->size;
+			len = MIN(r->size - off, r->size - (r->head - r->tail));
+			len = MIN(len, r->target - r->head);
+			len = MIN(len, max);
+			*dst = r->buf + off;
+			break;
+		}
+		pthread_cond_wait(&r->cond, &r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	return len;
+}
+
+static void cring_commit(cring *r, uint64_t len)
+{
+	pthread_mutex_lock(&r->lock);
+	r->head += len;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* Copies len bytes out of the ring, waiting for the producer as needed.
+ * Returns -1 if the producer failed or can never supply the bytes. */
+static int cring_read(cring *r, u_char *buf, uint64_t len)
+{
+	uint64_t n, off;
+
+	pthread_mutex_lock(&r->lock);
+	while (len > 0) {
+		if (r->head == r->tail) {
+			if (r->err || r->abort || (r->final && r->head == r->target)) {
+				pthread_mutex_unlock(&r->lock);
+				return -1;
+			}
+			pthread_cond_wait(&r->cond, &r->lock);
+			continue;
+		}
+		off = r->tail % r->size;
+		n = MIN(r->head - r->tail, r->size - off);
+		n = MIN(n, len);
+		/* the producer never writes into [tail, head) */
+		pthread_mutex_unlock(&r->lock);
+		memcpy(buf, r->buf + off, n);
+		pthread_mutex_lock(&r->lock);
+		r->tail += n;
+		buf += n;
+		len -= n;
+		pthread_cond_broadcast(&r->cond);
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	return 0;
+}
+
+static void readahead_flush(cpipe *p)
+{
+	if (p->ra_len == 0) {
+		return;
+	}
+	(void)madvise(p->old_data + p->ra_start, p->ra_len, MADV_WILLNEED);
+	p->ra_len = 0;
+}
+
+/* Schedules readahead for the old file range an ADD span will read. */
+static void readahead_old(cpipe *p, off_t start, off_t len)
+{
+	off_t end;
+
+	if (p->old_data == NULL || len <= 0 || start >= p->old_size) {
+		return;
+	}
+	/* both come from the delta; clamp before adding them */
+	if (start < 0) {
+		len += start;
+		start = 0;
+	}
+	end = start + MIN(len, p->old_size - start);
+	if (end <= start) {
+		return;
+	}
+	if (end - start >= BSDIFF_READAHEAD_MAX) {
+		start &= ~(off_t)(p->page - 1);
+		(void)madvise(p->old_data + start, end - start, MADV_SEQUENTIAL);
+		end = start + BSDIFF_READAHEAD_MAX;
+	}
+	start &= ~(off_t)(p->page - 1);
+
+	if (p->ra_len > 0 && start >= p->ra_start &&
+	    start <= p->ra_start + p->ra_len + p->page) {
+		p->ra_len = MAX(p->ra_len, end - p->ra_start);
+	} else {
+		readahead_flush(p);
+		p->ra_start = start;
+		p->ra_len = end - start;
+	}
+	if (p->ra_len >= BSDIFF_READAHEAD_MERGE) {
+		readahead_flush(p);
+	}
+}
+
+/* Decodes control tuples and asks the diff and extra decoders for the bytes
+ * each tuple consumes. Tuples that would overrun the new file, or seek
+ * outside the old one, end decoding; apply_delta_v2() rejects them when it
+ * reaches them. */
+static void *control_decoder(void *arg)
+{
+	cdecoder *d = arg;
+	cpipe *p = d->pipe;
+	cring *diff = &p->dec[BSDIFF_BLOCK_DIFF].ring;
+	cring *extra = &p->dec[BSDIFF_BLOCK_EXTRA].ring;
+	off_t new_pos = 0;
+	off_t old_pos = 0;
+	int64_t ctrl[3];
+	uint64_t len;
+	u_char *dst;
+
+	while (new_pos < p->new_size) {
+		/* the ring size is a multiple of 24, so tuples never wrap */
+		cring_request(&d->ring, 24, 0);
+		if ((len = cring_claim(&d->ring, &dst, 24)) == 0) {
+			break;
+		}
+		if (cfread(d->cf, dst, len, d->block, &d->zeros) < 0) {
+			cring_fail(&d->ring);
+			break;
+		}
+		ctrl[0] = offtin(dst);
+		ctrl[1] = offtin(dst + 8);
+		ctrl[2] = offtin(dst + 16);
+		cring_commit(&d->ring, len);
+
+		if (ctrl[0] < 0 || ctrl[1] < 0 ||
+		    ctrl[0] > p->new_size - new_pos ||
+		    ctrl[1] > p->new_size - new_pos - ctrl[0]) {
+			break;
+		}
+		new_pos += ctrl[0] + ctrl[1];
+		cring_request(diff, ctrl[0], 0);
+		cring_request(extra, ctrl[1], 0);
+
+		readahead_old(p, old_pos, ctrl[0]);
+		old_pos += ctrl[0];
+		if (ctrl[2] > p->old_size - old_pos || ctrl[2] < -old_pos) {
+			break;
+		}
+		old_pos += ctrl[2];
+	}
+	readahead_flush(p);
+
+	cring_request(&d->ring, 0, 1);
+	cring_request(diff, 0, 1);
+	cring_request(extra, 0, 1);
+	return NULL;
+}
+
+static void *data_decoder(void *arg)
+{
+	cdecoder *d = arg;
+	uint64_t len;
+	u_char *dst;
+
+	while ((len = cring_claim(&d->ring, &dst, BSDIFF_RING_CHUNK)) > 0) {
+		if (cfread(d->cf, dst, len, d->block, &d->zeros) < 0) {
+			cring_fail(&d->ring);
+			break;
+		}
+		cring_commit(&d->ring, len);
+	}
+	return NULL;
+}
+
+static void cpipe_stop(cpipe *p)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (p->dec[i].ring.buf) {
+			pthread_mutex_lock(&p->dec[i].ring.lock);
+			p->dec[i].ring.abort = 1;
+			pthread_cond_broadcast(&p->dec[i].ring.cond);
+			pthread_mutex_unlock(&p->dec[i].ring.lock);
+		}
+	}
+	for (i = 0; i < 3; i++) {
+		if (p->dec[i].running) {
+			pthread_join(p->dec[i].thread, NULL);
+			p->dec[i].running = 0;
+		}
+		cring_destroy(&p->dec[i].ring);
+	}
+}
+
+/* Prepares the three block readers, starting decoder threads when threaded
+ * is set. Decoding stays inline if the rings cannot be allocated; once any
+ * thread has started, a failure to start the others is an error, since that
+ * thread may already have consumed input. Readahead of old_data, when given,
+ * needs the threads. */
+static int cpipe_start(cpipe *p, cfile *cf, cfile *df, cfile *ef,
+		       off_t new_size, int threaded,
+		       u_char *old_data, off_t old_size)
+{
+	cfile *files[3] = {cf, df, ef};
+	int i;
+
+	memset(p, 0, sizeof(cpipe));
+	p->new_size = new_size;
+	for (i = 0; i < 3; i++) {
+		p->dec[i].pipe = p;
+		p->dec[i].cf = files[i];
+		p->dec[i].block = i;
+		p->dec[i].zeros = ULONG_MAX;
+	}
+	if (!threaded) {
+		return 0;
+	}
+	p->old_data = old_data;
+	p->old_size = old_size;
+	p->page = sysconf(_SC_PAGESIZE);
+
+	if (cring_init(&p->dec[BSDIFF_BLOCK_CONTROL].ring, BSDIFF_CTRL_RING_SIZE) < 0 ||
+	    cring_init(&p->dec[BSDIFF_BLOCK_DIFF].ring, BSDIFF_RING_SIZE) < 0 ||
+	    cring_init(&p->dec[BSDIFF_BLOCK_EXTRA].ring, BSDIFF_RING_SIZE) < 0) {
+		cpipe_stop(p);
+		return 0;
+	}
+	for (i = 0; i < 3; i++) {
+		if (pthread_create(&p->dec[i].thread, NULL,
+				   i == BSDIFF_BLOCK_CONTROL ? control_decoder : data_decoder,
+				   &p->dec[i]) != 0) {
+			cpipe_stop(p);
+			return -1;
+		}
+		p->dec[i].running = 1;
+	}
+	p->threaded = 1;
+
+	return 0;
+}
+
+static int cpipe_read(cpipe *p, int block, u_char *buf, size_t len)
+{
+	cdecoder *d = &p->dec[block];
+
+	if (!p->threaded) {
+		return cfread(d->cf, buf, len, block, &d->zeros);
+	}
+	return cring_read(&d->ring, buf, len);
+}
+
 static int check_header(FILE *f, enc_flags_t encoding,
 			off_t control_length, off_t diff_length, off_t extra_length,
 			off_t old_file_length, off_t new_file_length, off_t offset_to_first_block)
@@ -475,25 +1043,27 @@ static int check_header(FILE *f, enc_flags_t encoding,
 	return 0;
 }
 
-static int open_bsdiff_blocks(cfile *cf, cfile *df, cfile *ef, char *deltafile,
+static int open_bsdiff_blocks(cfile *cf, cfile *df, cfile *ef, struct bsdiff_reader *delta,
 			      off_t control_length, off_t diff_length,
 			      off_t offset_to_first_block, enc_flags_t encoding)
 {
+	cslock *lock = NULL;
 	int ret;
 
-	ret = cfopen(cf, deltafile, offset_to_first_block,
-		     "control", cblock_get_enc(encoding));
+	/* the three blocks are decoded on threads of their own */
+	ret = cfopen(cf, delta, offset_to_first_block,
+		     "control", cblock_get_enc(encoding), &lock);
 	if (ret < 0) {
 		return -1;
 	}
-	ret = cfopen(df, deltafile, offset_to_first_block + control_length,
-		     "diff", dblock_get_enc(encoding));
+	ret = cfopen(df, delta, offset_to_first_block + control_length,
+		     "diff", dblock_get_enc(encoding), &lock);
 	if (ret < 0) {
 		cfclose(cf);
 		return -1;
 	}
-	ret = cfopen(ef, deltafile, offset_to_first_block + control_length + diff_length,
-		     "extra", eblock_get_enc(encoding));
+	ret = cfopen(ef, delta, offset_to_first_block + control_length + diff_length,
+		     "extra", eblock_get_enc(encoding), &lock);
 	if (ret < 0) {
 		cfclose(cf);
 		cfclose(df);
@@ -502,56 +1072,452 @@ static int open_bsdiff_blocks(cfile *cf, cfile *df, cfile *ef, char *deltafile,
 	return 0;
 }
 
-static int read_file(char *filename, unsigned char **data, off_t len)
+/* Loads the old file, which must be len bytes. */
+static u_char *open_old(bsdiff_ctx *ctx, struct bsdiff_reader *old, off_t len,
+			int *mapped)
+{
+	if (old == NULL || old->size(old->opaque) != len) {
+		return NULL;
+	}
+	return reader_load(ctx, BSDIFF_BUF_OLD, old, len, mapped);
+}
+
+/* Reflink mode: block aligned parts of ADD spans whose diff bytes are all
+ * zero are plain copies of the old file. They are not rebuilt in new_data;
+ * instead they are shared with the old file through FICLONERANGE, copied
+ * in-kernel with copy_file_range(), or as a last resort written straight
+ * from old_data. */
+
+typedef struct {
+	off_t new_off;
+	off_t old_off;
+	off_t len;
+} cextent;
+
+typedef struct {
+	cextent *ext;
+	size_t count;
+	size_t alloc;
+	off_t blksize; /* 0 when reflink mode is off */
+	int old_fd;
+} cextents;
+
+static void clones_init(cextents *x)
+{
+	memset(x, 0, sizeof(cextents));
+	x->old_fd = -1;
+}
+
+/* Enables reflink mode when the old file's block size is usable. Failing to
+ * set up only means every byte goes through new_data as usual. */
+static void clones_setup(cextents *x, char *old_filename)
 {
-	int fd;
 	struct stat sb;
 
-	fd = open(filename, O_RDONLY, 0);
-	if (fd < 0) {
-		return -1;
+	if ((x->old_fd = open(old_filename, O_RDONLY)) < 0) {
+		return;
 	}
-
-	if (fstat(fd, &sb) != 0) {
-		close(fd);
-		return -1;
+	if (fstat(x->old_fd, &sb) != 0 || sb.st_blksize <= 0 ||
+	    (sb.st_blksize & (sb.st_blksize - 1)) != 0) {
+		close(x->old_fd);
+		x->old_fd = -1;
+		return;
 	}
+	x->blksize = sb.st_blksize;
+}
 
-	if (len != sb.st_size) {
-		close(fd);
-		return -1;
+static void clones_free(cextents *x)
+{
+	if (x->old_fd >= 0) {
+		close(x->old_fd);
 	}
+	free(x->ext);
+	clones_init(x);
+}
 
-	*data = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
-	close(fd);
+static int clones_add(cextents *x, off_t new_off, off_t old_off, off_t len)
+{
+	cextent *e;
 
-	if (*data == MAP_FAILED) {
-		*data = NULL;
-		return -1;
+	if (x->count > 0) {
+		e = &x->ext[x->count - 1];
+		if (e->new_off + e->len == new_off && e->old_off + e->len == old_off) {
+			e->len += len;
+			return 0;
+		}
+	}
+	if (x->count == x->alloc) {
+		size_t alloc = x->alloc ? 2 * x->alloc : 64;
+		if ((e = realloc(x->ext, alloc * sizeof(cextent))) == NULL) {
+			return -1;
+		}
+		x->ext = e;
+		x->alloc = alloc;
 	}
+	e = &x->ext[x->count++];
+	e->new_off = new_off;
+	e->old_off = old_off;
+	e->len = len;
 
 	return 0;
 }
 
-static int apply_delta_v2(int subver, FILE *f,
-			  char *old_filename, char *new_filename, char *delta_filename)
+/* Adds old data to the diff string in new_data for span offsets [from, to). */
+static void add_old_data(u_char *new_data, u_char *old_data, off_t old_size,
+			 off_t new_pos, off_t old_pos, off_t from, off_t to)
 {
-	cfile cf, df, ef;
-	unsigned char *old_data = NULL, *new_data;
-	unsigned char buf[8];
-	off_t old_pos, new_pos;
-	int64_t ctrl[3];
-	int i, ret, fd;
-	off_t data_offset;
-	off_t ctrllen, difflen, extralen;
-	off_t old_size, new_size;
-	mode_t mode;
+	off_t i;
+
+	for (i = from; i < to; i++) {
+		if ((old_pos + i >= 0) && (old_pos + i < old_size)) {
+			new_data[new_pos + i] += old_data[old_pos + i];
+		}
+	}
+}
+
+/* Like add_old_data() over a whole ADD span, except that whole blocks which
+ * are aligned in both files and carry an all-zero diff are recorded as clone
+ * extents and left untouched. A zeros-encoded diff block needs no scan. */
+static int add_old_data_cloned(cextents *x, u_char *new_data, u_char *old_data,
+			       off_t old_size, off_t new_pos, off_t old_pos,
+			       off_t len, int zero_diff)
+{
+	off_t bs = x->blksize;
+	off_t from, to, i, done = 0;
+	u_char *d;
+
+	if ((new_pos - old_pos) % bs != 0) {
+		add_old_data(new_data, old_data, old_size, new_pos, old_pos, 0, len);
+		return 0;
+	}
+
+	/* only blocks that lie within the old file can be shared */
+	from = old_pos < 0 ? -old_pos : 0;
+	to = MIN(len, old_size - old_pos);
+	from = ((new_pos + from + bs - 1) / bs) * bs - new_pos;
+
+	for (i = from; i + bs <= to; i += bs) {
+		d = new_data + new_pos + i;
+		if (!zero_diff && (d[0] != 0 || memcmp(d, d + 1, bs - 1) != 0)) {
+			continue;
+		}
+		if (clones_add(x, new_pos + i, old_pos + i, bs) < 0) {
+			return -1;
+		}
+		add_old_data(new_data, old_data, old_size, new_pos, old_pos, done, i);
+		done = i + bs;
+	}
+	add_old_data(new_data, old_data, old_size, new_pos, old_pos, done, len);
+
+	return 0;
+}
+
+static int write_all(int fd, u_char *buf, off_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/* Fills one clone extent of the new file at fd. */
+static int write_clone(cextents *x, cextent *e, int fd, u_char *old_data)
+{
+#ifdef FICLONERANGE
+	struct file_clone_range range;
+
+	range.src_fd = x->old_fd;
+	range.src_offset = e->old_off;
+	range.src_length = e->len;
+	range.dest_offset = e->new_off;
+	if (ioctl(fd, FICLONERANGE, &range) == 0) {
+		return 0;
+	}
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	loff_t off_in = e->old_off;
+	loff_t off_out = e->new_off;
+	off_t len = e->len;
+	ssize_t n;
+
+	while (len > 0) {
+		n = copy_file_range(x->old_fd, &off_in, fd, &off_out, len, 0);
+		if (n <= 0) {
+			break;
+		}
+		len -= n;
+	}
+	if (len == 0) {
+		return 0;
+	}
+	return write_all(fd, old_data + off_in, len, off_out);
+#else
+	return write_all(fd, old_data + e->old_off, e->len, e->new_off);
+#endif
+}
+
+/* with the io_uring engine, the finished part of the new file is written out
+ * whenever at least this much has accumulated */
+#define BSDIFF_WRITE_WINDOW (4 * 1024 * 1024)
+
+/* Sparse mode: runs of at least this many zero bytes, in whole blocks of
+ * the new file, are left as holes rather than written. */
+#define BSDIFF_SPARSE_MINRUN (32 * 1024)
+
+static int is_zero(u_char *buf, off_t len)
+{
+	return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+/* Writes a run of data, reserving its blocks first so that a file written
+ * around holes does not fragment. Preallocation is only a hint. */
+static int write_data(int fd, u_char *buf, off_t len, off_t off)
+{
+	if (len <= 0) {
+		return 0;
+	}
+	(void)fallocate(fd, 0, off, len);
+	return write_all(fd, buf, len, off);
+}
+
+/* Writes len bytes of buf at off, seeking over long zero runs. The file
+ * must already have its final size. */
+static int write_sparse(int fd, u_char *buf, off_t len, off_t off, off_t bs)
+{
+	off_t data = 0;
+	off_t hole, i;
+
+	i = ((off + bs - 1) / bs) * bs - off;
+	while (i + bs <= len) {
+		if (!is_zero(buf + i, bs)) {
+			i += bs;
+			continue;
+		}
+		hole = i;
+		while (i + bs <= len && is_zero(buf + i, bs)) {
+			i += bs;
+		}
+		if (i - hole < BSDIFF_SPARSE_MINRUN) {
+			continue;
+		}
+		if (write_data(fd, buf + data, hole - data, off + data) < 0) {
+			return -1;
+		}
+		data = i;
+	}
+	return write_data(fd, buf + data, len - data, off + data);
+}
+
+/* Writes new_data to fd, sharing every recorded clone extent with the old
+ * file instead, and leaving holes for long zero runs when sparse is set. */
+static int write_new_data(cextents *x, int fd, u_char *new_data, off_t new_size,
+			  u_char *old_data, int sparse)
+{
+	struct stat sb;
+	off_t bs = 0;
+	off_t pos = 0;
+	size_t i;
+
+	if (x->count == 0 && !sparse) {
+		(void)fallocate(fd, 0, 0, new_size);
+		return write_all(fd, new_data, new_size, 0);
+	}
+
+	if (sparse && fstat(fd, &sb) == 0 && sb.st_blksize > 0) {
+		bs = MAX(sb.st_blksize, 512);
+	}
+
+	/* clones must not land beyond the end of the destination, and holes
+	 * at the end of the file need the size set explicitly */
+	if (ftruncate(fd, new_size) != 0) {
+		return -1;
+	}
+	for (i = 0; i <= x->count; i++) {
+		off_t end = i < x->count ? x->ext[i].new_off : new_size;
+
+		if (bs) {
+			if (write_sparse(fd, new_data + pos, end - pos, pos, bs) < 0) {
+				return -1;
+			}
+		} else if (write_data(fd, new_data + pos, end - pos, pos) < 0) {
+			return -1;
+		}
+		if (i == x->count) {
+			break;
+		}
+		if (write_clone(x, &x->ext[i], fd, old_data) < 0) {
+			return -1;
+		}
+		pos = x->ext[i].new_off + x->ext[i].len;
+	}
+
+	return 0;
+}
+
+/* Creates new_filename for writing. With atomic set, the file is created
+ * unnamed in the target directory and *anon is set; publish_new_file() then
+ * links it into place once it is complete, so nobody sees a partial file.
+ * Filesystems without O_TMPFILE get the plain exclusive create. */
+static int open_new_file(char *new_filename, int atomic, int *anon)
+{
+	*anon = 0;
+#ifdef O_TMPFILE
+	if (atomic) {
+		char *tmp, *dir;
+		int fd;
+
+		if ((tmp = strdup(new_filename)) == NULL) {
+			return -1;
+		}
+		dir = dirname(tmp);
+		fd = open(dir, O_TMPFILE | O_WRONLY, 00644);
+		free(tmp);
+		if (fd >= 0) {
+			*anon = 1;
+			return fd;
+		}
+	}
+#endif
+	return open(new_filename, O_CREAT | O_EXCL | O_WRONLY, 00644);
+}
+
+/* Like O_EXCL, fails if new_filename appeared in the meantime. */
+static int publish_new_file(int fd, char *new_filename)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	return linkat(AT_FDCWD, path, AT_FDCWD, new_filename, AT_SYMLINK_FOLLOW);
+}
+
+/* Where apply_delta_v2() puts the new file: the file at path, else writer
+ * w, else memory, into *buf if it is set and *len bytes are enough, or into
+ * a buffer malloc'd for the caller otherwise. */
+typedef struct {
+	char *path;
+	struct bsdiff_writer *w;
+	void **buf;
+	size_t *len;
+} cdest;
+
+/* Adds new file bytes [from, to) to the digest. Blocks that reflink mode
+ * left out of new_data are taken from old_data instead; *next is the first
+ * clone extent not yet passed, and no extent straddles to. */
+static void digest_new_data(digest_ctx *d, cextents *x, size_t *next,
+			    u_char *new_data, u_char *old_data, off_t from, off_t to)
+{
+	cextent *e;
+
+	while (*next < x->count && x->ext[*next].new_off < to) {
+		e = &x->ext[*next];
+		digest_update(d, new_data + from, e->new_off - from);
+		digest_update(d, old_data + e->old_off, e->len);
+		from = e->new_off + e->len;
+		(*next)++;
+	}
+	digest_update(d, new_data + from, to - from);
+}
+
+/* Checks the old file against the samples and digest in a v3 header,
+ * cheapest first. */
+static int check_old(struct header_v30 *h, u_char *old_data, off_t old_size)
+{
+	digest_ctx d;
+	u_char sum[BSDIFF_DIGEST_MAX];
+	uint32_t i;
+
+	if (h->features & BSDIFF_V30_OLD_SAMPLES) {
+		for (i = 0; i < h->sample_count; i++) {
+			if (old_sample(old_data, old_size, h->sample_size, h->sample_count,
+				       i) != h->samples[i]) {
+				return -1;
+			}
+		}
+	}
+	if (h->features & BSDIFF_V30_OLD_DIGEST) {
+		digest_init(&d, h->old_digest_alg);
+		digest_update(&d, old_data, old_size);
+		digest_final(&d, sum);
+		if (memcmp(sum, h->old_digest, digest_size(h->old_digest_alg)) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Checks the CRC-32 of each stored block against crc, before anything is
+ * decompressed. */
+static int check_blocks_crc(struct bsdiff_reader *delta, off_t off, off_t ctrllen,
+			    off_t difflen, off_t extralen, uint32_t *crc)
+{
+	off_t len[3] = { ctrllen, difflen, extralen };
+	u_char buf[65536];
+	uLong sum;
+	size_t n;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		sum = crc32(0, NULL, 0);
+		while (len[i] > 0) {
+			n = MIN(len[i], (off_t)sizeof(buf));
+			if (reader_read(delta, buf, n, off) < 0) {
+				return -1;
+			}
+			sum = crc32(sum, buf, n);
+			off += n;
+			len[i] -= n;
+		}
+		if (sum != crc[i]) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Applies the delta read from f, which delta is opened again for the block
+ * readers, to old. Its header is v2.0 or v2.1 (subver 0 or 1) or v3 (subver
+ * 3). old_path is only needed for reflink output. */
+static int apply_delta_v2(bsdiff_ctx *ctx, int subver, FILE *f,
+			  struct bsdiff_reader *old, char *old_path,
+			  struct bsdiff_reader *delta, cdest *out)
+{
+	char *new_filename = out->path;
+	unsigned int flags = new_filename ? ctx->apply_flags : 0;
+	cfile cf, df, ef;
+	cpipe pipe;
+	cextents clones;
+	unsigned char *old_data = NULL, *new_data = NULL;
+	unsigned char buf[24];
+	off_t old_pos, new_pos;
+	int64_t ctrl[3];
+	int i, ret, fd, anon, old_mapped;
+	bsio *io;
+	off_t written;
+	off_t data_offset;
+	off_t ctrllen, difflen, extralen;
+	off_t old_size, new_size;
+	mode_t mode;
 	uid_t uid;
 	gid_t gid;
 	enc_flags_t encoding;
-	uint64_t d_zeros = ULONG_MAX;
-	uint64_t e_zeros = ULONG_MAX;
+	struct header_v30 v3_header;
+	digest_ctx digest;
+	u_char sum[BSDIFF_DIGEST_MAX];
+	off_t hashed;
+	size_t next_clone;
 
+	digest.alg = 0;
 	if (subver == 0) {
 		struct header_v20 header;
 		if (fread(&header, sizeof(struct header_v20), 1, f) < 1) {
@@ -582,43 +1548,127 @@ static int apply_delta_v2(int subver, FILE *f,
 		uid = header.file_owner;
 		gid = header.file_group;
 		encoding = header.encoding;
+	} else if (subver == 3) {
+		/* the v3 header, in front of the same blocks */
+		u_char hbuf[BSDIFF_V30_MAX_HEADER];
+		size_t hlen = fread(hbuf, 1, sizeof(hbuf), f);
+		if (header_v30_read(hbuf, hlen, &v3_header) < 0 ||
+		    v3_header.old_file_length > INT64_MAX ||
+		    v3_header.new_file_length > INT64_MAX) {
+			return -1;
+		}
+		data_offset = v3_header.offset_to_first_block;
+		ctrllen = v3_header.length[BSDIFF_BLOCK_CONTROL];
+		difflen = v3_header.length[BSDIFF_BLOCK_DIFF];
+		extralen = v3_header.length[BSDIFF_BLOCK_EXTRA];
+		old_size = v3_header.old_file_length;
+		new_size = v3_header.new_file_length;
+		mode = v3_header.file_mode;
+		uid = v3_header.file_owner;
+		gid = v3_header.file_group;
+		memset(&encoding, 0, sizeof(enc_flags_t));
+		cblock_set_enc(&encoding, v3_header.encoding[BSDIFF_BLOCK_CONTROL]);
+		dblock_set_enc(&encoding, v3_header.encoding[BSDIFF_BLOCK_DIFF]);
+		eblock_set_enc(&encoding, v3_header.encoding[BSDIFF_BLOCK_EXTRA]);
+		if (v3_header.features & BSDIFF_V30_NEW_DIGEST) {
+			digest_init(&digest, v3_header.digest_alg);
+		}
 	} else {
 		return -1;
 	}
 
+	if (ctrllen < 0 || difflen < 0 || extralen < 0 ||
+	    (subver == 3 && (v3_header.features & BSDIFF_V30_BLOCK_CRC) &&
+	     check_blocks_crc(delta, data_offset, ctrllen, difflen, extralen,
+			      v3_header.crc) < 0)) {
+		return -1;
+	}
+
 	if ((ret = check_header(f, encoding,
 				ctrllen, difflen, extralen,
 				old_size, new_size, data_offset)) < 0) {
 		return ret;
 	}
 
-	if ((ret = open_bsdiff_blocks(&cf, &df, &ef, delta_filename,
+	/* a different base means a full download rather than a bad delta */
+	if (old && old->size(old->opaque) != old_size) {
+		return -4;
+	}
+
+	if ((ret = open_bsdiff_blocks(&cf, &df, &ef, delta,
 				      ctrllen, difflen, data_offset, encoding)) < 0) {
 		return ret;
 	}
 
-	ret = read_file(old_filename, &old_data, old_size);
-	if (ret < 0) {
+	if ((old_data = open_old(ctx, old, old_size, &old_mapped)) == NULL) {
+		ret = -1;
+		goto preperror;
+	}
+
+	if (subver == 3 && check_old(&v3_header, old_data, old_size) < 0) {
+		reader_unload(old, old_data, old_mapped);
+		ret = -4;
 		goto preperror;
 	}
 
 	if (new_size > BSDIFF_MAX_FILESZ) {
-		munmap(old_data, old_size);
+		reader_unload(old, old_data, old_mapped);
 		ret = -1;
 		goto preperror;
 	}
 
 	/* Allocate new_size+1 bytes instead of new_size bytes to ensure
 	   that we never try to malloc(0) and get a NULL pointer */
-	if ((new_data = malloc(new_size + 1)) == NULL) {
-		munmap(old_data, old_size);
+	if (new_filename || out->w) {
+		new_data = ctx_buf(ctx, BSDIFF_BUF_NEW, new_size + 1);
+	} else if (*out->buf == NULL) {
+		new_data = malloc(new_size + 1);
+	} else if (*out->len >= (size_t)new_size) {
+		new_data = *out->buf;
+	}
+	if (new_data == NULL) {
+		reader_unload(old, old_data, old_mapped);
 		ret = -1;
 		goto preperror;
 	}
-	memset(new_data, 0, new_size + 1);
+	memset(new_data, 0, new_size);
+
+	clones_init(&clones);
+	if ((flags & BSDIFF_APPLY_REFLINK) && old_path) {
+		clones_setup(&clones, old_path);
+	}
+
+	/* With the io_uring engine, finished parts of new_data are written
+	 * out while the rest is still being built. Reflink and sparse output
+	 * need the whole file first. */
+	io = NULL;
+	fd = -1;
+	written = 0;
+	if ((flags & BSDIFF_APPLY_IO_URING) &&
+	    !(flags & (BSDIFF_APPLY_REFLINK | BSDIFF_APPLY_SPARSE))) {
+		io = bsio_open(new_data, new_size + 1);
+	}
+	if (io) {
+		fd = open_new_file(new_filename, flags & BSDIFF_APPLY_ATOMIC, &anon);
+		if (fd < 0) {
+			ret = -1;
+			goto readerror;
+		}
+	}
+
+	/* only a mapping of our own is advised; the caller's memory is theirs */
+	if ((ret = cpipe_start(&pipe, &cf, &df, &ef, new_size,
+			       new_size >= BSDIFF_PIPELINE_MINSZ,
+			       flags & BSDIFF_APPLY_NO_READAHEAD || !old_mapped ||
+			       !reader_own_map(old) ? NULL : old_data,
+			       old_size)) < 0) {
+		goto readerror;
+	}
 
 	old_pos = 0;
 	new_pos = 0;
+	hashed = 0;
+	next_clone = 0;
 	while (new_pos < new_size) {
 		/* Read control data:
 		 *   ctrl[0] == offset into diff block
@@ -632,12 +1682,12 @@ static int apply_delta_v2(int subver, FILE *f,
 		 * copies of the original file content rather than using
 		 * diff or extra content.
 		 */
+		ret = cpipe_read(&pipe, BSDIFF_BLOCK_CONTROL, buf, 24);
+		if (ret < 0) {
+			goto readerror;
+		}
 		for (i = 0; i <= 2; i++) {
-			ret = cfread(&cf, buf, 8, BSDIFF_BLOCK_CONTROL, NULL);
-			if (ret < 0) {
-				goto readerror;
-			}
-			ctrl[i] = offtin(buf);
+			ctrl[i] = offtin(buf + 8 * i);
 		}
 
 		/* Sanity-check */
@@ -647,16 +1697,21 @@ static int apply_delta_v2(int subver, FILE *f,
 		}
 
 		/* Read diff string */
-		ret = cfread(&df, new_data + new_pos, ctrl[0], BSDIFF_BLOCK_DIFF, &d_zeros);
+		ret = cpipe_read(&pipe, BSDIFF_BLOCK_DIFF, new_data + new_pos, ctrl[0]);
 		if (ret < 0) {
 			goto readerror;
 		}
 
 		/* Add old data to diff string */
-		for (i = 0; i < ctrl[0]; i++) {
-			if ((old_pos + i >= 0) && (old_pos + i < old_size)) {
-				new_data[new_pos + i] += old_data[old_pos + i];
+		if (clones.blksize) {
+			ret = add_old_data_cloned(&clones, new_data, old_data, old_size,
+						  new_pos, old_pos, ctrl[0],
+						  dblock_get_enc(encoding) == BSDIFF_ENC_ZEROS);
+			if (ret < 0) {
+				goto readerror;
 			}
+		} else {
+			add_old_data(new_data, old_data, old_size, new_pos, old_pos, 0, ctrl[0]);
 		}
 
 		/* Adjust pointers */
@@ -674,7 +1729,7 @@ static int apply_delta_v2(int subver, FILE *f,
 		}
 
 		/* Read extra string */
-		ret = cfread(&ef, new_data + new_pos, ctrl[1], BSDIFF_BLOCK_EXTRA, &e_zeros);
+		ret = cpipe_read(&pipe, BSDIFF_BLOCK_EXTRA, new_data + new_pos, ctrl[1]);
 		if (ret < 0) {
 			goto readerror;
 		}
@@ -682,49 +1737,106 @@ static int apply_delta_v2(int subver, FILE *f,
 		/* Adjust pointers */
 		new_pos += ctrl[1];
 		old_pos += ctrl[2];
+
+		if (io && new_pos - written >= BSDIFF_WRITE_WINDOW) {
+			/* a failed ring leaves the whole file to the plain write */
+			if (bsio_write(io, fd, new_data + written, new_pos - written, written) < 0) {
+				bsio_close(io);
+				io = NULL;
+			}
+			written = new_pos;
+		}
+
+		/* hash each window while it is still in cache */
+		if (digest.alg && new_pos - hashed >= BSDIFF_WRITE_WINDOW) {
+			digest_new_data(&digest, &clones, &next_clone, new_data, old_data,
+					hashed, new_pos);
+			hashed = new_pos;
+		}
+	}
+
+	if (digest.alg) {
+		digest_new_data(&digest, &clones, &next_clone, new_data, old_data,
+				hashed, new_size);
+		digest_final(&digest, sum);
+		if (memcmp(sum, v3_header.new_digest, digest_size(digest.alg)) != 0) {
+			ret = -3;
+			goto readerror;
+		}
 	}
 
 	/* Clean up the readers */
+	cpipe_stop(&pipe);
 	cfclose(&cf);
 	cfclose(&df);
 	cfclose(&ef);
 
-	/* Write the new file */
-	fd = open(new_filename, O_CREAT | O_EXCL | O_WRONLY, 00644);
-	if (fd < 0) {
-		ret = -1;
+	if (out->w) {
+		ret = writer_write(out->w, new_data, new_size, 0);
+		goto writeerror;
+	} else if (new_filename == NULL) {
+		*out->buf = new_data;
+		*out->len = new_size;
+		ret = 0;
 		goto writeerror;
 	}
 
-	if (write(fd, new_data, new_size) != new_size) {
-		unlink(new_filename);
+	/* Write the new file; without a ring, or when it fails, plainly */
+	ret = -1;
+	if (io) {
+		ret = bsio_write(io, fd, new_data + written, new_size - written, written);
+		if (ret == 0) {
+			ret = bsio_wait(io);
+		}
+		bsio_close(io);
+	}
+	if (ret < 0) {
+		if (fd < 0) {
+			fd = open_new_file(new_filename, flags & BSDIFF_APPLY_ATOMIC, &anon);
+		}
+		if (fd < 0) {
+			goto writeerror;
+		}
+		ret = write_new_data(&clones, fd, new_data, new_size, old_data,
+				     flags & BSDIFF_APPLY_SPARSE);
+	}
+	if (ret < 0) {
+		if (!anon) {
+			unlink(new_filename);
+		}
 		close(fd);
-		ret = -1;
 		goto writeerror;
 	}
 
-	close(fd);
-
-	ret = chown(new_filename, uid, gid);
-	if (ret < 0) {
-		free(new_data);
-		return ret;
+	ret = fchown(fd, uid, gid);
+	if (ret == 0) {
+		ret = fchmod(fd, mode);
 	}
-
-	ret = chmod(new_filename, mode);
-	if (ret < 0) {
-		free(new_data);
-		return ret;
+	if (ret == 0 && anon) {
+		ret = publish_new_file(fd, new_filename);
 	}
 
+	close(fd);
+
 writeerror:
-	free(new_data);
-	munmap(old_data, old_size);
+	clones_free(&clones);
+	reader_unload(old, old_data, old_mapped);
 	return ret;
 
 readerror:
-	free(new_data);
-	munmap(old_data, old_size);
+	cpipe_stop(&pipe);
+	bsio_close(io);
+	if (fd >= 0) {
+		if (!anon) {
+			unlink(new_filename);
+		}
+		close(fd);
+	}
+	clones_free(&clones);
+	reader_unload(old, old_data, old_mapped);
+	if (new_filename == NULL && out->w == NULL && *out->buf == NULL) {
+		free(new_data);
+	}
 preperror:
 	cfclose(&cf);
 	cfclose(&df);
@@ -732,56 +1844,990 @@ preperror:
 	return ret;
 }
 
-int apply_bsdiff_delta(char *oldfile, char *newfile, char *deltafile)
+/* Room for the three blocks of a stream frame, which never exceed their
+ * uncompressed sizes, max_tuples * 24 and frame_size, by more than a zeros
+ * count each. */
+static uint64_t frame_blocks_max(uint64_t frame_size)
 {
-	FILE *f;
-	unsigned char magic[8];
-	struct stat sb;
-	int ret;
+	return 3 * (MAX(frame_size, MAX(frame_size / 24, 1) * 24) + 8);
+}
+
+/* Decodes one stream frame, whose blocks have been read into fbuf, into
+ * fnew. The frame starts at *old_pos in the old file, which is advanced, and
+ * may produce no more than new_left bytes; *len gets what it produced. */
+static int decode_frame(struct frame_stream *frame, u_char *fbuf, uint64_t frame_size,
+			u_char *old_data, off_t old_size, off_t *old_pos,
+			off_t new_left, u_char *fnew, uint64_t *len)
+{
+	struct bsdiff_reader blocks;
+	memio mio;
+	cfile cf, df, ef;
+	u_char buf[24];
+	uint64_t n = 0, dzeros = ULONG_MAX, ezeros = ULONG_MAX;
+	int64_t ctrl[3];
+	uint32_t t;
+	int i, ret = 0;
 
-	/* Open patch file */
-	f = fopen(deltafile, "rb");
-	if (!f) {
+	if (frame->tuples == 0 || frame->tuples > MAX(frame_size / 24, 1) ||
+	    cblock_get_enc(frame->encoding) == BSDIFF_ENC_ZEROS) {
 		return -1;
 	}
 
-	if (stat(deltafile, &sb) == -1) {
-		ret = -1;
-		goto error;
-	}
-	/* Make sure delta file is at least big enough to have a header */
-	if (sb.st_size < 8) {
-		ret = -2;
-		goto error;
+	reader_mem(&blocks, &mio, fbuf, (uint64_t)frame->control_length +
+		   frame->diff_length + frame->extra_length);
+	if (open_bsdiff_blocks(&cf, &df, &ef, &blocks, frame->control_length,
+			       frame->diff_length, 0, frame->encoding) < 0) {
+		return -1;
 	}
 
-	/* Read header magic */
-	if (fread(&magic, 8, 1, f) < 1) {
-		ret = -1;
-		goto error;
-	}
+	/* same tuples as apply_delta_v2(), into the frame buffer */
+	for (t = 0; t < frame->tuples; t++) {
+		if ((ret = cfread(&cf, buf, 24, BSDIFF_BLOCK_CONTROL, NULL)) < 0) {
+			break;
+		}
+		for (i = 0; i <= 2; i++) {
+			ctrl[i] = offtin(buf + 8 * i);
+		}
 
-	/* Deal with different header types */
-	if (memcmp(&magic, BSDIFF_HDR_MAGIC_V20, 8) == 0) {
-		rewind(f);
-		ret = apply_delta_v2(0, f, oldfile, newfile, deltafile);
-		if (ret != 0) {
-			goto error;
+		if (ctrl[0] < 0 || ctrl[1] < 0 ||
+		    (uint64_t)ctrl[0] > frame_size - n ||
+		    (off_t)n + ctrl[0] > new_left) {
+			ret = -1;
+			break;
 		}
-	} else if (memcmp(&magic, BSDIFF_HDR_MAGIC_V21, 8) == 0) {
-		rewind(f);
-		ret = apply_delta_v2(1, f, oldfile, newfile, deltafile);
-		if (ret != 0) {
-			goto error;
+		if ((ret = cfread(&df, fnew + n, ctrl[0], BSDIFF_BLOCK_DIFF, &dzeros)) < 0) {
+			break;
 		}
-	} else if (memcmp(&magic, BSDIFF_HDR_DIR_V20, 8) == 0) {
-		ret = -1;
-	} else if (memcmp(&magic, BSDIFF_HDR_FULLDL, 8) == 0) {
-		ret = -2;
-	} else {
-		ret = -1;
+		add_old_data(fnew, old_data, old_size, n, *old_pos, 0, ctrl[0]);
+		n += ctrl[0];
+		*old_pos += ctrl[0];
+
+		if ((uint64_t)ctrl[1] > frame_size - n ||
+		    (off_t)n + ctrl[1] > new_left ||
+		    *old_pos + ctrl[2] > old_size || *old_pos + ctrl[2] < 0) {
+			ret = -1;
+			break;
+		}
+		if ((ret = cfread(&ef, fnew + n, ctrl[1], BSDIFF_BLOCK_EXTRA, &ezeros)) < 0) {
+			break;
+		}
+		n += ctrl[1];
+		*old_pos += ctrl[2];
 	}
-error:
-	fclose(f);
+	cfclose(&cf);
+	cfclose(&df);
+	cfclose(&ef);
+
+	*len = n;
+	return ret;
+}
+
+/* Resumable apply: the part file and checkpoint next to the new file. */
+typedef struct {
+	char *part;
+	char *ckpt;
+	char *tmp;
+	struct stream_checkpoint c;
+	off_t saved; /* new_pos of the last checkpoint */
+} cresume;
+
+static int resume_init(cresume *r, char *new_filename)
+{
+	if (asprintf(&r->part, "%s.part", new_filename) < 0) {
+		r->part = NULL;
+		return -1;
+	}
+	if (asprintf(&r->ckpt, "%s.ckpt", new_filename) < 0) {
+		r->ckpt = NULL;
+		return -1;
+	}
+	if (asprintf(&r->tmp, "%s.ckpt.tmp", new_filename) < 0) {
+		r->tmp = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static void resume_free(cresume *r)
+{
+	free(r->part);
+	free(r->ckpt);
+	free(r->tmp);
+}
+
+/* Makes the part file durable up to r->c.new_pos, then replaces the last
+ * checkpoint with r->c in one step. */
+static int resume_save(cresume *r, int fd)
+{
+	int cfd;
+
+	if (fdatasync(fd) != 0) {
+		return -1;
+	}
+	if ((cfd = open(r->tmp, O_CREAT | O_TRUNC | O_WRONLY, 00600)) < 0) {
+		return -1;
+	}
+	if (write_all(cfd, (u_char *)&r->c, sizeof(struct stream_checkpoint), 0) < 0 ||
+	    fsync(cfd) != 0) {
+		close(cfd);
+		unlink(r->tmp);
+		return -1;
+	}
+	close(cfd);
+	if (rename(r->tmp, r->ckpt) != 0) {
+		unlink(r->tmp);
+		return -1;
+	}
+	r->saved = r->c.new_pos;
+	return 0;
+}
+
+/* Sets r->c to the start of the delta whose header has CRC-32 header_crc. */
+static void resume_reset(cresume *r, uint32_t header_crc)
+{
+	memset(&r->c, 0, sizeof(struct stream_checkpoint));
+	memcpy(r->c.magic, BSDIFF_CKPT_MAGIC, 8);
+	r->c.header_crc = header_crc;
+	r->c.delta_crc = crc32(0, NULL, 0);
+	r->c.output_crc = crc32(0, NULL, 0);
+	r->saved = 0;
+}
+
+/* Opens the part file. If there is a checkpoint for the delta whose header
+ * has CRC-32 header_crc, and the part file still holds what it says, r->c
+ * is where to go on from; otherwise r->c starts from scratch. buf is
+ * scratch space of len bytes. */
+static int resume_open(cresume *r, uint32_t header_crc, u_char *buf, size_t len)
+{
+	struct stream_checkpoint c;
+	uLong crc;
+	off_t pos;
+	ssize_t n;
+	int fd, cfd;
+
+	resume_reset(r, header_crc);
+
+	if ((cfd = open(r->ckpt, O_RDONLY)) >= 0) {
+		n = read(cfd, &c, sizeof(struct stream_checkpoint));
+		close(cfd);
+		if (n == sizeof(struct stream_checkpoint) &&
+		    memcmp(c.magic, BSDIFF_CKPT_MAGIC, 8) == 0 && c.header_crc == header_crc &&
+		    c.new_pos > 0 && (fd = open(r->part, O_RDWR)) >= 0) {
+			crc = crc32(0, NULL, 0);
+			for (pos = 0; pos < c.new_pos; pos += n) {
+				n = pread(fd, buf, MIN((off_t)len, c.new_pos - pos), pos);
+				if (n <= 0) {
+					break;
+				}
+				crc = crc32(crc, buf, n);
+			}
+			if (pos == c.new_pos && crc == c.output_crc) {
+				r->c = c;
+				r->saved = c.new_pos;
+				return fd;
+			}
+			close(fd);
+		}
+	}
+	return open(r->part, O_CREAT | O_TRUNC | O_RDWR, 00644);
+}
+
+/* Puts the finished part file in place of the new file, which must not
+ * exist yet, and drops the checkpoint. */
+static int resume_publish(cresume *r, char *new_filename)
+{
+	if (link(r->part, new_filename) != 0) {
+		return -1;
+	}
+	unlink(r->part);
+	unlink(r->ckpt);
+	return 0;
+}
+
+/* Applies a stream delta read sequentially from f, whose magic has already
+ * been consumed; seekable says it is followed by the seekable header and
+ * its index, which this path skips. Each frame is decoded into a frame
+ * sized buffer and written out at once, so neither the delta nor the new
+ * file is held in memory. The reflink, sparse and io_uring flags do not
+ * apply to this path; the resume flag only applies to this path. */
+static int apply_stream(bsdiff_ctx *ctx, FILE *f, int seekable,
+			struct bsdiff_reader *old, cdest *out)
+{
+	char *new_filename = out->path;
+	unsigned int flags = new_filename ? ctx->apply_flags : 0;
+	struct header_stream header;
+	struct header_seekable sheader;
+	struct stream_index_entry entry;
+	struct frame_stream frame;
+	u_char *old_data = NULL, *new_data = NULL, *fbuf = NULL, *fnew = NULL;
+	uint64_t frame_size, blen, blocks, n, i;
+	off_t old_pos = 0, new_pos = 0, old_size, new_size, frames_at;
+	int ret = 0, fd = -1, anon = 0, old_mapped, resume = 0;
+	uLong header_crc, delta_crc;
+	cresume rs;
+
+	memset(&rs, 0, sizeof(cresume));
+	if (seekable) {
+		if (fread((u_char *)&sheader + 8, sizeof(struct header_seekable) - 8, 1, f) < 1 ||
+		    sheader.offset_to_first_block != sizeof(struct header_seekable)) {
+			return -1;
+		}
+		header_crc = crc32(0, (u_char *)&sheader + 8, sizeof(struct header_seekable) - 8);
+		for (i = 0; i < sheader.entries; i++) {
+			if (fread(&entry, sizeof(struct stream_index_entry), 1, f) < 1) {
+				return -1;
+			}
+			header_crc = crc32(header_crc, (u_char *)&entry,
+					   sizeof(struct stream_index_entry));
+		}
+		memcpy(&header.magic, sheader.magic, 8);
+		header.offset_to_first_block = sizeof(struct header_stream);
+		header.frame_size = sheader.frame_size;
+		header.old_file_length = sheader.old_file_length;
+		header.new_file_length = sheader.new_file_length;
+		header.file_mode = sheader.file_mode;
+		header.file_owner = sheader.file_owner;
+		header.file_group = sheader.file_group;
+	} else if (fread((u_char *)&header + 8, sizeof(struct header_stream) - 8, 1, f) < 1) {
+		return -1;
+	} else {
+		header_crc = crc32(0, (u_char *)&header + 8, sizeof(struct header_stream) - 8);
+	}
+	frame_size = header.frame_size;
+	old_size = header.old_file_length;
+	new_size = header.new_file_length;
+	/* only a new file built in memory is held to BSDIFF_MAX_FILESZ */
+	if (header.offset_to_first_block != sizeof(struct header_stream) ||
+	    frame_size == 0 || frame_size > BSDIFF_STREAM_MAX_FRAME ||
+	    old_size < 0 || new_size < 0 ||
+	    (new_size > BSDIFF_MAX_FILESZ && !new_filename && !out->w)) {
+		return -1;
+	}
+
+	/* a different base means a full download rather than a bad delta */
+	if (old && old->size(old->opaque) != old_size) {
+		return -4;
+	}
+	if ((old_data = open_old(ctx, old, old_size, &old_mapped)) == NULL) {
+		return -1;
+	}
+
+	blen = frame_blocks_max(frame_size);
+	if ((fbuf = malloc(blen)) == NULL || (fnew = malloc(frame_size)) == NULL) {
+		ret = -1;
+		goto out;
+	}
+
+	if (new_filename && (flags & BSDIFF_APPLY_RESUME)) {
+		resume = 1;
+		if (resume_init(&rs, new_filename) < 0 ||
+		    (fd = resume_open(&rs, header_crc, fnew, frame_size)) < 0) {
+			ret = -1;
+			goto out;
+		}
+	} else if (new_filename) {
+		fd = open_new_file(new_filename, flags & BSDIFF_APPLY_ATOMIC, &anon);
+		if (fd < 0) {
+			ret = -1;
+			goto out;
+		}
+	} else if (out->w == NULL) {
+		if (*out->buf == NULL) {
+			new_data = malloc(new_size + 1);
+		} else if (*out->len >= (size_t)new_size) {
+			new_data = *out->buf;
+		}
+		if (new_data == NULL) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	/* going on from a checkpoint, the frames before it are only read, to
+	 * check that they are the ones it was taken after */
+	if (resume && rs.c.frames > 0) {
+		frames_at = ftello(f);
+		delta_crc = crc32(0, NULL, 0);
+		for (i = 0, blocks = 0; i < rs.c.frames; i++) {
+			if (fread(&frame, sizeof(struct frame_stream), 1, f) < 1) {
+				ret = -1;
+				goto out;
+			}
+			n = (uint64_t)frame.control_length + frame.diff_length + frame.extra_length;
+			if (n > blen || (n > 0 && fread(fbuf, n, 1, f) < 1)) {
+				ret = -1;
+				goto out;
+			}
+			delta_crc = crc32(delta_crc, (u_char *)&frame, sizeof(struct frame_stream));
+			delta_crc = crc32(delta_crc, fbuf, n);
+			blocks += sizeof(struct frame_stream) + n;
+		}
+		if (delta_crc != rs.c.delta_crc || blocks != rs.c.delta_offset ||
+		    rs.c.new_pos > new_size || rs.c.old_pos < 0 || rs.c.old_pos > old_size) {
+			/* a different delta: start over, which a pipe cannot */
+			unlink(rs.ckpt);
+			if (frames_at < 0 || fseeko(f, frames_at, SEEK_SET) != 0 ||
+			    ftruncate(fd, 0) != 0) {
+				ret = -1;
+				goto out;
+			}
+			resume_reset(&rs, header_crc);
+		} else {
+			new_pos = rs.c.new_pos;
+			old_pos = rs.c.old_pos;
+		}
+	}
+
+	while (new_pos < new_size && ret == 0) {
+		if (fread(&frame, sizeof(struct frame_stream), 1, f) < 1) {
+			ret = -1;
+			break;
+		}
+		blocks = (uint64_t)frame.control_length + frame.diff_length + frame.extra_length;
+		if (blocks > blen || (blocks > 0 && fread(fbuf, blocks, 1, f) < 1)) {
+			ret = -1;
+			break;
+		}
+		if ((ret = decode_frame(&frame, fbuf, frame_size, old_data, old_size,
+					&old_pos, new_size - new_pos, fnew, &n)) < 0) {
+			break;
+		}
+
+		if (fd >= 0) {
+			ret = write_all(fd, fnew, n, new_pos);
+		} else if (out->w) {
+			ret = writer_write(out->w, fnew, n, new_pos);
+		} else {
+			memcpy(new_data + new_pos, fnew, n);
+		}
+		new_pos += n;
+
+		if (resume && ret == 0) {
+			rs.c.delta_crc = crc32(rs.c.delta_crc, (u_char *)&frame,
+					       sizeof(struct frame_stream));
+			rs.c.delta_crc = crc32(rs.c.delta_crc, fbuf, blocks);
+			rs.c.output_crc = crc32(rs.c.output_crc, fnew, n);
+			rs.c.frames++;
+			rs.c.delta_offset += sizeof(struct frame_stream) + blocks;
+			rs.c.new_pos = new_pos;
+			rs.c.old_pos = old_pos;
+			if (new_pos < new_size && new_pos - rs.saved >= BSDIFF_CKPT_INTERVAL) {
+				ret = resume_save(&rs, fd);
+			}
+		}
+	}
+
+	/* an interrupted delta leaves a checkpoint after its last good frame */
+	if (ret < 0 && resume && rs.c.new_pos > rs.saved) {
+		resume_save(&rs, fd);
+	}
+
+	if (ret == 0 && fd >= 0) {
+		ret = fchown(fd, header.file_owner, header.file_group);
+		if (ret == 0) {
+			ret = fchmod(fd, header.file_mode);
+		}
+		if (ret == 0 && anon) {
+			ret = publish_new_file(fd, new_filename);
+		}
+		if (ret == 0 && resume) {
+			ret = resume_publish(&rs, new_filename);
+		}
+	} else if (ret == 0 && new_data) {
+		*out->buf = new_data;
+		*out->len = new_size;
+		new_data = NULL;
+	}
+
+out:
+	if (fd >= 0) {
+		/* a part file is kept for the next run */
+		if (ret < 0 && !anon && !resume) {
+			unlink(new_filename);
+		}
+		close(fd);
+	}
+	if (new_data && new_data != *out->buf) {
+		free(new_data);
+	}
+	free(fbuf);
+	free(fnew);
+	resume_free(&rs);
+	reader_unload(old, old_data, old_mapped);
+	return ret;
+}
+
+static int apply_dir(bsdiff_ctx *ctx, char *olddir, char *newdir,
+		     struct bsdiff_reader *ar,
+		     void (*fulldl)(const char *name, void *arg), void *arg);
+
+/* Checks the magic of delta and applies it as apply_delta_v2() does. */
+static int apply_delta(bsdiff_ctx *ctx, struct bsdiff_reader *old, char *old_path,
+		       struct bsdiff_reader *delta, cdest *out)
+{
+	unsigned char magic[8];
+	int64_t delta_size;
+	FILE *f;
+	int ret;
+
+	/* Make sure delta file is at least big enough to have a header */
+	if ((delta_size = delta->size(delta->opaque)) < 0) {
+		return -1;
+	}
+	if (delta_size < 8) {
+		return -2;
+	}
+
+	if ((f = csopen(delta, NULL)) == NULL) {
+		return -1;
+	}
+
+	/* Read header magic */
+	if (fread(&magic, 8, 1, f) < 1) {
+		ret = -1;
+	} else if (memcmp(&magic, BSDIFF_HDR_MAGIC_V20, 8) == 0) {
+		/* Deal with different header types */
+		rewind(f);
+		ret = apply_delta_v2(ctx, 0, f, old, old_path, delta, out);
+	} else if (memcmp(&magic, BSDIFF_HDR_MAGIC_V21, 8) == 0) {
+		rewind(f);
+		ret = apply_delta_v2(ctx, 1, f, old, old_path, delta, out);
+	} else if (memcmp(&magic, BSDIFF_HDR_MAGIC_V30, 8) == 0) {
+		rewind(f);
+		ret = apply_delta_v2(ctx, 3, f, old, old_path, delta, out);
+	} else if (memcmp(&magic, BSDIFF_HDR_MAGIC_STREAM, 8) == 0) {
+		ret = apply_stream(ctx, f, 0, old, out);
+	} else if (memcmp(&magic, BSDIFF_HDR_MAGIC_SEEKABLE, 8) == 0) {
+		ret = apply_stream(ctx, f, 1, old, out);
+	} else if (memcmp(&magic, BSDIFF_HDR_DIR_V20, 8) == 0) {
+		/* archives only go from one directory to another */
+		if (old_path && out->path) {
+			ret = apply_dir(ctx, old_path, out->path, delta, NULL, NULL);
+		} else {
+			ret = -1;
+		}
+	} else if (memcmp(&magic, BSDIFF_HDR_FULLDL, 8) == 0) {
+		ret = -2;
+	} else {
+		ret = -1;
+	}
+
+	fclose(f);
+	return ret;
+}
+
+int bsdiff_ctx_apply(bsdiff_ctx *ctx, char *oldfile, char *newfile, char *deltafile)
+{
+	struct bsdiff_reader old, delta;
+	cdest out = { newfile, NULL, NULL, NULL };
+	int have_old, ret;
+
+	if (bsdiff_reader_file(&delta, deltafile) < 0) {
+		return -1;
+	}
+	/* a missing old file is only an error once the delta needs it */
+	have_old = bsdiff_reader_file(&old, oldfile) == 0;
+
+	ret = apply_delta(ctx, have_old ? &old : NULL, oldfile, &delta, &out);
+
+	if (have_old) {
+		bsdiff_reader_close(&old);
+	}
+	bsdiff_reader_close(&delta);
+	return ret;
+}
+
+int bsdiff_ctx_verify(bsdiff_ctx *ctx, char *oldfile, char *deltafile)
+{
+	struct bsdiff_reader old, delta;
+	void *buf = NULL;
+	size_t len = 0;
+	cdest out = { NULL, NULL, &buf, &len };
+	int have_old, ret;
+
+	if (bsdiff_reader_file(&delta, deltafile) < 0) {
+		return -1;
+	}
+	have_old = bsdiff_reader_file(&old, oldfile) == 0;
+
+	ret = apply_delta(ctx, have_old ? &old : NULL, NULL, &delta, &out);
+
+	free(buf);
+	if (have_old) {
+		bsdiff_reader_close(&old);
+	}
+	bsdiff_reader_close(&delta);
+	return ret;
+}
+
+int bsdiff_ctx_apply_io(bsdiff_ctx *ctx, struct bsdiff_reader *old,
+			struct bsdiff_reader *delta, struct bsdiff_writer *new)
+{
+	cdest out = { NULL, new, NULL, NULL };
+
+	return apply_delta(ctx, old, NULL, delta, &out);
+}
+
+int bsdiff_ctx_apply_mem(bsdiff_ctx *ctx, const void *old, size_t old_len,
+			 const void *delta, size_t delta_len,
+			 void **new, size_t *new_len)
+{
+	struct bsdiff_reader old_r, delta_r;
+	memio old_m, delta_m;
+	cdest out = { NULL, NULL, new, new_len };
+
+	reader_mem(&old_r, &old_m, old, old_len);
+	reader_mem(&delta_r, &delta_m, delta, delta_len);
+
+	return apply_delta(ctx, &old_r, NULL, &delta_r, &out);
+}
+
+int bsdiff_ctx_apply_fd(bsdiff_ctx *ctx, char *oldfile, char *newfile, int fd)
+{
+	struct bsdiff_reader old, delta;
+	cdest out = { newfile, NULL, NULL, NULL };
+	u_char *buf = NULL, *tmp;
+	size_t len = 0, cap = 0, n;
+	memio mio;
+	FILE *f;
+	int dfd, have_old, ret;
+
+	if ((dfd = dup(fd)) < 0) {
+		return -1;
+	}
+	if ((f = fdopen(dfd, "rb")) == NULL) {
+		close(dfd);
+		return -1;
+	}
+	have_old = bsdiff_reader_file(&old, oldfile) == 0;
+
+	/* the magic decides whether the rest can be taken as it comes */
+	cap = 8;
+	if ((buf = malloc(cap)) == NULL) {
+		ret = -1;
+		goto out;
+	}
+	len = fread(buf, 1, 8, f);
+	if (len == 8 && (memcmp(buf, BSDIFF_HDR_MAGIC_STREAM, 8) == 0 ||
+			 memcmp(buf, BSDIFF_HDR_MAGIC_SEEKABLE, 8) == 0)) {
+		ret = apply_stream(ctx, f, memcmp(buf, BSDIFF_HDR_MAGIC_SEEKABLE, 8) == 0,
+				   have_old ? &old : NULL, &out);
+		goto out;
+	}
+
+	while (len == cap) {
+		if (cap > BSDIFF_MAX_FILESZ) {
+			ret = -1;
+			goto out;
+		}
+		if ((tmp = realloc(buf, 2 * cap)) == NULL) {
+			ret = -1;
+			goto out;
+		}
+		buf = tmp;
+		cap *= 2;
+		n = fread(buf + len, 1, cap - len, f);
+		len += n;
+	}
+	if (ferror(f)) {
+		ret = -1;
+		goto out;
+	}
+	reader_mem(&delta, &mio, buf, len);
+	ret = apply_delta(ctx, have_old ? &old : NULL, oldfile, &delta, &out);
+
+out:
+	if (have_old) {
+		bsdiff_reader_close(&old);
+	}
+	free(buf);
+	fclose(f);
+	return ret;
+}
+
+/* Rebuilds len bytes of the new file at offset into buf. A seekable delta
+ * only has the frames covering the range decoded, starting from the old
+ * file position its index records for the first of them; any other delta
+ * is applied whole in memory. */
+int bsdiff_ctx_apply_range(bsdiff_ctx *ctx, struct bsdiff_reader *old,
+			   struct bsdiff_reader *delta, uint64_t offset, void *buf, size_t len)
+{
+	struct header_seekable h;
+	struct stream_index_entry *index = NULL, *e;
+	struct frame_stream frame;
+	unsigned char magic[8];
+	u_char *old_data = NULL, *fbuf = NULL, *fnew = NULL, *new = NULL;
+	uint64_t frame_size, blen, base, n, from, done = 0;
+	int64_t delta_size;
+	off_t old_pos;
+	uint32_t lo, hi, mid, i;
+	size_t new_len;
+	cdest out = { NULL, NULL, (void **)&new, &new_len };
+	int ret = 0, old_mapped;
+
+	if ((delta_size = delta->size(delta->opaque)) < 0) {
+		return -1;
+	}
+	if (delta_size < 8 || reader_read(delta, magic, 8, 0) < 0 ||
+	    memcmp(magic, BSDIFF_HDR_MAGIC_SEEKABLE, 8) != 0) {
+		/* everything else is rebuilt whole */
+		ret = apply_delta(ctx, old, NULL, delta, &out);
+		if (ret == 0 && (offset > new_len || len > new_len - offset)) {
+			ret = -1;
+		} else if (ret == 0) {
+			memcpy(buf, new + offset, len);
+		}
+		free(new);
+		return ret;
+	}
+
+	if (reader_read(delta, &h, sizeof(struct header_seekable), 0) < 0) {
+		return -1;
+	}
+	frame_size = h.frame_size;
+	base = h.offset_to_first_block + (uint64_t)h.entries * sizeof(struct stream_index_entry);
+	if (h.offset_to_first_block != sizeof(struct header_seekable) ||
+	    frame_size == 0 || frame_size > BSDIFF_STREAM_MAX_FRAME ||
+	    h.new_file_length > INT64_MAX || h.old_file_length > INT64_MAX ||
+	    base > (uint64_t)delta_size) {
+		return -1;
+	}
+	if (offset > h.new_file_length || len > h.new_file_length - offset) {
+		return -1;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	if ((index = malloc((uint64_t)h.entries * sizeof(struct stream_index_entry))) == NULL ||
+	    reader_read(delta, index, (uint64_t)h.entries * sizeof(struct stream_index_entry),
+			h.offset_to_first_block) < 0) {
+		free(index);
+		return -1;
+	}
+	for (i = 0; i < h.entries; i++) {
+		if ((i == 0 && index[i].new_pos != 0) ||
+		    (i > 0 && (index[i].new_pos < index[i - 1].new_pos ||
+			       index[i].offset <= index[i - 1].offset)) ||
+		    index[i].old_pos > h.old_file_length) {
+			free(index);
+			return -1;
+		}
+	}
+
+	/* the last frame starting at or before offset */
+	lo = 0;
+	hi = h.entries;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (index[mid].new_pos <= offset) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (old && (uint64_t)old->size(old->opaque) != h.old_file_length) {
+		free(index);
+		return -4;
+	}
+	if ((old_data = open_old(ctx, old, h.old_file_length, &old_mapped)) == NULL) {
+		free(index);
+		return -1;
+	}
+	blen = frame_blocks_max(frame_size);
+	if ((fbuf = malloc(blen)) == NULL || (fnew = malloc(frame_size)) == NULL) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = lo; i < h.entries && done < len; i++) {
+		e = &index[i];
+		if (reader_read(delta, &frame, sizeof(struct frame_stream), base + e->offset) < 0) {
+			ret = -1;
+			break;
+		}
+		n = (uint64_t)frame.control_length + frame.diff_length + frame.extra_length;
+		if (n > blen ||
+		    reader_read(delta, fbuf, n, base + e->offset + sizeof(struct frame_stream)) < 0) {
+			ret = -1;
+			break;
+		}
+		old_pos = e->old_pos;
+		if ((ret = decode_frame(&frame, fbuf, frame_size, old_data, h.old_file_length,
+					&old_pos, h.new_file_length - e->new_pos, fnew, &n)) < 0) {
+			break;
+		}
+		/* frames must join up as the index says */
+		if ((i + 1 < h.entries && e->new_pos + n != index[i + 1].new_pos) ||
+		    (i + 1 == h.entries && e->new_pos + n != h.new_file_length)) {
+			ret = -1;
+			break;
+		}
+
+		from = offset + done - e->new_pos;
+		if (from < n) {
+			memcpy((u_char *)buf + done, fnew + from, MIN(n - from, len - done));
+			done += MIN(n - from, len - done);
+		}
+	}
+	if (ret == 0 && done < len) {
+		ret = -1;
+	}
+
+out:
+	free(index);
+	free(fbuf);
+	free(fnew);
+	reader_unload(old, old_data, old_mapped);
+	return ret;
+}
+
+/* Directory archives (DIR_V20), see struct header_dir_v20. */
+
+/* A reader for part of another one: a delta in the data area. */
+typedef struct {
+	struct bsdiff_reader *r;
+	uint64_t base;
+	uint64_t len;
+} crange;
+
+static int64_t range_read_at(void *opaque, void *buf, size_t len, uint64_t off)
+{
+	crange *c = opaque;
+
+	if (off >= c->len) {
+		return 0;
+	}
+	return c->r->read_at(c->r->opaque, buf, MIN(len, c->len - off), c->base + off);
+}
+
+static int64_t range_size(void *opaque)
+{
+	return ((crange *)opaque)->len;
+}
+
+static void reader_range(struct bsdiff_reader *r, crange *c,
+			 struct bsdiff_reader *from, uint64_t base, uint64_t len)
+{
+	c->r = from;
+	c->base = base;
+	c->len = len;
+
+	memset(r, 0, sizeof(struct bsdiff_reader));
+	r->opaque = c;
+	r->read_at = range_read_at;
+	r->size = range_size;
+}
+
+/* Decodes the index or solid stream, length bytes at off that expand to
+ * size bytes. */
+u_char *dir_block(struct bsdiff_reader *ar, off_t off, uint64_t length,
+		  uint64_t size, int method, const char *tag)
+{
+	uint64_t zeros = ULONG_MAX;
+	u_char *buf;
+	cfile cf;
+	int ret;
+
+	if (size > BSDIFF_MAX_FILESZ || (method == BSDIFF_ENC_NONE && length != size)) {
+		return NULL;
+	}
+	if ((buf = malloc(size + 1)) == NULL) {
+		return NULL;
+	}
+	if (cfopen(&cf, ar, off, tag, method, NULL) < 0) {
+		free(buf);
+		return NULL;
+	}
+	ret = cfread(&cf, buf, size, BSDIFF_BLOCK_DIFF, &zeros);
+	cfclose(&cf);
+	if (ret < 0) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/* Names come from the archive; they must stay below the target directory. */
+static int dir_name_ok(const char *name)
+{
+	const char *p = name;
+
+	if (*name == '\0' || *name == '/') {
+		return 0;
+	}
+	while (p) {
+		if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0')) {
+			return 0;
+		}
+		if (*p == '/' || (p[0] == '.' && (p[1] == '/' || p[1] == '\0'))) {
+			return 0;
+		}
+		if ((p = strchr(p, '/')) != NULL) {
+			p++;
+		}
+	}
+	return 1;
+}
+
+/* Creates a directory of the archive. One that is already there keeps
+ * its metadata. */
+static int dir_mkdir(char *path, mode_t mode, uid_t uid, gid_t gid)
+{
+	if (mkdir(path, 0700) != 0) {
+		return errno == EEXIST ? 0 : -1;
+	}
+	if (chown(path, uid, gid) != 0 || chmod(path, mode & 07777) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int apply_dir(bsdiff_ctx *ctx, char *olddir, char *newdir,
+		     struct bsdiff_reader *ar,
+		     void (*fulldl)(const char *name, void *arg), void *arg)
+{
+	char old_path[PATH_MAX], new_path[PATH_MAX], name[UINT16_MAX + 1];
+	struct header_dir_v20 header;
+	struct dir_entry_v20 e;
+	struct bsdiff_reader old, delta;
+	u_char *index = NULL, *solid = NULL, *p;
+	uint64_t data_start;
+	uint32_t i;
+	crange range;
+	memio mio;
+	cdest out;
+	int have_old, r, ret = 0;
+
+	if (reader_read(ar, &header, sizeof(struct header_dir_v20), 0) < 0 ||
+	    header.offset_to_first_block != sizeof(struct header_dir_v20)) {
+		return -1;
+	}
+	data_start = header.offset_to_first_block + header.index_length + header.solid_length;
+	if (header.index_length > (uint64_t)ar->size(ar->opaque) ||
+	    header.solid_length > (uint64_t)ar->size(ar->opaque) ||
+	    header.data_length > (uint64_t)ar->size(ar->opaque) ||
+	    data_start + header.data_length != (uint64_t)ar->size(ar->opaque)) {
+		return -1;
+	}
+
+	index = dir_block(ar, header.offset_to_first_block, header.index_length,
+			  header.index_size, cblock_get_enc(header.encoding), "index");
+	solid = dir_block(ar, header.offset_to_first_block + header.index_length,
+			  header.solid_length, header.solid_size,
+			  dblock_get_enc(header.encoding), "solid");
+	if (index == NULL || solid == NULL ||
+	    dir_mkdir(newdir, header.file_mode, header.file_owner, header.file_group) < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	p = index;
+	for (i = 0; i < header.entries && ret != -1; i++) {
+		if ((uint64_t)(index + header.index_size - p) < sizeof(struct dir_entry_v20)) {
+			ret = -1;
+			break;
+		}
+		memcpy(&e, p, sizeof(struct dir_entry_v20));
+		p += sizeof(struct dir_entry_v20);
+		if ((uint64_t)(index + header.index_size - p) < e.name_length) {
+			ret = -1;
+			break;
+		}
+		memcpy(name, p, e.name_length);
+		name[e.name_length] = '\0';
+		p += e.name_length;
+
+		if (strlen(name) != e.name_length || !dir_name_ok(name) ||
+		    snprintf(old_path, PATH_MAX, "%s/%s", olddir, name) >= PATH_MAX ||
+		    snprintf(new_path, PATH_MAX, "%s/%s", newdir, name) >= PATH_MAX) {
+			ret = -1;
+			break;
+		}
+
+		if (e.type == BSDIFF_DIR_DIR) {
+			if (dir_mkdir(new_path, e.file_mode, e.file_owner, e.file_group) < 0) {
+				ret = -1;
+			}
+			continue;
+		} else if (e.type == BSDIFF_DIR_FULLDL) {
+			if (fulldl) {
+				fulldl(name, arg);
+			}
+			ret = -2;
+			continue;
+		} else if (e.type == BSDIFF_DIR_SOLID && e.offset <= header.solid_size &&
+			   e.length <= header.solid_size - e.offset) {
+			reader_mem(&delta, &mio, solid + e.offset, e.length);
+		} else if (e.type == BSDIFF_DIR_DELTA && e.offset <= header.data_length &&
+			   e.length <= header.data_length - e.offset) {
+			reader_range(&delta, &range, ar, data_start + e.offset, e.length);
+		} else {
+			ret = -1;
+			break;
+		}
+
+		memset(&out, 0, sizeof(cdest));
+		out.path = new_path;
+		have_old = bsdiff_reader_file(&old, old_path) == 0;
+		r = apply_delta(ctx, have_old ? &old : NULL, old_path, &delta, &out);
+		if (have_old) {
+			bsdiff_reader_close(&old);
+		}
+		if (r == -2 && fulldl) {
+			fulldl(name, arg);
+		}
+		if (r < 0) {
+			ret = r;
+		}
+	}
+	if (ret == 0 && i != header.entries) {
+		ret = -1;
+	}
+
+out:
+	free(index);
+	free(solid);
+	return ret;
+}
+
+int bsdiff_ctx_apply_dir(bsdiff_ctx *ctx, char *olddir, char *newdir, char *archive,
+			 void (*fulldl)(const char *name, void *arg), void *arg)
+{
+	struct bsdiff_reader ar;
+	unsigned char magic[8];
+	int ret;
+
+	if (bsdiff_reader_file(&ar, archive) < 0) {
+		return -1;
+	}
+	if (reader_read(&ar, magic, 8, 0) < 0 || memcmp(magic, BSDIFF_HDR_DIR_V20, 8) != 0) {
+		ret = -1;
+	} else {
+		ret = apply_dir(ctx, olddir, newdir, &ar, fulldl, arg);
+	}
+	bsdiff_reader_close(&ar);
+
+	return ret;
+}
+
+int apply_bsdiff_delta(char *oldfile, char *newfile, char *deltafile)
+{
+	return apply_bsdiff_delta_flags(oldfile, newfile, deltafile, 0);
+}
+
+int apply_bsdiff_delta_flags(char *oldfile, char *newfile, char *deltafile,
+			     unsigned int flags)
+{
+	bsdiff_ctx ctx;
+	int ret;
+
+	bsdiff_ctx_init(&ctx);
+	ctx.apply_flags = flags;
+	ret = bsdiff_ctx_apply(&ctx, oldfile, newfile, deltafile);
+	bsdiff_ctx_release(&ctx);
+
 	return ret;
 }
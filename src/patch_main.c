@@ -30,23 +30,301 @@
  */
 
 #define _GNU_SOURCE
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "bsdiff.h"
+#include "programs.h"
 
-int main(int argc, char **argv)
+static const struct option prog_opts[] = {
+	{"reflink", no_argument, NULL, 'r'},
+	{"sparse", no_argument, NULL, 's'},
+	{"atomic", no_argument, NULL, 'a'},
+	{"io-uring", no_argument, NULL, 'u'},
+	{"no-readahead", no_argument, NULL, 'R'},
+	{"batch", required_argument, NULL, 'b'},
+	{"jobs", required_argument, NULL, 'j'},
+	{"mem-limit", required_argument, NULL, 'm'},
+	{"extract", required_argument, NULL, 'e'},
+	{"verify", no_argument, NULL, 'V'},
+	{"resume", no_argument, NULL, 'C'},
+	{NULL, 0, NULL, 0}
+};
+
+static void usage(char *name)
+{
+	printf("Usage: %s [OPTION]... oldfile newfile deltafile\n", name);
+	printf("  or:  %s [OPTION]... --batch manifest\n", name);
+	printf("  or:  %s --verify oldfile deltafile\n\n", name);
+	printf("Applies the binary diff DELTAFILE to OLDFILE.");
+	printf(" The resulting file will be named NEWFILE.");
+	printf(" A DELTAFILE of '-' is read from standard input.");
+	printf(" If OLDFILE is a directory, DELTAFILE must be a directory archive");
+	printf(" and NEWFILE is the directory to create.\n\n");
+	printf(" In batch mode, each line of MANIFEST names an oldfile, newfile");
+	printf(" and deltafile, separated by whitespace.\n\n");
+	printf("  -r, --reflink        Share unchanged blocks with OLDFILE where the\n");
+	printf("                       filesystem supports it\n");
+	printf("  -s, --sparse         Leave long runs of zeros in NEWFILE as holes\n");
+	printf("  -a, --atomic         Only create NEWFILE once it is complete\n");
+	printf("  -u, --io-uring       Write NEWFILE with io_uring while it is built\n");
+	printf("  -R, --no-readahead   Do not prefetch the parts of OLDFILE needed next\n");
+	printf("  -e, --extract=OFFSET:LENGTH\n");
+	printf("                       Only write LENGTH bytes of the new file from OFFSET\n");
+	printf("  -C, --resume         Build NEWFILE as NEWFILE.part with checkpoints, and\n");
+	printf("                       go on from the last one if it is there (stream\n");
+	printf("                       deltas only)\n");
+	printf("  -V, --verify         Rebuild the new file in memory and check it against\n");
+	printf("                       the digest in DELTAFILE, without writing it\n");
+	printf("  -b, --batch=FILE     Apply every delta listed in FILE\n");
+	printf("  -j, --jobs=N         Run N batch jobs at once (default: one per CPU)\n");
+	printf("  -m, --mem-limit=MiB  Memory budget for batch jobs (default: half of RAM)\n");
+}
+
+static int run_batch(char *manifest, unsigned int flags, unsigned int threads,
+		     uint64_t mem_limit)
+{
+	struct bsdiff_job *jobs;
+	size_t njobs, i, fulldl = 0, failed = 0;
+	bsdiff_ctx *ctx;
+	int ret;
+
+	if (read_manifest(manifest, &jobs, &njobs) < 0) {
+		printf("Failed to read manifest %s\n", manifest);
+		free_manifest(jobs, njobs);
+		return -EXIT_FAILURE;
+	}
+	if ((ctx = bsdiff_ctx_new()) == NULL) {
+		free_manifest(jobs, njobs);
+		return -EXIT_FAILURE;
+	}
+	bsdiff_ctx_set_apply_flags(ctx, flags);
+
+	ret = bsdiff_ctx_apply_batch(ctx, jobs, njobs, threads, mem_limit);
+
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].ret == -2) {
+			fulldl++;
+		} else if (jobs[i].ret < 0) {
+			failed++;
+		}
+		if (jobs[i].ret < 0) {
+			printf("Failed to apply delta (%d): %s\n", jobs[i].ret,
+			       jobs[i].delta_filename);
+		}
+	}
+	printf("Jobs: %zu (%zu applied, %zu full downloads, %zu failed)\n",
+	       njobs, njobs - fulldl - failed, fulldl, failed);
+
+	bsdiff_ctx_free(ctx);
+	free_manifest(jobs, njobs);
+
+	return ret < 0 ? -EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void print_fulldl(const char *name, void *arg)
 {
+	(void)arg;
+	printf("Full download: %s\n", name);
+}
+
+static int run_dir(char *olddir, char *newdir, char *archive, unsigned int flags)
+{
+	bsdiff_ctx *ctx;
 	int ret;
 
-	if (argc != 4) {
-		printf("Usage: %s oldfile newfile deltafile\n\n", argv[0]);
-		printf("Applies the binary diff DELTAFILE to OLDFILE.");
-		printf(" The resulting file will be named NEWFILE.\n");
+	if ((ctx = bsdiff_ctx_new()) == NULL) {
 		return -EXIT_FAILURE;
 	}
+	bsdiff_ctx_set_apply_flags(ctx, flags);
+
+	ret = bsdiff_ctx_apply_dir(ctx, olddir, newdir, archive, print_fulldl, NULL);
+
+	bsdiff_ctx_free(ctx);
+	return ret;
+}
 
-	ret = apply_bsdiff_delta(argv[1], argv[2], argv[3]);
+static int run_stdin(char *oldfile, char *newfile, unsigned int flags)
+{
+	bsdiff_ctx *ctx;
+	int ret;
+
+	if ((ctx = bsdiff_ctx_new()) == NULL) {
+		return -EXIT_FAILURE;
+	}
+	bsdiff_ctx_set_apply_flags(ctx, flags);
+
+	ret = bsdiff_ctx_apply_fd(ctx, oldfile, newfile, STDIN_FILENO);
+
+	bsdiff_ctx_free(ctx);
+	return ret;
+}
+
+static int run_verify(char *oldfile, char *deltafile)
+{
+	bsdiff_ctx *ctx;
+	int ret;
+
+	if ((ctx = bsdiff_ctx_new()) == NULL) {
+		return -EXIT_FAILURE;
+	}
+
+	ret = bsdiff_ctx_verify(ctx, oldfile, deltafile);
+	if (ret == -3) {
+		printf("New file does not match the delta's digest\n");
+	}
+
+	bsdiff_ctx_free(ctx);
+	return ret;
+}
+
+/* Writes the part of the new file given as OFFSET:LENGTH to newfile. */
+static int run_extract(char *oldfile, char *newfile, char *deltafile, char *range)
+{
+	struct bsdiff_reader old, delta;
+	uint64_t offset, len;
+	bsdiff_ctx *ctx = NULL;
+	void *buf = NULL;
+	char *end;
+	FILE *f;
+	int ret = -1;
+
+	offset = strtoull(range, &end, 10);
+	if (*end != ':') {
+		printf("Bad range %s\n", range);
+		return -EXIT_FAILURE;
+	}
+	len = strtoull(end + 1, &end, 10);
+	if (*end != '\0' || len > SIZE_MAX) {
+		printf("Bad range %s\n", range);
+		return -EXIT_FAILURE;
+	}
+
+	if (bsdiff_reader_file(&old, oldfile) < 0) {
+		return -1;
+	}
+	if (bsdiff_reader_file(&delta, deltafile) < 0) {
+		bsdiff_reader_close(&old);
+		return -1;
+	}
+	if ((ctx = bsdiff_ctx_new()) == NULL || (buf = malloc(len + 1)) == NULL) {
+		goto out;
+	}
+	if ((ret = bsdiff_ctx_apply_range(ctx, &old, &delta, offset, buf, len)) < 0) {
+		goto out;
+	}
+	if ((f = fopen(newfile, "wx")) == NULL) {
+		ret = -1;
+		goto out;
+	}
+	if (fwrite(buf, 1, len, f) != len) {
+		ret = -1;
+	}
+	if (fclose(f) != 0) {
+		ret = -1;
+	}
+	if (ret < 0) {
+		unlink(newfile);
+	}
+
+out:
+	free(buf);
+	bsdiff_ctx_free(ctx);
+	bsdiff_reader_close(&delta);
+	bsdiff_reader_close(&old);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int ret, opt;
+	unsigned int flags = 0, threads = 0;
+	uint64_t mem_limit = 0;
+	char *manifest = NULL, *extract = NULL;
+	int verify = 0;
+	struct stat st;
+
+	while ((opt = getopt_long(argc, argv, "rasuRCb:j:m:e:V", prog_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'r':
+			flags |= BSDIFF_APPLY_REFLINK;
+			break;
+		case 's':
+			flags |= BSDIFF_APPLY_SPARSE;
+			break;
+		case 'a':
+			flags |= BSDIFF_APPLY_ATOMIC;
+			break;
+		case 'u':
+			flags |= BSDIFF_APPLY_IO_URING;
+			break;
+		case 'R':
+			flags |= BSDIFF_APPLY_NO_READAHEAD;
+			break;
+		case 'C':
+			flags |= BSDIFF_APPLY_RESUME;
+			break;
+		case 'b':
+			manifest = optarg;
+			break;
+		case 'j':
+			threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			mem_limit = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 'e':
+			extract = optarg;
+			break;
+		case 'V':
+			verify = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return -EXIT_FAILURE;
+		}
+	}
+
+	if (manifest) {
+		if (argc - optind != 0) {
+			usage(argv[0]);
+			return -EXIT_FAILURE;
+		}
+		return run_batch(manifest, flags, threads, mem_limit);
+	}
+
+	if (verify) {
+		if (argc - optind != 2) {
+			usage(argv[0]);
+			return -EXIT_FAILURE;
+		}
+		ret = run_verify(argv[optind], argv[optind + 1]);
+		if (ret != 0) {
+			printf("Failed to verify delta (%d)\n", ret);
+			return ret;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	if (argc - optind != 3) {
+		usage(argv[0]);
+		return -EXIT_FAILURE;
+	}
+
+	if (extract) {
+		ret = run_extract(argv[optind], argv[optind + 1], argv[optind + 2], extract);
+	} else if (strcmp(argv[optind + 2], "-") == 0) {
+		ret = run_stdin(argv[optind], argv[optind + 1], flags);
+	} else if (stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode)) {
+		ret = run_dir(argv[optind], argv[optind + 1], argv[optind + 2], flags);
+	} else {
+		ret = apply_bsdiff_delta_flags(argv[optind], argv[optind + 1],
+					       argv[optind + 2], flags);
+	}
 
 	if (ret != 0) {
 		printf("Failed to apply delta (%d)\n", ret);
@@ -0,0 +1,29 @@
+#ifndef __INCLUDE_GUARD_PROGRAMS_H
+#define __INCLUDE_GUARD_PROGRAMS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bsdiff.h"
+
+/* Helpers shared by the bsdiff, bspatch and bstune programs. They are built
+ * into the programs, not the library, and use only its public API. */
+
+/* batch manifests (manifest.c) */
+int read_manifest(char *filename, struct bsdiff_job **jobs, size_t *njobs);
+void free_manifest(struct bsdiff_job *jobs, size_t njobs);
+
+/* tunables by name (tunables.c); integer tunables use the i member of a
+ * value, the others d */
+#define BSDIFF_TUNABLES 9
+typedef union {
+	int64_t i;
+	double d;
+} tunable_value;
+extern const char *const tunable_names[];
+void set_tunable(struct bsdiff_tunables *t, int i, tunable_value value);
+int parse_tunable_value(int i, const char *s, char **end, tunable_value *value);
+int find_tunable(const char *name, size_t len);
+int parse_tunable(struct bsdiff_tunables *t, const char *arg);
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ *   This file is part of bsdiff.
+ *
+ *      Copyright © 2012-2016 Intel Corporation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bsdiff.h"
+#include "programs.h"
+
+const char *const tunable_names[] = {
+	"match_margin",
+	"fulldl_ratio",
+	"fulldl_min_size",
+	"small_max",
+	"bzip2_factor",
+	"bzip2_penalty",
+	"predict_samples",
+	"scan_work",
+	"scan_seconds",
+	NULL
+};
+
+/* Whether tunable i of tunable_names[] is a double rather than an int64_t. */
+static int tunable_is_double(int i)
+{
+	return i == 1 || i == 4 || i == 8;
+}
+
+/* Sets tunable i of tunable_names[] to value. */
+void set_tunable(struct bsdiff_tunables *t, int i, tunable_value value)
+{
+	switch (i) {
+	case 0:
+		t->match_margin = value.i;
+		break;
+	case 1:
+		t->fulldl_ratio = value.d;
+		break;
+	case 2:
+		t->fulldl_min_size = value.i;
+		break;
+	case 3:
+		t->small_max = value.i;
+		break;
+	case 4:
+		t->bzip2_factor = value.d;
+		break;
+	case 5:
+		t->bzip2_penalty = value.i;
+		break;
+	case 6:
+		t->predict_samples = value.i;
+		break;
+	case 7:
+		t->scan_work = value.i;
+		break;
+	case 8:
+		t->scan_seconds = value.d;
+		break;
+	}
+}
+
+/* Parses a value for tunable i from the start of s, leaving *end after it.
+ * Returns -1 if there is no number there, or for an integer tunable, if it
+ * is not a whole number in the range of int64_t. */
+int parse_tunable_value(int i, const char *s, char **end, tunable_value *value)
+{
+	errno = 0;
+	if (tunable_is_double(i)) {
+		value->d = strtod(s, end);
+	} else {
+		value->i = strtoll(s, end, 10);
+	}
+	if (*end == s || errno == ERANGE) {
+		return -1;
+	}
+	return 0;
+}
+
+/* The index of name in tunable_names[], or -1. */
+int find_tunable(const char *name, size_t len)
+{
+	int i;
+
+	for (i = 0; tunable_names[i]; i++) {
+		if (strlen(tunable_names[i]) == len && strncmp(tunable_names[i], name, len) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Parses "NAME=VALUE" into t. Returns -1 for an unknown name or a value
+ * parse_tunable_value() rejects. */
+int parse_tunable(struct bsdiff_tunables *t, const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	tunable_value value;
+	char *end;
+	int i;
+
+	if (eq == NULL || (i = find_tunable(arg, eq - arg)) < 0) {
+		return -1;
+	}
+	if (parse_tunable_value(i, eq + 1, &end, &value) < 0 || *end != '\0') {
+		return -1;
+	}
+	set_tunable(t, i, value);
+
+	return 0;
+}
@@ -0,0 +1,289 @@
+/*
+ *   This file is part of bsdiff.
+ *
+ *      Copyright © 2012-2016 Intel Corporation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bsdiff.h"
+#include "programs.h"
+
+/* values swept per tunable */
+#define TUNE_MAX_VALUES 32
+
+typedef struct {
+	void *old;
+	size_t old_len;
+	void *new;
+	size_t new_len;
+} cpair;
+
+typedef struct {
+	struct bsdiff_tunables t;
+	uint64_t bytes;
+	double secs;
+	size_t fulldl;
+	size_t failed;
+} cpoint;
+
+static const struct option prog_opts[] = {
+	{"effort", required_argument, NULL, 'e'},
+	{"set", required_argument, NULL, 's'},
+	{NULL, 0, NULL, 0}
+};
+
+static void usage(char *name)
+{
+	int i;
+
+	printf("Usage: %s [OPTION]... manifest\n\n", name);
+	printf("Diffs every oldfile and newfile pair of MANIFEST, in the format of");
+	printf(" bsdiff --batch, in memory for each combination of the tunable");
+	printf(" values given, and reports the total delta size and diff time of");
+	printf(" each. A FULLDL delta, or a pair that fails to diff, counts as the");
+	printf(" size of its newfile. The");
+	printf(" combinations on the size/time Pareto front are marked with '*'.");
+	printf(" Delta file names in MANIFEST are ignored.\n\n");
+	printf("  -e, --effort=N         Effort level to diff at (default: 9)\n");
+	printf("  -s, --set=NAME=V1,...  Values to try for tunable NAME; the others\n");
+	printf("                         keep their defaults. NAME is one of:\n");
+	for (i = 0; tunable_names[i]; i++) {
+		printf("                           %s\n", tunable_names[i]);
+	}
+}
+
+static int load(char *path, void **buf, size_t *len)
+{
+	FILE *f;
+	long size;
+
+	*buf = NULL;
+	if ((f = fopen(path, "rb")) == NULL) {
+		return -1;
+	}
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET) != 0 || (*buf = malloc(size ? size : 1)) == NULL ||
+	    fread(*buf, 1, size, f) != (size_t)size) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	*len = size;
+
+	return 0;
+}
+
+/* Parses "NAME=V1,V2,..." into the values to sweep for that tunable. */
+static int parse_sweep(char *arg, tunable_value values[][TUNE_MAX_VALUES], int *nvalues)
+{
+	char *eq = strchr(arg, '='), *p, *end;
+	int i;
+
+	if (eq == NULL || (i = find_tunable(arg, eq - arg)) < 0) {
+		return -1;
+	}
+	nvalues[i] = 0;
+	for (p = eq + 1;; p = end + 1) {
+		if (nvalues[i] == TUNE_MAX_VALUES) {
+			return -1;
+		}
+		if (parse_tunable_value(i, p, &end, &values[i][nvalues[i]++]) < 0 ||
+		    (*end != ',' && *end != '\0')) {
+			return -1;
+		}
+		if (*end == '\0') {
+			return 0;
+		}
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Diffs every pair with the tunables of pt, and records the totals.
+ * Returns -1 if the tunables are out of range. */
+static int measure(bsdiff_ctx *ctx, cpair *pairs, size_t npairs, cpoint *pt)
+{
+	size_t i, len;
+	void *delta;
+	double start;
+	int ret;
+
+	if (bsdiff_ctx_set_tunables(ctx, &pt->t) < 0) {
+		return -1;
+	}
+	pt->bytes = 0;
+	pt->fulldl = 0;
+	pt->failed = 0;
+	start = now();
+	for (i = 0; i < npairs; i++) {
+		delta = NULL;
+		ret = bsdiff_ctx_diff_mem(ctx, pairs[i].old, pairs[i].old_len, pairs[i].new,
+					  pairs[i].new_len, &delta, &len);
+		free(delta);
+		if (ret < 0) {
+			pt->bytes += pairs[i].new_len;
+			pt->failed++;
+		} else if (ret == 1) {
+			pt->bytes += pairs[i].new_len;
+			pt->fulldl++;
+		} else {
+			pt->bytes += len;
+		}
+	}
+	pt->secs = now() - start;
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	tunable_value values[BSDIFF_TUNABLES][TUNE_MAX_VALUES];
+	int nvalues[BSDIFF_TUNABLES] = { 0 }, at[BSDIFF_TUNABLES] = { 0 };
+	struct bsdiff_job *jobs = NULL;
+	struct bsdiff_tunables def;
+	cpair *pairs = NULL;
+	cpoint *points = NULL;
+	size_t njobs = 0, npoints = 1, i, j;
+	int opt, effort = BSDIFF_EFFORT_MAX, k, front, ret = -EXIT_FAILURE;
+	bsdiff_ctx *ctx = NULL;
+
+	while ((opt = getopt_long(argc, argv, "e:s:", prog_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'e':
+			effort = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			if (parse_sweep(optarg, values, nvalues) < 0) {
+				printf("Bad tunable values: %s\n", optarg);
+				return -EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return -EXIT_FAILURE;
+		}
+	}
+	if (argc - optind != 1) {
+		usage(argv[0]);
+		return -EXIT_FAILURE;
+	}
+
+	/* unswept tunables take their one default value */
+	bsdiff_tunables_init(&def);
+	for (k = 0; tunable_names[k]; k++) {
+		npoints *= nvalues[k] ? nvalues[k] : 1;
+	}
+
+	if ((ctx = bsdiff_ctx_new()) == NULL || bsdiff_ctx_set_effort(ctx, effort) < 0) {
+		printf("Effort must be %d to %d\n", BSDIFF_EFFORT_MIN, BSDIFF_EFFORT_MAX);
+		goto out;
+	}
+	if (read_manifest(argv[optind], &jobs, &njobs) < 0) {
+		printf("Failed to read manifest %s\n", argv[optind]);
+		goto out;
+	}
+	if ((pairs = calloc(njobs + 1, sizeof(cpair))) == NULL ||
+	    (points = calloc(npoints, sizeof(cpoint))) == NULL) {
+		goto out;
+	}
+	for (i = 0; i < njobs; i++) {
+		if (load(jobs[i].old_filename, &pairs[i].old, &pairs[i].old_len) < 0 ||
+		    load(jobs[i].new_filename, &pairs[i].new, &pairs[i].new_len) < 0) {
+			printf("Failed to read %s or %s\n", jobs[i].old_filename,
+			       jobs[i].new_filename);
+			goto out;
+		}
+	}
+
+	/* every combination, the first tunable varying fastest */
+	for (i = 0; i < npoints; i++) {
+		points[i].t = def;
+		for (k = 0; tunable_names[k]; k++) {
+			if (nvalues[k]) {
+				set_tunable(&points[i].t, k, values[k][at[k]]);
+			}
+		}
+		if (measure(ctx, pairs, njobs, &points[i]) < 0) {
+			printf("Tunables out of range in combination %zu\n", i + 1);
+			goto out;
+		}
+		for (k = 0; tunable_names[k]; k++) {
+			if (nvalues[k] && ++at[k] < nvalues[k]) {
+				break;
+			}
+			at[k] = 0;
+		}
+	}
+
+	for (k = 0; tunable_names[k]; k++) {
+		printf("%s\t", tunable_names[k]);
+	}
+	printf("bytes\tseconds\tfulldl\tfailed\tfront\n");
+	for (i = 0; i < npoints; i++) {
+		front = 1;
+		for (j = 0; j < npoints; j++) {
+			if (points[j].bytes <= points[i].bytes && points[j].secs <= points[i].secs &&
+			    (points[j].bytes < points[i].bytes || points[j].secs < points[i].secs)) {
+				front = 0;
+				break;
+			}
+		}
+		printf("%lld\t%.2f\t%lld\t%lld\t%.2f\t%lld\t%lld\t%lld\t%.2f\t%llu\t%.3f\t%zu\t%zu\t%s\n",
+		       (long long)points[i].t.match_margin, points[i].t.fulldl_ratio,
+		       (long long)points[i].t.fulldl_min_size, (long long)points[i].t.small_max,
+		       points[i].t.bzip2_factor, (long long)points[i].t.bzip2_penalty,
+		       (long long)points[i].t.predict_samples, (long long)points[i].t.scan_work,
+		       points[i].t.scan_seconds,
+		       (unsigned long long)points[i].bytes, points[i].secs,
+		       points[i].fulldl, points[i].failed, front ? "*" : "");
+	}
+	ret = EXIT_SUCCESS;
+
+out:
+	if (pairs) {
+		for (i = 0; i < njobs; i++) {
+			free(pairs[i].old);
+			free(pairs[i].new);
+		}
+	}
+	free(pairs);
+	free(points);
+	free_manifest(jobs, njobs);
+	bsdiff_ctx_free(ctx);
+
+	return ret;
+}
@@ -0,0 +1,104 @@
+/*
+ *   This file is part of bsdiff.
+ *
+ *      Copyright © 2012-2016 Intel Corporation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* Test harness for bsio.c, which is built into it with BSIO_TEST_SHORT set:
+ * every completion is cut short, so each chunk of the reads and writes below
+ * is queued again until it is done. */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bsheader.h"
+
+/* several chunks and a partial one, more than the ring holds at once */
+#define TEST_SIZE (40 * 1024 * 1024 + 12345)
+
+int main(int argc, char *argv[])
+{
+	u_char *data, *buf;
+	bsio *io;
+	size_t i;
+	int fd;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s INFILE OUTFILE\n", argv[0]);
+		return 1;
+	}
+	/* a lost completion would wait forever */
+	alarm(60);
+
+	if ((data = malloc(TEST_SIZE)) == NULL || (buf = calloc(1, TEST_SIZE)) == NULL) {
+		return 1;
+	}
+	for (i = 0; i < TEST_SIZE; i++) {
+		data[i] = (u_char)(i * 2654435761u >> 13);
+	}
+
+	if ((io = bsio_open(buf, TEST_SIZE)) == NULL) {
+		printf("io_uring is not available; nothing to test\n");
+		return 0;
+	}
+
+	fd = open(argv[1], O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0 || pwrite(fd, data, TEST_SIZE, 0) != TEST_SIZE) {
+		return 1;
+	}
+	if (bsio_read(io, fd, buf, TEST_SIZE, 0) < 0 || bsio_wait(io) < 0) {
+		fprintf(stderr, "short reads failed\n");
+		return 1;
+	}
+	close(fd);
+	if (memcmp(buf, data, TEST_SIZE) != 0) {
+		fprintf(stderr, "short reads returned the wrong data\n");
+		return 1;
+	}
+
+	fd = open(argv[2], O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0) {
+		return 1;
+	}
+	if (bsio_write(io, fd, buf, TEST_SIZE, 0) < 0 || bsio_wait(io) < 0) {
+		fprintf(stderr, "short writes failed\n");
+		return 1;
+	}
+	memset(data, 0, TEST_SIZE);
+	if (pread(fd, data, TEST_SIZE, 0) != TEST_SIZE || memcmp(buf, data, TEST_SIZE) != 0) {
+		fprintf(stderr, "short writes stored the wrong data\n");
+		return 1;
+	}
+	close(fd);
+
+	bsio_close(io);
+	free(buf);
+	free(data);
+	return 0;
+}
@@ -6,7 +6,7 @@ cd $srcdir/test
 # number is incremented after running every test
 testnum=0
 
-sudo rm -f *.diff *.out
+sudo rm -rf *.diff *.out *.manifest *.tree *.part *.ckpt
 
 VALGRIND="valgrind -q"
 if [ -n "$SKIP_VALGRIND" ]; then
@@ -17,6 +17,8 @@ libdir="$abs_builddir/.libs"
 ldpath="LD_LIBRARY_PATH=$libdir"
 BSDIFF="sudo $ldpath $VALGRIND $libdir/bsdiff"
 BSPATCH="sudo $ldpath $VALGRIND $libdir/bspatch"
+BSDUMP="sudo $ldpath $VALGRIND $libdir/bsdump"
+BSTUNE="sudo $ldpath $VALGRIND $libdir/bstune"
 
 # If exit status is 0, the test succeeded. Else it failed.
 check_success() {
@@ -85,20 +87,15 @@ $BSPATCH data/13.bspatch.original 13.out 13.diff
 diff data/13.bspatch.modified 13.out
 check_success "output does not match expected!!"
 
-# Next a very loooong running test, but one which successfully condenses the 2MB
-# original file pair into a 26kB bsdiff.  The bsdiff computation alone (ie:
-# non-valgrind'd) takes ~20minutes on a decent build machine.  Running it
-# through valgrind takes many many hours to run to completion.  Therefore leave
-# filepair #14 as one for only occasional use in long-running regression
-# testing.  The other file pairs can be check quickly enough that they can be
-# used in a regression test run at every check-in of code changes to the bsdiff
-# implementation.
-#
-#echo "Running test #14 ..."
-#$BSDIFF data/14.bspatch.original data/14.bspatch.modified 14.diff any
-#$BSPATCH data/14.bspatch.original 14.out 14.diff
-#diff data/14.bspatch.modified 14.out
-#check_success "output does not match expected!!"
+# Next a test which condenses the 2MB original file pair into a 26kB bsdiff.
+# It used to take ~20 minutes, most of it searching the same long matches
+# over and over; the scan budget (scan_work) now turns the scan coarse
+# after a few seconds' work, which gives the same delta size.
+echo "Running test #14 ..."
+$BSDIFF data/14.bspatch.original data/14.bspatch.modified 14.diff any
+$BSPATCH data/14.bspatch.original 14.out 14.diff
+diff data/14.bspatch.modified 14.out
+check_success "output does not match expected!!"
 
 echo "Running test #15 ..."
 $BSDIFF data/15.bspatch.original data/15.bspatch.modified 15.diff any
@@ -110,5 +107,271 @@ echo "Running test #16 ..."
 $BSPATCH data/16.bspatch.original 16.out data/16.bspatch.diff
 check_success
 
+# new file is large enough for the threaded block decoders
+echo "Running test #17 ..."
+$BSDIFF data/17.bspatch.original data/17.bspatch.modified 17.diff any
+$BSPATCH data/17.bspatch.original 17.out 17.diff
+diff data/17.bspatch.modified 17.out
+check_success "output does not match expected!!"
+
+# reflink mode must not change the output, whatever the filesystem supports
+echo "Running test #18 ..."
+$BSPATCH --reflink data/17.bspatch.original 18.out 17.diff
+diff data/17.bspatch.modified 18.out
+check_success "output does not match expected!!"
+
+# sparse atomic output: long zero runs become holes, and a failed apply
+# leaves nothing behind
+echo "Running test #19 ..."
+{ head -c 1048576 /dev/zero; cat data/17.bspatch.modified; head -c 1048576 /dev/zero; } > 19.new &&
+	$BSDIFF data/17.bspatch.original 19.new 19.diff &&
+	$BSPATCH --sparse --atomic data/17.bspatch.original 19.out 19.diff &&
+	cmp 19.new 19.out &&
+	[ $(($(stat -c %b 19.out) * $(stat -c %B 19.out))) -lt $(stat -c %s 19.out) ] &&
+	head -c -5 19.diff > 19b.diff &&
+	! $BSPATCH --sparse --atomic data/17.bspatch.original 19b.out 19b.diff &&
+	[ -z "$(ls -A | grep '^19b\.out')" ]
+check_success "output does not match expected!!"
+
+# io_uring engine, or the blocking fallback where it is unavailable
+echo "Running test #20 ..."
+$BSDIFF --io-uring data/17.bspatch.original data/17.bspatch.modified 20.diff any
+$BSPATCH --io-uring data/17.bspatch.original 20.out 20.diff
+diff data/17.bspatch.modified 20.out
+check_success "output does not match expected!!"
+
+# batch mode, including a job that fails and one left to full download
+echo "Running test #21 ..."
+printf "data/17.bspatch.original data/17.bspatch.modified 21a.diff\n# comment\n\ndata/9.bspatch.original data/9.bspatch.modified 21b.diff\ndata/9.bspatch.original data/missing 21c.diff\ndata/5.bspatch.original data/5.bspatch.diff 21d.diff\n" > 21.manifest
+$BSDIFF --jobs 2 --batch 21.manifest any
+[ $? -eq 255 ] &&
+	$BSPATCH data/17.bspatch.original 21a.out 21a.diff &&
+	diff data/17.bspatch.modified 21a.out &&
+	$BSPATCH data/9.bspatch.original 21b.out 21b.diff &&
+	diff data/9.bspatch.modified 21b.out &&
+	[ ! -e 21c.diff ] &&
+	[ "$(head -c 8 21d.diff)" = "FULLV20U" ]
+check_success "batch output does not match expected!!"
+
+# batch apply, keeping the per-job return codes
+echo "Running test #22 ..."
+printf "data/17.bspatch.original 22a.out 21a.diff\ndata/9.bspatch.original 22b.out 21b.diff\ndata/5.bspatch.original 22d.out 21d.diff\n" > 22.manifest
+$BSPATCH --jobs 2 --batch 22.manifest | grep -q "Failed to apply delta (-2): 21d.diff" &&
+	diff data/17.bspatch.modified 22a.out &&
+	diff data/9.bspatch.modified 22b.out
+check_success "batch output does not match expected!!"
+
+# directory archive: changed, unchanged, new-only and nested files
+echo "Running test #23 ..."
+mkdir -p 23old.tree/sub 23new.tree/sub/new &&
+	cp data/17.bspatch.original 23old.tree/a &&
+	cp data/17.bspatch.modified 23new.tree/a &&
+	cp data/9.bspatch.original 23old.tree/sub/b &&
+	cp data/9.bspatch.modified 23new.tree/sub/b &&
+	cp data/12.bspatch.original 23old.tree/sub/c &&
+	cp data/12.bspatch.original 23new.tree/sub/c &&
+	cp data/5.bspatch.diff 23new.tree/sub/new/d &&
+	$BSDIFF 23old.tree 23new.tree 23.diff &&
+	[ "$(head -c 8 23.diff)" = "DIR_V20U" ]
+$BSPATCH 23old.tree 23out.tree 23.diff | grep -q "Full download: sub/new/d"
+[ $? -eq 0 ] &&
+	diff data/17.bspatch.modified 23out.tree/a &&
+	diff data/9.bspatch.modified 23out.tree/sub/b &&
+	diff data/12.bspatch.original 23out.tree/sub/c &&
+	[ -d 23out.tree/sub/new ] &&
+	[ ! -e 23out.tree/sub/new/d ]
+check_success "directory archive does not match expected!!"
+
+# streaming delta over more than one frame, applied from a pipe
+echo "Running test #24 ..."
+cat data/17.bspatch.original data/13.bspatch.original > 24.old.out &&
+	cat data/17.bspatch.modified data/13.bspatch.original > 24.new.out &&
+	$BSDIFF --stream 24.old.out 24.new.out 24.diff &&
+	[ "$(head -c 8 24.diff)" = "BSDIFF4S" ] &&
+	cat 24.diff | $BSPATCH 24.old.out 24.out - &&
+	diff 24.new.out 24.out &&
+	$BSPATCH 24.old.out 24b.out 24.diff &&
+	diff 24.new.out 24b.out
+check_success "streaming output does not match expected!!"
+
+# seekable delta: a range across the frame boundary, then the whole file
+echo "Running test #25 ..."
+$BSDIFF --seekable 24.old.out 24.new.out 25.diff &&
+	[ "$(head -c 8 25.diff)" = "BSDIFF4X" ] &&
+	$BSPATCH --extract 1048000:2000 24.old.out 25a.out 25.diff &&
+	tail -c +1048001 24.new.out | head -c 2000 | cmp - 25a.out &&
+	$BSPATCH 24.old.out 25.out 25.diff &&
+	diff 24.new.out 25.out
+check_success "seekable output does not match expected!!"
+
+# v3 header with block checksums; a damaged block is refused up front
+echo "Running test #26 ..."
+$BSDIFF --checksum data/17.bspatch.original data/17.bspatch.modified 26.diff &&
+	[ "$(head -c 8 26.diff)" = "BSDIFF4W" ] &&
+	$BSPATCH data/17.bspatch.original 26.out 26.diff &&
+	diff data/17.bspatch.modified 26.out &&
+	cp 26.diff 26b.diff &&
+	printf '\377' | dd of=26b.diff bs=1 seek=$(($(stat -c %s 26.diff) - 1)) conv=notrunc 2>/dev/null &&
+	! $BSPATCH data/17.bspatch.original 26b.out 26b.diff
+check_success "v3 checksums do not work as expected!!"
+
+# v3 header with a digest of the new file; --verify writes nothing
+echo "Running test #27 ..."
+cp data/17.bspatch.original 27.old.out &&
+	printf 'Q' | dd of=27.old.out bs=1 seek=100 conv=notrunc 2>/dev/null &&
+	$BSDIFF --digest=sha256 data/17.bspatch.original data/17.bspatch.modified 27.diff &&
+	[ "$($BSDUMP 27.diff | grep sha256 | cut -f2)" = "$(sha256sum < data/17.bspatch.modified | cut -d' ' -f1)" ] &&
+	$BSPATCH --verify data/17.bspatch.original 27.diff &&
+	$BSPATCH data/17.bspatch.original 27.out 27.diff &&
+	diff data/17.bspatch.modified 27.out &&
+	! $BSPATCH --verify 27.old.out 27.diff &&
+	! $BSPATCH 27.old.out 27b.out 27.diff &&
+	[ ! -e 27b.out ]
+check_success "new file digests do not work as expected!!"
+
+# old file digest and samples; a different base fails with -4 (252), as
+# does an old file of the wrong size for a stream or seekable delta
+echo "Running test #28 ..."
+$BSDIFF --old-digest --old-samples data/17.bspatch.original data/17.bspatch.modified 28.diff &&
+	$BSPATCH data/17.bspatch.original 28.out 28.diff &&
+	diff data/17.bspatch.modified 28.out &&
+	{ $BSPATCH 27.old.out 28b.out 28.diff; [ $? -eq 252 ]; } &&
+	[ ! -e 28b.out ] &&
+	{ $BSPATCH data/13.bspatch.original 28c.out 24.diff; [ $? -eq 252 ]; } &&
+	{ $BSPATCH --extract 0:100 data/13.bspatch.original 28d.out 25.diff; [ $? -eq 252 ]; }
+check_success "old file digests do not work as expected!!"
+
+# resumable apply: a cut off stream delta leaves a checkpoint that the
+# next run picks up from, or starts over from if it has another delta
+echo "Running test #29 ..."
+head -c -5 24.diff > 29.diff &&
+	! $BSPATCH --resume 24.old.out 29.out 29.diff &&
+	[ -e 29.out.part ] && [ -e 29.out.ckpt ] && [ ! -e 29.out ] &&
+	$BSPATCH --resume 24.old.out 29.out 24.diff &&
+	diff 24.new.out 29.out &&
+	[ ! -e 29.out.part ] && [ ! -e 29.out.ckpt ] &&
+	{ printf 'X'; tail -c +2 24.new.out; } > 29b.new &&
+	$BSDIFF --stream 24.old.out 29b.new 29b.diff &&
+	head -c -5 29b.diff > 29c.diff &&
+	! $BSPATCH -C 24.old.out 29b.out 29c.diff &&
+	[ -e 29b.out.ckpt ] &&
+	$BSPATCH -C 24.old.out 29b.out 24.diff &&
+	diff 24.new.out 29b.out &&
+	[ ! -e 29b.out.part ] && [ ! -e 29b.out.ckpt ]
+check_success "resumable apply does not work as expected!!"
+
+# windowed diff, forced on files smaller than a window
+echo "Running test #30 ..."
+$BSDIFF --windowed 24.old.out 24.new.out 30.diff &&
+	[ "$(head -c 8 30.diff)" = "BSDIFF4S" ] &&
+	$BSPATCH 24.old.out 30.out 30.diff &&
+	diff 24.new.out 30.out &&
+	$BSDIFF --windowed --seekable 24.old.out 24.new.out 30b.diff &&
+	$BSPATCH 24.old.out 30b.out 30b.diff &&
+	diff 24.new.out 30b.out
+check_success "windowed diff does not work as expected!!"
+
+# suffix array sorted on disk, which must give the same delta
+echo "Running test #31 ..."
+$BSDIFF 24.old.out 24.new.out 31a.diff &&
+	$BSDIFF --sort-mem=1 --scratch=. 24.old.out 24.new.out 31.diff &&
+	cmp 31a.diff 31.diff &&
+	! ls bsdiff-sort.* 2> /dev/null &&
+	$BSPATCH 24.old.out 31.out 31.diff &&
+	diff 24.new.out 31.out
+check_success "on-disk suffix sort does not work as expected!!"
+
+# fast hash-anchored engine, whose deltas are ordinary ones
+echo "Running test #32 ..."
+$BSDIFF --fast data/17.bspatch.original data/17.bspatch.modified 32.diff &&
+	[ "$(head -c 8 32.diff)" = "BSDIFF4U" ] &&
+	$BSPATCH data/17.bspatch.original 32.out 32.diff &&
+	diff data/17.bspatch.modified 32.out &&
+	$BSDIFF --fast --windowed 24.old.out 24.new.out 32b.diff &&
+	$BSPATCH 24.old.out 32b.out 32b.diff &&
+	diff 24.new.out 32b.out
+check_success "fast diff does not work as expected!!"
+
+# effort levels; the top one is the default
+echo "Running test #33 ..."
+$BSDIFF --effort=1 data/17.bspatch.original data/17.bspatch.modified 33a.diff &&
+	$BSPATCH data/17.bspatch.original 33a.out 33a.diff &&
+	diff data/17.bspatch.modified 33a.out &&
+	$BSDIFF --effort=6 data/17.bspatch.original data/17.bspatch.modified 33b.diff &&
+	$BSPATCH data/17.bspatch.original 33b.out 33b.diff &&
+	diff data/17.bspatch.modified 33b.out &&
+	$BSDIFF --effort=9 data/17.bspatch.original data/17.bspatch.modified 33c.diff &&
+	$BSDIFF data/17.bspatch.original data/17.bspatch.modified 33d.diff &&
+	cmp 33c.diff 33d.diff &&
+	! $BSDIFF --effort=10 data/17.bspatch.original data/17.bspatch.modified 33e.diff
+check_success "effort levels do not work as expected!!"
+
+# tunables: a sweep over two pairs, two values and two combinations
+echo "Running test #34 ..."
+printf "data/17.bspatch.original data/17.bspatch.modified -\ndata/9.bspatch.original data/9.bspatch.modified -\n" > 34.manifest
+$BSTUNE --set match_margin=8,16 --set fulldl_ratio=0.9 34.manifest > 34.out &&
+	[ $(wc -l < 34.out) -eq 3 ] &&
+	grep -q "^8	0.90	200	65536	1.05	512	1024	64	0.00	$(($(stat -c %s 21a.diff) + $(stat -c %s 21b.diff)))	" 34.out &&
+	grep -q "\*$" 34.out &&
+	$BSDIFF --tune match_margin=16 data/17.bspatch.original data/17.bspatch.modified 34.diff &&
+	$BSPATCH data/17.bspatch.original 34b.out 34.diff &&
+	diff data/17.bspatch.modified 34b.out &&
+	! $BSDIFF --tune small_max=70000 data/17.bspatch.original data/17.bspatch.modified 34c.diff &&
+	! $BSDIFF --tune small_max=1e30 data/17.bspatch.original data/17.bspatch.modified 34d.diff &&
+	! $BSDIFF --tune fulldl_min_size=0.5 data/17.bspatch.original data/17.bspatch.modified 34e.diff &&
+	! $BSTUNE --set scan_work=99999999999999999999 34.manifest > 34c.out
+check_success "tunables do not work as expected!!"
+
+# a new file with nothing in common with the old one is FULLDL before
+# sorting, the same as after a full diff; one with dense small edits is not
+echo "Running test #35 ..."
+head -c 262144 /dev/urandom > 35.new
+$BSDIFF --stats 24.old.out 35.new 35a.diff > 35a.out
+[ $? -eq 1 ] &&
+	[ "$(head -c 8 35a.diff)" = "FULLV20U" ] &&
+	grep -q "^Early FULLDL:  1 of 1$" 35a.out &&
+	! $BSDIFF --stats --tune predict_samples=0 24.old.out 35.new 35b.diff > 35b.out &&
+	cmp 35a.diff 35b.diff &&
+	grep -q "^Early FULLDL:  0 of 1$" 35b.out &&
+	head -c 1048576 /dev/urandom > 35c.old &&
+	perl -0777 -pe 'for ($i = 0; $i < length; $i += 12) { substr($_, $i, 1) = chr((ord(substr($_, $i, 1)) + 1) & 255) }' 35c.old > 35c.new &&
+	$BSDIFF --stats 35c.old 35c.new 35c.diff > 35c.out &&
+	[ "$(head -c 8 35c.diff)" = "BSDIFF4U" ] &&
+	grep -q "^Early FULLDL:  0 of 0$" 35c.out &&
+	$BSPATCH 35c.old 35c.out.new 35c.diff &&
+	cmp 35c.new 35c.out.new
+check_success "early FULLDL does not work as expected!!"
+
+# scan budgets: pair 14 runs out of scan work, and a tiny time limit cuts
+# the scan short, which still gives a delta that applies
+echo "Running test #36 ..."
+$BSDIFF --stats data/14.bspatch.original data/14.bspatch.modified 36a.diff > 36a.out &&
+	grep -q "^Coarse scans:  1, 0 cut short$" 36a.out &&
+	$BSDIFF --stats --tune scan_seconds=0.000001 data/14.bspatch.original data/14.bspatch.modified 36b.diff raw > 36b.out &&
+	grep -q ", 1 cut short$" 36b.out &&
+	$BSPATCH data/14.bspatch.original 36b.new 36b.diff &&
+	diff data/14.bspatch.modified 36b.new
+check_success "scan budgets do not work as expected!!"
+
+# optimal parse: smaller than the scan's delta on pair 13, and applies
+# as a stream too
+echo "Running test #37 ..."
+$BSDIFF data/13.bspatch.original data/13.bspatch.modified 37a.diff &&
+	$BSDIFF --optimal --stats data/13.bspatch.original data/13.bspatch.modified 37b.diff > 37b.out &&
+	grep -q "^Reparsed:      1$" 37b.out &&
+	[ $(stat -c %s 37b.diff) -lt $(stat -c %s 37a.diff) ] &&
+	$BSPATCH data/13.bspatch.original 37b.new 37b.diff &&
+	diff data/13.bspatch.modified 37b.new &&
+	$BSDIFF --optimal --stream data/17.bspatch.original data/17.bspatch.modified 37c.diff &&
+	$BSPATCH data/17.bspatch.original 37c.new 37c.diff &&
+	diff data/17.bspatch.modified 37c.new
+check_success "optimal parse does not work as expected!!"
+
+# io_uring with every transfer cut short, so each chunk is queued again for
+# its rest; without liburing there is nothing to cut short
+echo "Running test #38 ..."
+$abs_builddir/test/bsio_short 38a.out 38b.out
+check_success "short io_uring transfers do not work as expected!!"
+
 # For TAP support, output the plan
 echo "1..${testnum}"